@@ -0,0 +1,191 @@
+
+//          Copyright Andrey Lifanov 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// One writer and several readers on the same hierarchy: a global mutex, a global shared mutex
+// and per-composite locking of `concurrent_composite`.
+//
+// Usage: composite_object_contention_bench [readers] [milliseconds]
+// Prints CSV: mode,readers,reads_per_second,writes_per_second
+
+#include "composite_object.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <shared_mutex>
+
+
+namespace
+{
+    class bench_interface
+    {
+    public:
+        virtual int get_value() const = 0;
+        virtual void set_value(int val) = 0;
+    };
+
+    using bench_abstract = composite_object::abstract<bench_interface, composite_object::default_pointer_model>;
+
+    class bench_node : public bench_abstract
+    {
+    public:
+        int get_value() const override
+        {
+            return value;
+        }
+
+        void set_value(int val) override
+        {
+            value = val;
+        }
+
+    private:
+        int value{ 0 };
+    };
+
+    using bench_leaf = composite_object::leaf<bench_node>;
+    using smart_ptr = bench_abstract::smart_ptr;
+
+    const int dirs = 64;
+    const int leaves_per_dir = 64;
+
+
+    struct global_mutex
+    {
+        static const char *name() { return "global_mutex"; }
+
+        template <class Func>
+        void read(Func func) { std::lock_guard<std::mutex> guard(mutex); func(); }
+
+        template <class Func>
+        void write(Func func) { std::lock_guard<std::mutex> guard(mutex); func(); }
+
+        std::mutex mutex;
+    };
+
+    struct global_shared_mutex
+    {
+        static const char *name() { return "global_shared_mutex"; }
+
+        template <class Func>
+        void read(Func func) { std::shared_lock<std::shared_timed_mutex> guard(mutex); func(); }
+
+        template <class Func>
+        void write(Func func) { std::unique_lock<std::shared_timed_mutex> guard(mutex); func(); }
+
+        std::shared_timed_mutex mutex;
+    };
+
+    struct per_composite
+    {
+        static const char *name() { return "concurrent_composite"; }
+
+        template <class Func>
+        void read(Func func) { func(); }
+
+        template <class Func>
+        void write(Func func) { func(); }
+    };
+
+
+    template <class Composite, class Locking>
+    void run(const unsigned readers, const std::chrono::milliseconds duration)
+    {
+        Composite root;
+        std::vector<Composite*> dir;
+        for (int i = 0; i < dirs; ++i)
+        {
+            dir.push_back(new Composite());
+            root.push_back(smart_ptr(dir.back()));
+            for (int j = 0; j < leaves_per_dir; ++j)
+            {
+                dir.back()->push_back(smart_ptr(new bench_leaf()));
+                dir.back()->rbegin()->get()->set_value(j);
+            }
+        }
+
+        Locking locking;
+        std::atomic<bool> done{ false };
+        std::atomic<size_t> reads{ 0 };
+        long long checksum = 0;
+
+        std::vector<std::thread> threads;
+        for (unsigned r = 0; r < readers; ++r)
+        {
+            threads.emplace_back([&, r]()
+            {
+                std::minstd_rand random(r + 1);
+                size_t count = 0;
+                long long sum = 0;
+                while (!done.load(std::memory_order_relaxed))
+                {
+                    Composite *target = dir[random() % dirs];
+                    locking.read([&]()
+                    {
+                        for (auto it = target->cbegin(); it != target->cend(); ++it)
+                        {
+                            sum += (*it)->get_value();
+                        }
+                    });
+                    ++count;
+                }
+                reads += count;
+                locking.write([&]() { checksum += sum; });
+            });
+        }
+
+        // A starved writer must not keep the benchmark running, so the main thread stops it.
+        std::atomic<size_t> writes{ 0 };
+        threads.emplace_back([&]()
+        {
+            std::minstd_rand random(0);
+            while (!done.load(std::memory_order_relaxed))
+            {
+                Composite *target = dir[random() % dirs];
+                const int value = static_cast<int>(random() % leaves_per_dir);
+                locking.write([&]()
+                {
+                    auto added = new bench_leaf();
+                    added->set_value(value);
+                    target->push_back(smart_ptr(added));
+                    auto pred = [added](const smart_ptr &obj) { return obj.get() == added; };
+                    target->remove_if(pred);
+                });
+                ++writes;
+            }
+        });
+
+        const auto start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(duration);
+        done = true;
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::printf("%s,%u,%.0f,%.0f\n", Locking::name(), readers, reads / seconds, writes.load() / seconds);
+        std::fflush(stdout);
+        (void)checksum;
+    }
+}
+
+
+int main(int argc, char *args[])
+{
+    const unsigned hardware = std::max(2u, std::thread::hardware_concurrency());
+    const unsigned readers = argc > 1 ? static_cast<unsigned>(std::atoi(args[1])) : hardware - 1;
+    const std::chrono::milliseconds duration(argc > 2 ? std::atoi(args[2]) : 1000);
+
+    using plain = composite_object::composite<bench_node>;
+    using concurrent = composite_object::concurrent_composite<bench_node>;
+
+    std::printf("mode,readers,reads_per_second,writes_per_second\n");
+    run<plain, global_mutex>(readers, duration);
+    run<plain, global_shared_mutex>(readers, duration);
+    run<concurrent, per_composite>(readers, duration);
+    return 0;
+}
@@ -0,0 +1,172 @@
+//          Copyright Andrey Lifanov 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Whole-hierarchy operations on a degenerate chain, a single wide composite and a balanced
+// binary tree of the same size. For the shapes whose depth the call stack survives, the size is
+// also computed by the recursive algorithm `nested_hierarchy_size` had before it became iterative:
+// one virtual call per child, reached through the composite's polymorphic iterators.
+//
+// Usage: composite_object_deep_chain_bench [nodes]
+// Prints CSV: shape,nodes,operation,milliseconds
+
+#include "composite_object.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+
+namespace
+{
+    class bench_interface
+    {
+    public:
+        virtual int get_value() const = 0;
+        virtual void set_value(int val) = 0;
+        virtual size_t recursive_nested_hierarchy_size() const = 0;
+    };
+
+    using bench_abstract = composite_object::abstract<bench_interface, composite_object::default_pointer_model>;
+
+    class bench_node : public bench_abstract
+    {
+    public:
+        int get_value() const override
+        {
+            return value;
+        }
+
+        void set_value(int val) override
+        {
+            value = val;
+        }
+
+        size_t recursive_nested_hierarchy_size() const override
+        {
+            return 0;
+        }
+
+    private:
+        int value{ 0 };
+    };
+
+    using bench_leaf = composite_object::leaf<bench_node>;
+    using smart_ptr = bench_abstract::smart_ptr;
+
+    class bench_composite : public composite_object::composite<bench_node>
+    {
+        using parent = composite_object::composite<bench_node>;
+
+    public:
+        bench_composite()
+        {
+        }
+
+        bench_composite(const bench_composite &another) :
+            parent(another)
+        {
+        }
+
+        raw_pointer_to_base_interface clone() const override
+        {
+            return new bench_composite(*this);
+        }
+
+        // `nested_hierarchy_size` of the recursive version.
+        size_t recursive_nested_hierarchy_size() const override
+        {
+            size_t count = size();
+            for (auto it = cbegin(); it != cend(); ++it)
+            {
+                count += (*it)->recursive_nested_hierarchy_size();
+            }
+
+            return count;
+        }
+    };
+
+
+    void build_chain(bench_composite &root, const size_t nodes)
+    {
+        bench_abstract *current = &root;
+        for (size_t i = 0; i < nodes; ++i)
+        {
+            current->push_back(smart_ptr(new bench_composite()));
+            current = current->rbegin()->get();
+        }
+    }
+
+    void build_wide(bench_composite &root, const size_t nodes)
+    {
+        for (size_t i = 0; i < nodes; ++i)
+        {
+            root.push_back(smart_ptr(new bench_leaf()));
+        }
+    }
+
+    void build_balanced(bench_composite &root, const size_t nodes)
+    {
+        std::vector<bench_abstract*> level{ &root };
+        size_t built = 0;
+        for (size_t i = 0; built < nodes; ++i)
+        {
+            level.push_back(new bench_composite());
+            level[i]->push_back(smart_ptr(level.back()));
+            ++built;
+            if (built < nodes)
+            {
+                level.push_back(new bench_composite());
+                level[i]->push_back(smart_ptr(level.back()));
+                ++built;
+            }
+        }
+    }
+
+    template <class Func>
+    void measure(const char *shape, const size_t nodes, const char *operation, Func func)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        func();
+        const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::printf("%s,%zu,%s,%.2f\n", shape, nodes, operation, milliseconds);
+        std::fflush(stdout);
+    }
+
+    template <class Build>
+    void run(const char *shape, const size_t nodes, Build build, const bool recursion_fits)
+    {
+        std::unique_ptr<bench_composite> root(new bench_composite());
+        measure(shape, nodes, "build", [&]() { build(*root, nodes); });
+
+        size_t size = 0;
+        measure(shape, nodes, "nested_hierarchy_size", [&]() { size = root->nested_hierarchy_size(); });
+        if (recursion_fits)
+        {
+            measure(shape, nodes, "recursive_nested_hierarchy_size", [&]() { size += root->recursive_nested_hierarchy_size(); });
+        }
+
+        std::unique_ptr<bench_composite> copy;
+        measure(shape, nodes, "copy", [&]() { copy.reset(new bench_composite(*root)); });
+        measure(shape, nodes, "destroy_copy", [&]() { copy.reset(); });
+
+        auto none = [](const smart_ptr &) { return false; };
+        measure(shape, nodes, "remove_if_none", [&]() { root->remove_if(none); });
+
+        auto all = [](const smart_ptr &) { return true; };
+        measure(shape, nodes, "remove_if_all", [&]() { root->remove_if(all); });
+        (void)size;
+    }
+}
+
+
+int main(int argc, char *args[])
+{
+    const size_t nodes = argc > 1 ? static_cast<size_t>(std::atoll(args[1])) : 1000000;
+
+    std::printf("shape,nodes,operation,milliseconds\n");
+    run("chain", nodes, build_chain, false);
+    run("wide", nodes, build_wide, true);
+    run("balanced", nodes, build_balanced, true);
+    return 0;
+}
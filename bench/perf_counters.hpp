@@ -0,0 +1,183 @@
+//          Copyright Andrey Lifanov 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+
+namespace bench
+{
+
+// Hardware counters of the calling thread through Linux `perf_event_open`, user space only.
+// Counters the kernel, the CPU or the permissions do not provide stay unavailable, and on other
+// systems all of them are; `start()` and `stop()` are no-ops for unavailable counters.
+// Values are scaled when the kernel multiplexes the counters.
+class perf_counters
+{
+public:
+    enum counter
+    {
+        cycles,
+        instructions,
+        l1d_misses,
+        llc_misses,
+        branch_misses,
+        count
+    };
+
+    static const char *name(const counter which)
+    {
+        static const char *names[count] = { "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses" };
+        return names[which];
+    }
+
+    perf_counters()
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            fds[i] = open(static_cast<counter>(i));
+            values[i] = 0;
+        }
+    }
+
+    perf_counters(const perf_counters &) = delete;
+    perf_counters &operator=(const perf_counters &) = delete;
+
+    ~perf_counters()
+    {
+#ifdef __linux__
+        for (int fd : fds)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    bool available(const counter which) const noexcept
+    {
+        return fds[which] >= 0;
+    }
+
+    bool any_available() const noexcept
+    {
+        for (int fd : fds)
+        {
+            if (fd >= 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        for (int fd : fds)
+        {
+            if (fd >= 0)
+            {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    void stop()
+    {
+#ifdef __linux__
+        for (int i = 0; i < count; ++i)
+        {
+            if (fds[i] >= 0)
+            {
+                ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            values[i] = 0;
+            std::uint64_t data[3];
+            if (fds[i] >= 0 && read(fds[i], data, sizeof(data)) == static_cast<ssize_t>(sizeof(data)) && data[2] > 0)
+            {
+                // value, time enabled, time running
+                values[i] = data[2] < data[1] ? static_cast<std::uint64_t>(static_cast<double>(data[0]) * data[1] / data[2]) : data[0];
+            }
+        }
+#endif
+    }
+
+    // The count between the last `start()` and `stop()`.
+    std::uint64_t value(const counter which) const noexcept
+    {
+        return values[which];
+    }
+
+private:
+    static int open(const counter which)
+    {
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        const auto cache_read_miss = [](const std::uint64_t cache)
+        {
+            return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        };
+
+        switch (which)
+        {
+        case cycles:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case instructions:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case l1d_misses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cache_read_miss(PERF_COUNT_HW_CACHE_L1D);
+            break;
+        case llc_misses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cache_read_miss(PERF_COUNT_HW_CACHE_LL);
+            break;
+        default:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        }
+
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+        (void)which;
+        return -1;
+#endif
+    }
+
+private:
+    int fds[count];
+    std::uint64_t values[count];
+};
+
+}
@@ -0,0 +1,466 @@
+//          Copyright Andrey Lifanov 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Benchmark suite over wide, deep, balanced and random hierarchies from 1k nodes up to
+// `max_nodes`: construction, hierarchical traversals, `nested_hierarchy_size`, `clone`,
+// `remove_if` in every references mode and `relocate_to`. Shapes are generated from fixed
+// seeds without standard distributions, so every platform measures the same trees.
+// Every 16th leaf is a reference to the previous leaf.
+//
+// Usage: composite_object_bench [max_nodes] [repetitions] [filter] [perf]
+// Runs the benchmarks whose name contains `filter`.
+// Prints CSV: benchmark,shape,nodes,operations,repetitions,median_ms,min_ms,ns_per_operation
+// With `perf` it also reads hardware counters through `perf_event_open` and appends their mean
+// per operation over the repetitions: cycles, instructions, l1d_misses, llc_misses, branch_misses.
+// For traversals an operation is a visited node. Counters the system does not provide are left empty.
+
+#include "composite_object.hpp"
+#include "perf_counters.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+
+namespace
+{
+    class bench_interface
+    {
+    public:
+        virtual int get_value() const = 0;
+        virtual void set_value(int val) = 0;
+    };
+
+    using bench_abstract = composite_object::abstract<bench_interface, composite_object::default_pointer_model>;
+
+    class bench_node : public bench_abstract
+    {
+    public:
+        int get_value() const override
+        {
+            return value;
+        }
+
+        void set_value(int val) override
+        {
+            value = val;
+        }
+
+    private:
+        int value{ 0 };
+    };
+
+    using bench_leaf = composite_object::leaf<bench_node>;
+    using bench_composite = composite_object::composite<bench_node>;
+    using smart_ptr = bench_abstract::smart_ptr;
+
+    class bench_null_reference : public composite_object::null_reference<bench_abstract>
+    {
+    public:
+        int get_value() const override
+        {
+            return 0;
+        }
+
+        void set_value(int) override
+        {
+        }
+
+        raw_pointer_to_base_interface clone() const override
+        {
+            return new bench_null_reference(*this);
+        }
+    };
+
+    class bench_reference : public bench_abstract::reference
+    {
+    public:
+        explicit bench_reference(const smart_ptr &source) :
+            bench_abstract::reference(source)
+        {
+        }
+
+        null_reference_type *obtain_null_reference() override
+        {
+            static bench_null_reference obj;
+            return &obj;
+        }
+
+        int get_value() const override
+        {
+            return ptr->get_value();
+        }
+
+        void set_value(int val) override
+        {
+            ptr->set_value(val);
+        }
+
+        raw_pointer_to_base_interface clone() const override
+        {
+            return new bench_reference(*this);
+        }
+    };
+
+
+    enum class shape
+    {
+        wide,
+        deep,
+        balanced,
+        random
+    };
+
+    const char *shape_name(const shape value)
+    {
+        switch (value)
+        {
+        case shape::wide: return "wide";
+        case shape::deep: return "deep";
+        case shape::balanced: return "balanced";
+        default: return "random";
+        }
+    }
+
+    // Appends `nodes` nodes below `root`.
+    class builder
+    {
+    public:
+        explicit builder(bench_composite &root) :
+            composites{ &root }
+        {
+        }
+
+        bench_abstract *add_composite(bench_abstract *parent)
+        {
+            parent->push_back(smart_ptr(new bench_composite()));
+            auto node = parent->rbegin()->get();
+            node->set_value(static_cast<int>(count++));
+            composites.push_back(node);
+            return node;
+        }
+
+        void add_leaf(bench_abstract *parent)
+        {
+            if (++leaves % 16 == 0 && last_leaf)
+            {
+                parent->push_back(smart_ptr(new bench_reference(*last_leaf)));
+            }
+            else
+            {
+                parent->push_back(smart_ptr(new bench_leaf()));
+                parent->rbegin()->get()->set_value(static_cast<int>(count));
+                last_leaf = &*parent->rbegin();
+            }
+            ++count;
+        }
+
+        void build(const shape kind, const size_t nodes)
+        {
+            switch (kind)
+            {
+            case shape::wide:
+                while (count < nodes)
+                {
+                    add_leaf(composites.front());
+                }
+                break;
+
+            case shape::deep:
+                // A chain of composites, each also holding one leaf.
+                for (auto parent = composites.front(); count < nodes; )
+                {
+                    add_leaf(parent);
+                    if (count < nodes)
+                    {
+                        parent = add_composite(parent);
+                    }
+                }
+                break;
+
+            case shape::balanced:
+                // Node `j` (the root is 0) is a child of `(j - 1) / 4` and a composite if it has children.
+                for (size_t j = 1; j <= nodes; ++j)
+                {
+                    auto parent = composites[(j - 1) / 4];
+                    if (4 * j + 1 <= nodes)
+                    {
+                        add_composite(parent);
+                    }
+                    else
+                    {
+                        add_leaf(parent);
+                    }
+                }
+                break;
+
+            case shape::random:
+            {
+                // A quarter of the nodes are composites, attached below uniformly chosen composites.
+                std::minstd_rand random(42);
+                while (count < nodes)
+                {
+                    auto parent = composites[random() % composites.size()];
+                    if (random() % 4 == 0)
+                    {
+                        add_composite(parent);
+                    }
+                    else
+                    {
+                        add_leaf(parent);
+                    }
+                }
+                break;
+            }
+            }
+        }
+
+    private:
+        std::vector<bench_abstract*> composites;
+        const smart_ptr *last_leaf{ nullptr };
+        size_t count{ 0 };
+        size_t leaves{ 0 };
+    };
+
+
+    struct result
+    {
+        double median_ms;
+        double min_ms;
+        // Summed over the repetitions.
+        std::uint64_t events[bench::perf_counters::count];
+    };
+
+    // `prepare()` runs untimed before every repetition, `func()` is timed and counted by `counters` if any.
+    template <class Prepare, class Func>
+    result measure(const unsigned repetitions, bench::perf_counters *counters, Prepare prepare, Func func)
+    {
+        result res{};
+        std::vector<double> times;
+        for (unsigned i = 0; i < repetitions; ++i)
+        {
+            prepare();
+            if (counters)
+            {
+                counters->start();
+            }
+            const auto start = std::chrono::steady_clock::now();
+            func();
+            times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            if (counters)
+            {
+                counters->stop();
+                for (int j = 0; j < bench::perf_counters::count; ++j)
+                {
+                    res.events[j] += counters->value(static_cast<bench::perf_counters::counter>(j));
+                }
+            }
+        }
+        std::sort(times.begin(), times.end());
+        res.median_ms = times[times.size() / 2];
+        res.min_ms = times.front();
+        return res;
+    }
+
+    volatile long long sink = 0;
+
+    class suite
+    {
+    public:
+        suite(const unsigned repetitions, std::string filter, bench::perf_counters *counters) :
+            repetitions(repetitions), filter(std::move(filter)), counters(counters)
+        {
+        }
+
+        void print_header() const
+        {
+            std::printf("benchmark,shape,nodes,operations,repetitions,median_ms,min_ms,ns_per_operation");
+            if (counters)
+            {
+                for (int i = 0; i < bench::perf_counters::count; ++i)
+                {
+                    std::printf(",%s_per_operation", bench::perf_counters::name(static_cast<bench::perf_counters::counter>(i)));
+                }
+            }
+            std::printf("\n");
+        }
+
+        void run(const shape kind, const size_t nodes)
+        {
+            current_shape = kind;
+            current_nodes = nodes;
+
+            std::unique_ptr<bench_composite> root;
+            report("push_back", nodes,
+                [&]() { root.reset(new bench_composite()); },
+                [&]() { builder(*root).build(kind, nodes); });
+            if (!root || root->empty())
+            {
+                root.reset(new bench_composite());
+                builder(*root).build(kind, nodes);
+            }
+            auto &tree = *root;
+            const bench_composite &const_tree = tree;
+            visited = 0;
+            for (auto it = tree.df_pre_order_begin(); it != tree.df_pre_order_end(); ++it)
+            {
+                ++visited;
+            }
+
+            traverse("df_pre_order", [&]() { return sum(tree.df_pre_order_begin(), tree.df_pre_order_end()); });
+            traverse("cdf_pre_order", [&]() { return sum(const_tree.cdf_pre_order_begin(), const_tree.cdf_pre_order_end()); });
+            traverse("rdf_pre_order", [&]() { return sum(tree.rdf_pre_order_begin(), tree.rdf_pre_order_end()); });
+            traverse("crdf_pre_order", [&]() { return sum(const_tree.crdf_pre_order_begin(), const_tree.crdf_pre_order_end()); });
+            traverse("df_post_order", [&]() { return sum(tree.df_post_order_begin(), tree.df_post_order_end()); });
+            traverse("cdf_post_order", [&]() { return sum(const_tree.cdf_post_order_begin(), const_tree.cdf_post_order_end()); });
+            traverse("rdf_post_order", [&]() { return sum(tree.rdf_post_order_begin(), tree.rdf_post_order_end()); });
+            traverse("crdf_post_order", [&]() { return sum(const_tree.crdf_post_order_begin(), const_tree.crdf_post_order_end()); });
+            traverse("bf", [&]() { return sum(tree.bf_begin(), tree.bf_end()); });
+            traverse("cbf", [&]() { return sum(const_tree.cbf_begin(), const_tree.cbf_end()); });
+            traverse("rbf", [&]() { return sum(tree.rbf_begin(), tree.rbf_end()); });
+            traverse("crbf", [&]() { return sum(const_tree.crbf_begin(), const_tree.crbf_end()); });
+
+            report("nested_hierarchy_size", nodes, []() {}, [&]() { sink += tree.nested_hierarchy_size(); });
+
+            std::unique_ptr<bench_abstract> copy;
+            report("clone", nodes, [&]() { copy.reset(); }, [&]() { copy.reset(tree.clone()); });
+            report("destroy", nodes, [&]() { copy.reset(tree.clone()); }, [&]() { copy.reset(); });
+
+            // Every 10th node, with its subtree.
+            auto pred = [](const smart_ptr &obj) { return obj->get_value() % 10 == 0; };
+            std::unique_ptr<bench_composite> target;
+            auto fresh_copy = [&]() { target.reset(); target.reset(static_cast<bench_composite*>(tree.clone())); };
+            report("remove_if_do_not_track_references", nodes, fresh_copy,
+                [&]() { target->remove_if(pred, bench_composite::do_not_track_references); });
+            report("remove_if_remove_references", nodes, fresh_copy,
+                [&]() { target->remove_if(pred, bench_composite::remove_references); });
+            report("remove_if_nullify_references", nodes, fresh_copy,
+                [&]() { target->remove_if(pred, bench_composite::nullify_references); });
+            target.reset();
+
+            relocate(tree);
+        }
+
+    private:
+        template <class Iterator>
+        static long long sum(Iterator first, Iterator last)
+        {
+            long long total = 0;
+            for (; first != last; ++first)
+            {
+                total += (*first)->get_value();
+            }
+            return total;
+        }
+
+        template <class Func>
+        void traverse(const char *name, Func func)
+        {
+            report(name, visited, []() {}, [&]() { sink += func(); });
+        }
+
+        // Moves up to 100 leaves, spread evenly over the pre-order, into another composite.
+        void relocate(const bench_composite &tree)
+        {
+            std::unique_ptr<bench_composite> target;
+            bench_composite destination;
+            std::vector<bench_abstract*> moved;
+            const size_t operations = std::min<size_t>(100, current_nodes);
+            auto prepare = [&]()
+            {
+                destination.clear();
+                destination.push_back(smart_ptr(new bench_composite()));
+                target.reset(static_cast<bench_composite*>(tree.clone()));
+                moved.clear();
+                std::vector<bench_abstract*> leaves;
+                for (auto it = target->df_pre_order_begin(); it != target->df_pre_order_end(); ++it)
+                {
+                    if ((*it)->is_leaf() && !(*it)->is_reference())
+                    {
+                        leaves.push_back(it->get());
+                    }
+                }
+                for (size_t i = 0; i < operations && i < leaves.size(); ++i)
+                {
+                    moved.push_back(leaves[i * leaves.size() / operations]);
+                }
+            };
+            report("relocate_to", operations, prepare, [&]()
+            {
+                for (auto node : moved)
+                {
+                    node->relocate_to(*destination.begin());
+                }
+            });
+        }
+
+        template <class Prepare, class Func>
+        void report(const char *name, const size_t operations, Prepare prepare, Func func)
+        {
+            if (std::string(name).find(filter) == std::string::npos)
+            {
+                return;
+            }
+            const auto timing = measure(repetitions, counters, prepare, func);
+            std::printf("%s,%s,%zu,%zu,%u,%.3f,%.3f,%.1f", name, shape_name(current_shape), current_nodes, operations,
+                repetitions, timing.median_ms, timing.min_ms, operations ? timing.median_ms * 1e6 / operations : 0.0);
+            if (counters)
+            {
+                for (int i = 0; i < bench::perf_counters::count; ++i)
+                {
+                    if (counters->available(static_cast<bench::perf_counters::counter>(i)) && operations)
+                    {
+                        std::printf(",%.3f", static_cast<double>(timing.events[i]) / repetitions / operations);
+                    }
+                    else
+                    {
+                        std::printf(",");
+                    }
+                }
+            }
+            std::printf("\n");
+            std::fflush(stdout);
+        }
+
+    private:
+        const unsigned repetitions;
+        const std::string filter;
+        bench::perf_counters *const counters;
+        shape current_shape{ shape::wide };
+        size_t current_nodes{ 0 };
+        // Nodes a whole traversal of the current tree visits.
+        size_t visited{ 0 };
+    };
+}
+
+
+int main(int argc, char *args[])
+{
+    const size_t max_nodes = argc > 1 ? static_cast<size_t>(std::atoll(args[1])) : 1000000;
+    const unsigned repetitions = std::max(1, argc > 2 ? std::atoi(args[2]) : 5);
+    const std::string filter = argc > 3 ? args[3] : "";
+
+    std::unique_ptr<bench::perf_counters> counters;
+    if (argc > 4 && std::string(args[4]) == "perf")
+    {
+        counters.reset(new bench::perf_counters());
+        if (!counters->any_available())
+        {
+            std::fprintf(stderr, "perf_event_open counters are unavailable, their columns stay empty\n");
+        }
+    }
+
+    suite benchmarks(repetitions, filter, counters.get());
+    benchmarks.print_header();
+    for (size_t nodes = 1000; nodes <= max_nodes; nodes *= 10)
+    {
+        for (auto kind : { shape::wide, shape::deep, shape::balanced, shape::random })
+        {
+            benchmarks.run(kind, nodes);
+        }
+    }
+    return 0;
+}
@@ -9,2404 +9,7894 @@
 #include <memory>
 #include <iterator>
 #include <list>
+#include <set>
 #include <stack>
 #include <vector>
+#include <deque>
 #include <queue>
 #include <unordered_map>
 #include <string>
 #include <algorithm>
 #include <utility>
+#include <tuple>
 #include <initializer_list>
 #include <functional>
+#include <typeindex>
+#include <typeinfo>
 #include <cstddef>
+#include <limits>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <new>
+#include <exception>
+#include <cstdlib>
+#include <cassert>
 
 #ifdef _MSC_VER
     #pragma warning( disable : 4503)
 #endif
 
+// Children prefetched ahead by hierarchical iterators; 0 disables prefetching.
+#ifndef COMPOSITE_OBJECT_PREFETCH_DISTANCE
+    #define COMPOSITE_OBJECT_PREFETCH_DISTANCE 0
+#endif
+
+#if COMPOSITE_OBJECT_PREFETCH_DISTANCE > 0 && defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #include <xmmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+    #include <malloc.h>
+#endif
+
 
 namespace composite_object
 {
 
-template <class T>
-struct default_pointer_model
-{
-    using type = std::unique_ptr<T, std::default_delete<T>>;
-};
+// Allocation tracking
 
-template <class T>
-struct default_container_type
+// Heap allocations made by the library itself, by category.
+enum class allocation_category : unsigned char
 {
-    using type = std::list<T>;
+    iterator_impl,      // implementations of polymorphic iterators from `begin()`, `end()`, ...
+    iterator_clone,     // copies of those implementations
+    container_node,     // storage of the default children container
+    traversal_stack,    // stacks of depth-first hierarchical iterators
+    traversal_queue,    // queues of breadth-first hierarchical iterators
+    count
 };
 
+#ifdef COMPOSITE_OBJECT_TRACK_ALLOCATIONS
 
-template
-    <
-    class Base,
-    template <class T> class PointerModel = default_pointer_model,
-    class BaseIteratorCategory = std::bidirectional_iterator_tag
-    >
-    class abstract;
+// Allocation counters of the calling thread; defined with COMPOSITE_OBJECT_TRACK_ALLOCATIONS only.
+struct allocation_stats
+{
+    static constexpr size_t categories = static_cast<size_t>(allocation_category::count);
 
+    size_t allocations[categories] = {};
+    size_t bytes[categories] = {};
 
-template <class Base>
-    class leaf;
+    size_t allocations_of(const allocation_category category) const noexcept
+    {
+        return allocations[static_cast<size_t>(category)];
+    }
 
+    size_t bytes_of(const allocation_category category) const noexcept
+    {
+        return bytes[static_cast<size_t>(category)];
+    }
 
-template
-    <
-    class Base,
-    template <class T> class Container = default_container_type
-    >
-    class composite;
+    size_t total_allocations() const noexcept
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < categories; ++i)
+        {
+            total += allocations[i];
+        }
+        return total;
+    }
 
+    allocation_stats operator-(const allocation_stats &another) const noexcept
+    {
+        allocation_stats difference;
+        for (size_t i = 0; i < categories; ++i)
+        {
+            difference.allocations[i] = allocations[i] - another.allocations[i];
+            difference.bytes[i] = bytes[i] - another.bytes[i];
+        }
+        return difference;
+    }
 
-template <class Base>
-    class null_reference;
+    static allocation_stats &current() noexcept
+    {
+        static thread_local allocation_stats stats;
+        return stats;
+    }
 
+    static void reset() noexcept
+    {
+        current() = allocation_stats();
+    }
 
-template <class Base>
-    class reference;
+    static void record(const allocation_category category, const size_t size) noexcept
+    {
+        auto &stats = current();
+        ++stats.allocations[static_cast<size_t>(category)];
+        stats.bytes[static_cast<size_t>(category)] += size;
+    }
+};
 
+// Allocations made on this thread since construction, e.g. by one traversal.
+class allocation_scope
+{
+public:
+    allocation_scope() noexcept :
+        start(allocation_stats::current())
+    {
+    }
 
-template
-    <
-    class Category,
-    class T,
-    class Distance = ptrdiff_t,
-    class Pointer = T*,
-    class Reference = T&,
-    bool reversed = false
-    >
-    class polymorphic_iterator_template;
+    allocation_stats stats() const noexcept
+    {
+        return allocation_stats::current() - start;
+    }
 
+private:
+    allocation_stats start;
+};
 
-enum class df_traverse_algorithm
+template <class T, allocation_category category>
+struct tracking_allocator
 {
-    pre_order,
-    post_order
-};
+    using value_type = T;
 
+    template <class U>
+    struct rebind
+    {
+        using other = tracking_allocator<U, category>;
+    };
 
-template
-    <
-    class LinearIterator,
-    const df_traverse_algorithm traverse_algorithm_param,
-    bool reversed = false
-    >
-    class df_hierarchical_iterator_template;
+    tracking_allocator() noexcept
+    {
+    }
 
+    template <class U>
+    tracking_allocator(const tracking_allocator<U, category> &) noexcept
+    {
+    }
 
-template
-    <
-    class LinearIterator,
-    bool reversed = false
-    >
-    class bf_hierarchical_iterator_template;
+    T *allocate(const size_t n)
+    {
+        allocation_stats::record(category, n * sizeof(T));
+        return std::allocator<T>().allocate(n);
+    }
 
-//
+    void deallocate(T * const ptr, const size_t n) noexcept
+    {
+        std::allocator<T>().deallocate(ptr, n);
+    }
 
+    template <class U>
+    bool operator==(const tracking_allocator<U, category> &) const noexcept
+    {
+        return true;
+    }
 
-template
-<
-    class Base,
-    template <class T> class PointerModel,
-    class BaseIteratorCategory
->
-class abstract : public Base
-{
-    using self = abstract;
+    template <class U>
+    bool operator!=(const tracking_allocator<U, category> &) const noexcept
+    {
+        return false;
+    }
+};
 
-    template <class _Base>
-        friend class leaf;
+template <class T, allocation_category category>
+using library_allocator = tracking_allocator<T, category>;
 
-    template
-        <
-        class _Base,
-        template <class T> class Container
-        >
-        friend class composite;
+#else
 
-    template <class _Base>
-        friend class reference;
+template <class T, allocation_category category>
+using library_allocator = std::allocator<T>;
 
-public:
-    using smart_ptr = typename PointerModel<self>::type;
-    using value_type = smart_ptr;
-    using reference = composite_object::reference<self>;
-    using raw_pointer_to_base_interface = self*;
+#endif
 
 
-    struct iterator_traits
+// Memory at `alignment` boundaries, which C++14 `new` does not provide for over-aligned types.
+namespace
+{
+    inline void *aligned_allocate(const size_t size, const size_t alignment)
     {
-        using iterator_category    = BaseIteratorCategory;
-        using value_type           = smart_ptr;
-        using const_value_type     = const value_type;
-        using reference            = value_type&;
-        using const_reference      = const_value_type&;
-        using raw_pointer          = self*;
-        using pointer              = value_type*;
-        using const_pointer        = const_value_type*;
-        using difference_type      = ptrdiff_t;
-    };
+#ifdef _MSC_VER
+        void * const ptr = _aligned_malloc(size, alignment);
+#else
+        void *ptr = nullptr;
+        if (posix_memalign(&ptr, alignment, size) != 0)
+        {
+            ptr = nullptr;
+        }
+#endif
+        if (!ptr)
+        {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
 
-    using iterator = polymorphic_iterator_template
-        <
-        typename iterator_traits::iterator_category,
-        typename iterator_traits::value_type,
-        typename iterator_traits::difference_type,
-        typename iterator_traits::pointer,
-        typename iterator_traits::reference
-        >;
+    inline void aligned_deallocate(void * const ptr) noexcept
+    {
+#ifdef _MSC_VER
+        _aligned_free(ptr);
+#else
+        std::free(ptr);
+#endif
+    }
+}
 
-    using const_iterator = polymorphic_iterator_template
-        <
-        typename iterator_traits::iterator_category,
-        typename iterator_traits::const_value_type,
-        typename iterator_traits::difference_type,
-        typename iterator_traits::const_pointer,
-        typename iterator_traits::const_reference
-        >;
 
-    using reverse_iterator = polymorphic_iterator_template
-        <
-        typename iterator_traits::iterator_category,
-        typename iterator_traits::value_type,
-        typename iterator_traits::difference_type,
-        typename iterator_traits::pointer,
-        typename iterator_traits::reference,
-        true
-        >;
+// Traversal statistics
 
-    using const_reverse_iterator = polymorphic_iterator_template
-        <
-        typename iterator_traits::iterator_category,
-        typename iterator_traits::const_value_type,
-        typename iterator_traits::difference_type,
-        typename iterator_traits::const_pointer,
-        typename iterator_traits::const_reference,
-        true
-        >;
+#ifdef COMPOSITE_OBJECT_TRAVERSAL_STATS
 
-    using df_pre_order_hierarchical_iterator =
-        df_hierarchical_iterator_template<iterator, df_traverse_algorithm::pre_order>;
-    using const_df_pre_order_hierarchical_iterator =
-        df_hierarchical_iterator_template<const_iterator, df_traverse_algorithm::pre_order>;
-    using reverse_df_pre_order_hierarchical_iterator =
-        df_hierarchical_iterator_template<reverse_iterator, df_traverse_algorithm::pre_order, true>;
-    using const_reverse_df_pre_order_hierarchical_iterator =
-        df_hierarchical_iterator_template<const_reverse_iterator, df_traverse_algorithm::pre_order, true>;
+// Counters of hierarchical iterators on the calling thread; defined with COMPOSITE_OBJECT_TRAVERSAL_STATS
+// only. Traversals are counted only while a `traversal_stats_scope` is alive, so that they can be sampled.
+struct traversal_stats
+{
+    size_t nodes_visited = 0;
+    size_t max_depth = 0;               // of depth-first stacks and breadth-first queues
+    size_t descents = 0;                // composites whose children were entered or queued
+    size_t size_calls = 0;              // virtual `size()` calls deciding whether to descend
+    size_t iterator_allocations = 0;    // implementations of polymorphic iterators, copies included
 
-    using df_post_order_hierarchical_iterator =
-        df_hierarchical_iterator_template<iterator, df_traverse_algorithm::post_order>;
-    using const_df_post_order_hierarchical_iterator =
-        df_hierarchical_iterator_template<const_iterator, df_traverse_algorithm::post_order>;
-    using reverse_df_post_order_hierarchical_iterator =
-        df_hierarchical_iterator_template<reverse_iterator, df_traverse_algorithm::post_order, true>;
-    using const_reverse_df_post_order_hierarchical_iterator =
-        df_hierarchical_iterator_template<const_reverse_iterator, df_traverse_algorithm::post_order, true>;
+    static traversal_stats &current() noexcept
+    {
+        static thread_local traversal_stats stats;
+        return stats;
+    }
 
-    using bf_hierarchical_iterator =
-        bf_hierarchical_iterator_template<iterator>;
-    using const_bf_hierarchical_iterator =
-        bf_hierarchical_iterator_template<const_iterator>;
-    using reverse_bf_hierarchical_iterator =
-        bf_hierarchical_iterator_template<reverse_iterator, true>;
-    using const_reverse_bf_hierarchical_iterator =
-        bf_hierarchical_iterator_template<const_reverse_iterator, true>;
+    static bool &recording() noexcept
+    {
+        static thread_local bool value = false;
+        return value;
+    }
+
+    static void reset() noexcept
+    {
+        current() = traversal_stats();
+    }
+};
 
+// Counts the traversals made on this thread until destruction; `max_depth` is the maximum since construction.
+class traversal_stats_scope
+{
 public:
-    virtual void push_back(const value_type &) = 0;
-    virtual void push_back(value_type &&) = 0;
-    virtual bool is_leaf() const = 0;
-    virtual bool is_composite() const = 0;
-    virtual bool is_reference() const noexcept = 0;
-    virtual bool is_null_reference() const noexcept = 0;
-    virtual bool is_traversable() const noexcept = 0;
-    virtual void clear() = 0;
-    virtual size_t size() const = 0;
-    virtual bool empty() const = 0;
-    virtual size_t nested_hierarchy_size() const = 0;
-    virtual raw_pointer_to_base_interface clone() const = 0;
+    traversal_stats_scope() noexcept :
+        start(traversal_stats::current()), was_recording(traversal_stats::recording())
+    {
+        traversal_stats::recording() = true;
+        traversal_stats::current().max_depth = 0;
+    }
 
-    virtual iterator begin() = 0;
-    virtual iterator end() = 0;
-    virtual const_iterator cbegin() const = 0;
-    virtual const_iterator cend() const = 0;
-    virtual reverse_iterator rbegin() = 0;
-    virtual reverse_iterator rend() = 0;
-    virtual const_reverse_iterator crbegin() const = 0;
-    virtual const_reverse_iterator crend() const = 0;
+    traversal_stats_scope(const traversal_stats_scope &) = delete;
+    traversal_stats_scope &operator=(const traversal_stats_scope &) = delete;
 
-    virtual raw_pointer_to_base_interface get_parent() const
+    ~traversal_stats_scope()
     {
-        return _parent;
+        auto &stats = traversal_stats::current();
+        stats.max_depth = std::max(stats.max_depth, start.max_depth);
+        traversal_stats::recording() = was_recording;
     }
 
-    void relocate_to(value_type &another)
+    traversal_stats stats() const noexcept
     {
-        if (another->is_composite())
+        const auto &stats = traversal_stats::current();
+        traversal_stats difference;
+        difference.nodes_visited = stats.nodes_visited - start.nodes_visited;
+        difference.max_depth = stats.max_depth;
+        difference.descents = stats.descents - start.descents;
+        difference.size_calls = stats.size_calls - start.size_calls;
+        difference.iterator_allocations = stats.iterator_allocations - start.iterator_allocations;
+        return difference;
+    }
+
+private:
+    const traversal_stats start;
+    const bool was_recording;
+};
+
+#endif
+
+namespace
+{
+    // Called by hierarchical iterators; empty without COMPOSITE_OBJECT_TRAVERSAL_STATS.
+    struct traversal_recorder
+    {
+#ifdef COMPOSITE_OBJECT_TRAVERSAL_STATS
+        static void visit() noexcept
         {
+            if (traversal_stats::recording())
+            {
+                ++traversal_stats::current().nodes_visited;
+            }
+        }
+
+        // Comparing polymorphic iterators is a virtual call, so it is only made with statistics.
+        template <class Iterator>
+        static void visit_unless_end(const Iterator &it, const Iterator &end)
+        {
+            if (it != end)
+            {
+                visit();
+            }
+        }
+
+        static void depth(const size_t value) noexcept
+        {
+            if (traversal_stats::recording())
+            {
+                auto &stats = traversal_stats::current();
+                stats.max_depth = std::max(stats.max_depth, value);
+            }
+        }
+
+        static void descent(const size_t new_depth) noexcept
+        {
+            if (traversal_stats::recording())
+            {
+                ++traversal_stats::current().descents;
+                depth(new_depth);
+            }
+        }
+
+        static void size_call() noexcept
+        {
+            if (traversal_stats::recording())
+            {
+                ++traversal_stats::current().size_calls;
+            }
+        }
+
+        static void iterator_allocation() noexcept
+        {
+            if (traversal_stats::recording())
+            {
+                ++traversal_stats::current().iterator_allocations;
+            }
+        }
+#else
+        static void visit() noexcept {}
+        template <class Iterator>
+        static void visit_unless_end(const Iterator &, const Iterator &) noexcept {}
+        static void depth(size_t) noexcept {}
+        static void descent(size_t) noexcept {}
+        static void size_call() noexcept {}
+        static void iterator_allocation() noexcept {}
+#endif
+    };
+}
+
+
+template <class T>
+struct default_pointer_model
+{
+    using type = std::unique_ptr<T, std::default_delete<T>>;
+};
+
+// Shared ownership of children, required by `versioned_hierarchy` to share subtrees between versions.
+template <class T>
+struct shared_pointer_model
+{
+    using type = std::shared_ptr<T>;
+};
+
+template <class T>
+struct default_container_type
+{
+    using type = std::list<T, library_allocator<T, allocation_category::container_node>>;
+};
+
+
+// Flat vector of node pointers kept in `KeyOf()(*item)` order. `push_back` inserts after
+// equal keys, so the order of equal keys is the insertion order. Lookups are binary searches;
+// insertion is a binary search plus a move of the pointers behind the insertion point, so it
+// is linear in the number of children. Wide composites with frequent insertions are better
+// served by `sorted_multiset`.
+template <class T, class KeyOf, class Compare>
+class sorted_vector
+{
+    using self = sorted_vector;
+    using base_container = std::vector<T>;
+
+public:
+    using value_type             = T;
+    using allocator_type         = typename base_container::allocator_type;
+    using size_type              = typename base_container::size_type;
+    using difference_type        = typename base_container::difference_type;
+    using reference              = typename base_container::reference;
+    using const_reference        = typename base_container::const_reference;
+    using pointer                = typename base_container::pointer;
+    using const_pointer          = typename base_container::const_pointer;
+    using iterator               = typename base_container::iterator;
+    using const_iterator         = typename base_container::const_iterator;
+    using reverse_iterator       = typename base_container::reverse_iterator;
+    using const_reverse_iterator = typename base_container::const_reverse_iterator;
+    using key_type = typename std::decay<decltype(std::declval<const KeyOf&>()(*std::declval<const T&>()))>::type;
+    using key_of_type = KeyOf;
+
+public:
+    sorted_vector()
+    {
+    }
+
+    sorted_vector(std::initializer_list<T> init_list)
+    {
+        items.reserve(init_list.size());
+        for (auto &item : init_list)
+        {
+            insert(item);
+        }
+    }
+
+    size_type capacity() const noexcept { return items.capacity(); }
+
+    iterator begin() noexcept { return items.begin(); }
+    iterator end() noexcept { return items.end(); }
+    const_iterator begin() const noexcept { return items.begin(); }
+    const_iterator end() const noexcept { return items.end(); }
+    const_iterator cbegin() const noexcept { return items.cbegin(); }
+    const_iterator cend() const noexcept { return items.cend(); }
+    reverse_iterator rbegin() noexcept { return items.rbegin(); }
+    reverse_iterator rend() noexcept { return items.rend(); }
+    const_reverse_iterator rbegin() const noexcept { return items.rbegin(); }
+    const_reverse_iterator rend() const noexcept { return items.rend(); }
+    const_reverse_iterator crbegin() const noexcept { return items.crbegin(); }
+    const_reverse_iterator crend() const noexcept { return items.crend(); }
+
+    size_type size() const noexcept { return items.size(); }
+    bool empty() const noexcept { return items.empty(); }
+    void clear() noexcept { items.clear(); }
+    void reserve(const size_type count) { items.reserve(count); }
+
+    reference front() { return items.front(); }
+    const_reference front() const { return items.front(); }
+    reference back() { return items.back(); }
+    const_reference back() const { return items.back(); }
+
+    iterator insert(T &&value)
+    {
+        auto pos = upper_bound(key_of(*value));
+        return items.insert(pos, std::move(value));
+    }
+
+    iterator insert(const T &value)
+    {
+        auto pos = upper_bound(key_of(*value));
+        return items.insert(pos, value);
+    }
+
+    void push_back(T &&value)
+    {
+        insert(std::move(value));
+    }
+
+    void push_back(const T &value)
+    {
+        insert(value);
+    }
+
+    template <class... Args>
+    void emplace_back(Args&&... args)
+    {
+        insert(T(std::forward<Args>(args)...));
+    }
+
+    iterator erase(const_iterator pos)
+    {
+        return items.erase(pos);
+    }
+
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        return items.erase(first, last);
+    }
+
+    // Key queries
+
+    template <class Key>
+    iterator lower_bound(const Key &key)
+    {
+        return std::lower_bound(items.begin(), items.end(), key,
+            [this](const T &item, const Key &k) { return compare(key_of(*item), k); });
+    }
+
+    template <class Key>
+    const_iterator lower_bound(const Key &key) const
+    {
+        return const_cast<self*>(this)->lower_bound(key);
+    }
+
+    template <class Key>
+    iterator upper_bound(const Key &key)
+    {
+        return std::upper_bound(items.begin(), items.end(), key,
+            [this](const Key &k, const T &item) { return compare(k, key_of(*item)); });
+    }
+
+    template <class Key>
+    const_iterator upper_bound(const Key &key) const
+    {
+        return const_cast<self*>(this)->upper_bound(key);
+    }
+
+    template <class Key>
+    std::pair<iterator, iterator> equal_range(const Key &key)
+    {
+        return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
+    template <class Key>
+    std::pair<const_iterator, const_iterator> equal_range(const Key &key) const
+    {
+        return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
+    template <class Key>
+    iterator find(const Key &key)
+    {
+        auto it = lower_bound(key);
+        return (it != items.end() && !compare(key, key_of(**it))) ? it : items.end();
+    }
+
+    template <class Key>
+    const_iterator find(const Key &key) const
+    {
+        return const_cast<self*>(this)->find(key);
+    }
+
+    template <class Key>
+    size_type count(const Key &key) const
+    {
+        auto range = equal_range(key);
+        return static_cast<size_type>(range.second - range.first);
+    }
+
+    // Children with keys in [low, high).
+    template <class Key>
+    std::pair<iterator, iterator> range(const Key &low, const Key &high)
+    {
+        return std::make_pair(lower_bound(low), lower_bound(high));
+    }
+
+    template <class Key>
+    std::pair<const_iterator, const_iterator> range(const Key &low, const Key &high) const
+    {
+        return std::make_pair(lower_bound(low), lower_bound(high));
+    }
+
+    // Children with string-like keys starting with `prefix`.
+    template <class Prefix>
+    std::pair<iterator, iterator> prefix_range(const Prefix &prefix)
+    {
+        auto first = lower_bound(prefix);
+        auto last = std::partition_point(first, items.end(), [this, &prefix](const T &item)
+        {
+            const auto &key = key_of(*item);
+            return key.size() >= prefix.size() && std::equal(prefix.begin(), prefix.end(), key.begin());
+        });
+        return std::make_pair(first, last);
+    }
+
+    template <class Prefix>
+    std::pair<const_iterator, const_iterator> prefix_range(const Prefix &prefix) const
+    {
+        auto range = const_cast<self*>(this)->prefix_range(prefix);
+        return std::pair<const_iterator, const_iterator>(range.first, range.second);
+    }
+
+private:
+    base_container items;
+    KeyOf key_of;
+    Compare compare;
+};
+
+
+// Node-based counterpart of `sorted_vector` on top of `std::multiset`: insertion and erasure
+// of single children are logarithmic, at the cost of one allocation per child and iterators
+// which are only bidirectional. Equal keys also keep the insertion order. Items are reachable
+// through mutable iterators, as `composite` moves them while erasing; moves must keep the order.
+template <class T, class KeyOf, class Compare>
+class sorted_multiset
+{
+    using self = sorted_multiset;
+
+    struct entry
+    {
+        mutable T item;
+    };
+
+    struct entry_compare
+    {
+        using is_transparent = void;
+
+        template <class A, class B>
+        bool operator()(const A &a, const B &b) const
+        {
+            return compare(key(a), key(b));
+        }
+
+        template <class Key>
+        const Key &key(const Key &k) const noexcept
+        {
+            return k;
+        }
+
+        auto key(const entry &e) const -> decltype(std::declval<const KeyOf&>()(*e.item))
+        {
+            return key_of(*e.item);
+        }
+
+        KeyOf key_of;
+        Compare compare;
+    };
+
+    using base_container = std::multiset<entry, entry_compare>;
+
+    template <class Value, class BaseIterator>
+    class iterator_template
+    {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Value*;
+        using reference = Value&;
+
+    public:
+        iterator_template()
+        {
+        }
+
+        explicit iterator_template(const BaseIterator &it) :
+            it(it)
+        {
+        }
+
+        operator iterator_template<const T, typename base_container::const_iterator>() const
+        {
+            return iterator_template<const T, typename base_container::const_iterator>(it);
+        }
+
+        reference operator*() const { return it->item; }
+        pointer operator->() const { return &it->item; }
+
+        iterator_template &operator++() { ++it; return *this; }
+        iterator_template &operator--() { --it; return *this; }
+        iterator_template operator++(int) { auto copy = *this; ++it; return copy; }
+        iterator_template operator--(int) { auto copy = *this; --it; return copy; }
+
+        bool operator==(const iterator_template &another) const { return it == another.it; }
+        bool operator!=(const iterator_template &another) const { return it != another.it; }
+
+    private:
+        BaseIterator it;
+
+        friend class sorted_multiset;
+    };
+
+public:
+    using value_type             = T;
+    using size_type              = typename base_container::size_type;
+    using difference_type        = typename base_container::difference_type;
+    using reference              = T&;
+    using const_reference        = const T&;
+    using pointer                = T*;
+    using const_pointer          = const T*;
+    using iterator               = iterator_template<T, typename base_container::iterator>;
+    using const_iterator         = iterator_template<const T, typename base_container::const_iterator>;
+    using reverse_iterator       = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+    using key_type = typename std::decay<decltype(std::declval<const KeyOf&>()(*std::declval<const T&>()))>::type;
+    using key_of_type = KeyOf;
+
+public:
+    sorted_multiset()
+    {
+    }
+
+    sorted_multiset(std::initializer_list<T> init_list)
+    {
+        for (auto &item : init_list)
+        {
+            insert(item);
+        }
+    }
+
+    iterator begin() noexcept { return iterator(items.begin()); }
+    iterator end() noexcept { return iterator(items.end()); }
+    const_iterator begin() const noexcept { return const_iterator(items.begin()); }
+    const_iterator end() const noexcept { return const_iterator(items.end()); }
+    const_iterator cbegin() const noexcept { return begin(); }
+    const_iterator cend() const noexcept { return end(); }
+    reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+    reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+    const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); }
+    const_reverse_iterator crbegin() const noexcept { return rbegin(); }
+    const_reverse_iterator crend() const noexcept { return rend(); }
+
+    size_type size() const noexcept { return items.size(); }
+    bool empty() const noexcept { return items.empty(); }
+    void clear() noexcept { items.clear(); }
+
+    reference front() { return *begin(); }
+    const_reference front() const { return *begin(); }
+    reference back() { return *rbegin(); }
+    const_reference back() const { return *rbegin(); }
+
+    // `std::multiset` inserts after equal keys.
+    iterator insert(T &&value)
+    {
+        return iterator(items.insert(entry{ std::move(value) }));
+    }
+
+    iterator insert(const T &value)
+    {
+        return iterator(items.insert(entry{ value }));
+    }
+
+    void push_back(T &&value)
+    {
+        insert(std::move(value));
+    }
+
+    void push_back(const T &value)
+    {
+        insert(value);
+    }
+
+    template <class... Args>
+    void emplace_back(Args&&... args)
+    {
+        insert(T(std::forward<Args>(args)...));
+    }
+
+    iterator erase(const_iterator pos)
+    {
+        return iterator(items.erase(pos.it));
+    }
+
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        return iterator(items.erase(first.it, last.it));
+    }
+
+    // Key queries
+
+    template <class Key>
+    iterator lower_bound(const Key &key)
+    {
+        return iterator(items.lower_bound(key));
+    }
+
+    template <class Key>
+    const_iterator lower_bound(const Key &key) const
+    {
+        return const_iterator(items.lower_bound(key));
+    }
+
+    template <class Key>
+    iterator upper_bound(const Key &key)
+    {
+        return iterator(items.upper_bound(key));
+    }
+
+    template <class Key>
+    const_iterator upper_bound(const Key &key) const
+    {
+        return const_iterator(items.upper_bound(key));
+    }
+
+    template <class Key>
+    std::pair<iterator, iterator> equal_range(const Key &key)
+    {
+        return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
+    template <class Key>
+    std::pair<const_iterator, const_iterator> equal_range(const Key &key) const
+    {
+        return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
+    template <class Key>
+    iterator find(const Key &key)
+    {
+        return iterator(items.find(key));
+    }
+
+    template <class Key>
+    const_iterator find(const Key &key) const
+    {
+        return const_iterator(items.find(key));
+    }
+
+    template <class Key>
+    size_type count(const Key &key) const
+    {
+        return items.count(key);
+    }
+
+    // Children with keys in [low, high).
+    template <class Key>
+    std::pair<iterator, iterator> range(const Key &low, const Key &high)
+    {
+        return std::make_pair(lower_bound(low), lower_bound(high));
+    }
+
+    template <class Key>
+    std::pair<const_iterator, const_iterator> range(const Key &low, const Key &high) const
+    {
+        return std::make_pair(lower_bound(low), lower_bound(high));
+    }
+
+    // Children with string-like keys starting with `prefix`.
+    template <class Prefix>
+    std::pair<iterator, iterator> prefix_range(const Prefix &prefix)
+    {
+        auto first = lower_bound(prefix);
+        auto last = std::partition_point(first, end(), [this, &prefix](const T &item)
+        {
+            const auto &key = items.key_comp().key_of(*item);
+            return key.size() >= prefix.size() && std::equal(prefix.begin(), prefix.end(), key.begin());
+        });
+        return std::make_pair(first, last);
+    }
+
+    template <class Prefix>
+    std::pair<const_iterator, const_iterator> prefix_range(const Prefix &prefix) const
+    {
+        auto range = const_cast<self*>(this)->prefix_range(prefix);
+        return std::pair<const_iterator, const_iterator>(range.first, range.second);
+    }
+
+private:
+    base_container items;
+};
+
+
+// Container policy for `composite` which keeps children ordered by `KeyOf()(child)`:
+// `composite<Base, ordered_by<KeyOf>::container_type>`.
+template <class KeyOf, class Compare = std::less<void>>
+struct ordered_by
+{
+    template <class T>
+    struct container_type
+    {
+        using type = sorted_vector<T, KeyOf, Compare>;
+    };
+};
+
+// As `ordered_by`, for wide composites with frequent insertions and removals:
+// `composite<Base, multiset_ordered_by<KeyOf>::container_type>`.
+template <class KeyOf, class Compare = std::less<void>>
+struct multiset_ordered_by
+{
+    template <class T>
+    struct container_type
+    {
+        using type = sorted_multiset<T, KeyOf, Compare>;
+    };
+};
+
+
+// Growable array for concurrent appends without locks. `push_back` reserves a slot with an
+// atomic counter, constructs the item in a segment which never moves, and marks it ready;
+// `size()` counts the ready prefix, which every appender helps to advance, so readers iterate
+// a consistent prefix while appends go on. Segments double in size and are allocated on demand.
+// Erasing, clearing, moving and destruction require that no other thread uses the container.
+template <class T, std::size_t FirstSegmentSize = 16>
+class append_only_vector
+{
+    using self = append_only_vector;
+
+    static_assert(FirstSegmentSize > 0 && (FirstSegmentSize & (FirstSegmentSize - 1)) == 0,
+        "The first segment size must be a power of two");
+
+    struct slot
+    {
+        std::atomic<bool> ready{ false };
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+        T &get() noexcept { return *reinterpret_cast<T*>(&storage); }
+    };
+
+    static const std::size_t max_segments = 32;
+
+    static constexpr std::size_t log2(std::size_t value) noexcept
+    {
+        std::size_t result = 0;
+        for (; value > 1; value >>= 1)
+        {
+            ++result;
+        }
+        return result;
+    }
+
+    template <class Value>
+    class iterator_template
+    {
+        using container = typename std::conditional<std::is_const<Value>::value, const self, self>::type;
+
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Value*;
+        using reference = Value&;
+
+    public:
+        iterator_template() noexcept
+        {
+        }
+
+        iterator_template(container *owner, const std::size_t index) noexcept :
+            owner(owner), index(index)
+        {
+        }
+
+        operator iterator_template<const T>() const noexcept
+        {
+            return iterator_template<const T>(owner, index);
+        }
+
+        reference operator*() const { return owner->at(index); }
+        pointer operator->() const { return &owner->at(index); }
+        reference operator[](const difference_type diff) const { return owner->at(index + diff); }
+
+        iterator_template &operator++() noexcept { ++index; return *this; }
+        iterator_template &operator--() noexcept { --index; return *this; }
+        iterator_template operator++(int) noexcept { auto copy = *this; ++index; return copy; }
+        iterator_template operator--(int) noexcept { auto copy = *this; --index; return copy; }
+        iterator_template &operator+=(const difference_type diff) noexcept { index += diff; return *this; }
+        iterator_template &operator-=(const difference_type diff) noexcept { index -= diff; return *this; }
+        iterator_template operator+(const difference_type diff) const noexcept { return iterator_template(owner, index + diff); }
+        iterator_template operator-(const difference_type diff) const noexcept { return iterator_template(owner, index - diff); }
+        difference_type operator-(const iterator_template &another) const noexcept { return difference_type(index) - difference_type(another.index); }
+
+        bool operator==(const iterator_template &another) const noexcept { return index == another.index; }
+        bool operator!=(const iterator_template &another) const noexcept { return index != another.index; }
+        bool operator<(const iterator_template &another) const noexcept { return index < another.index; }
+        bool operator>(const iterator_template &another) const noexcept { return index > another.index; }
+        bool operator<=(const iterator_template &another) const noexcept { return index <= another.index; }
+        bool operator>=(const iterator_template &another) const noexcept { return index >= another.index; }
+
+    private:
+        container *owner{ nullptr };
+        std::size_t index{ 0 };
+
+        friend class append_only_vector;
+    };
+
+public:
+    using value_type             = T;
+    using size_type              = std::size_t;
+    using difference_type        = std::ptrdiff_t;
+    using reference              = T&;
+    using const_reference        = const T&;
+    using pointer                = T*;
+    using const_pointer          = const T*;
+    using iterator               = iterator_template<T>;
+    using const_iterator         = iterator_template<const T>;
+    using reverse_iterator       = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+public:
+    append_only_vector()
+    {
+    }
+
+    append_only_vector(std::initializer_list<T> init_list)
+    {
+        for (auto &item : init_list)
+        {
+            push_back(item);
+        }
+    }
+
+    append_only_vector(const self &) = delete;
+    self &operator=(const self &) = delete;
+
+    append_only_vector(self &&another) noexcept :
+        table(another.table.exchange(nullptr)),
+        reserved(another.reserved.exchange(0)),
+        committed(another.committed.exchange(0))
+    {
+    }
+
+    self &operator=(self &&another) noexcept
+    {
+        if (this != &another)
+        {
+            release();
+            table = another.table.exchange(nullptr);
+            reserved = another.reserved.exchange(0);
+            committed = another.committed.exchange(0);
+        }
+        return *this;
+    }
+
+    ~append_only_vector()
+    {
+        release();
+    }
+
+    iterator begin() noexcept { return iterator(this, 0); }
+    iterator end() noexcept { return iterator(this, size()); }
+    const_iterator begin() const noexcept { return const_iterator(this, 0); }
+    const_iterator end() const noexcept { return const_iterator(this, size()); }
+    const_iterator cbegin() const noexcept { return begin(); }
+    const_iterator cend() const noexcept { return end(); }
+    reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+    reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+    const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); }
+    const_reverse_iterator crbegin() const noexcept { return rbegin(); }
+    const_reverse_iterator crend() const noexcept { return rend(); }
+
+    size_type size() const noexcept { return committed.load(std::memory_order_acquire); }
+    bool empty() const noexcept { return size() == 0; }
+
+    reference front() { return at(0); }
+    const_reference front() const { return at(0); }
+    reference back() { return at(size() - 1); }
+    const_reference back() const { return at(size() - 1); }
+
+    void push_back(T &&value)
+    {
+        emplace_back(std::move(value));
+    }
+
+    void push_back(const T &value)
+    {
+        emplace_back(value);
+    }
+
+    template <class... Args>
+    void emplace_back(Args&&... args)
+    {
+        const size_type index = reserved.fetch_add(1, std::memory_order_relaxed);
+        slot &target = obtain_slot(index);
+        new (&target.storage) T(std::forward<Args>(args)...);
+        target.ready.store(true);
+        publish();
+    }
+
+    // Not thread-safe.
+    iterator erase(const_iterator pos)
+    {
+        return erase(pos, pos + 1);
+    }
+
+    // Not thread-safe.
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        const size_type count = size();
+        const size_type from = first.index;
+        const size_type removed = last.index - first.index;
+
+        for (size_type i = from; i + removed < count; ++i)
+        {
+            at(i) = std::move(at(i + removed));
+        }
+        for (size_type i = count - removed; i < count; ++i)
+        {
+            slot &item = locate(i);
+            item.get().~T();
+            item.ready.store(false, std::memory_order_relaxed);
+        }
+
+        reserved.store(count - removed, std::memory_order_relaxed);
+        committed.store(count - removed, std::memory_order_release);
+        return iterator(this, from);
+    }
+
+    // Not thread-safe.
+    void clear()
+    {
+        erase(cbegin(), cend());
+    }
+
+private:
+    // Segment `s` holds `FirstSegmentSize << s` items starting at `FirstSegmentSize * (2^s - 1)`.
+    static size_type segment_of(const size_type index, size_type &offset) noexcept
+    {
+        const size_type biased = index + FirstSegmentSize;
+        const size_type log = log2(biased);
+        offset = biased - (size_type(1) << log);
+        return log - log2(FirstSegmentSize);
+    }
+
+    slot &locate(const size_type index) const noexcept
+    {
+        size_type offset = 0;
+        const size_type segment = segment_of(index, offset);
+        return table.load(std::memory_order_acquire)[segment].load(std::memory_order_acquire)[offset];
+    }
+
+    // The slot may be reserved before its segment is allocated.
+    bool is_ready(const size_type index) const noexcept
+    {
+        size_type offset = 0;
+        const size_type segment = segment_of(index, offset);
+        std::atomic<slot*> *segments = table.load();
+        slot *items = segments ? segments[segment].load() : nullptr;
+        return items && items[offset].ready.load();
+    }
+
+    T &at(const size_type index) const noexcept
+    {
+        return locate(index).get();
+    }
+
+    slot &obtain_slot(const size_type index)
+    {
+        std::atomic<slot*> *segments = table.load(std::memory_order_acquire);
+        if (!segments)
+        {
+            auto created = new std::atomic<slot*>[max_segments];
+            for (size_type i = 0; i < max_segments; ++i)
+            {
+                created[i].store(nullptr, std::memory_order_relaxed);
+            }
+            if (table.compare_exchange_strong(segments, created, std::memory_order_acq_rel))
+            {
+                segments = created;
+            }
+            else
+            {
+                delete[] created;
+            }
+        }
+
+        size_type offset = 0;
+        const size_type segment = segment_of(index, offset);
+        slot *items = segments[segment].load(std::memory_order_acquire);
+        if (!items)
+        {
+            auto created = new slot[FirstSegmentSize << segment];
+            if (segments[segment].compare_exchange_strong(items, created, std::memory_order_acq_rel))
+            {
+                items = created;
+            }
+            else
+            {
+                delete[] created;
+            }
+        }
+        return items[offset];
+    }
+
+    // Advances the committed prefix over ready slots. Sequentially consistent with the stores
+    // of the ready flags, so the appender of the last ready slot always finishes the prefix.
+    void publish()
+    {
+        size_type current = committed.load();
+        while (current < reserved.load() && is_ready(current))
+        {
+            committed.compare_exchange_weak(current, current + 1);
+        }
+    }
+
+    void release() noexcept
+    {
+        std::atomic<slot*> *segments = table.load(std::memory_order_relaxed);
+        if (!segments)
+        {
+            return;
+        }
+
+        const size_type count = committed.load(std::memory_order_relaxed);
+        for (size_type i = 0; i < count; ++i)
+        {
+            at(i).~T();
+        }
+        for (size_type i = 0; i < max_segments; ++i)
+        {
+            delete[] segments[i].load(std::memory_order_relaxed);
+        }
+        delete[] segments;
+        table.store(nullptr, std::memory_order_relaxed);
+        reserved.store(0, std::memory_order_relaxed);
+        committed.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<std::atomic<slot*>*> table{ nullptr };
+    std::atomic<size_type> reserved{ 0 };
+    std::atomic<size_type> committed{ 0 };
+};
+
+
+template <class T>
+struct append_only_container_type
+{
+    using type = append_only_vector<T>;
+};
+
+
+template
+    <
+    class Base,
+    template <class T> class PointerModel = default_pointer_model,
+    class BaseIteratorCategory = std::bidirectional_iterator_tag
+    >
+    class abstract;
+
+
+template <class Base>
+    class leaf;
+
+
+template
+    <
+    class Base,
+    template <class T> class Container = default_container_type
+    >
+    class composite;
+
+
+template
+    <
+    class Base,
+    class KeyOf,
+    class Hash = void,
+    template <class T> class Container = default_container_type
+    >
+    class keyed_composite;
+
+
+template
+    <
+    class Base,
+    template <class T> class Container = default_container_type
+    >
+    class concurrent_composite;
+
+
+template <class Base>
+    class null_reference;
+
+
+template <class Composite>
+    class versioned_hierarchy;
+
+
+// Receives subtrees removed by `remove_if` and `clear` on the installing thread instead of
+// letting the composite destroy them. Installed with `node_disposer::scope`.
+template <class SmartPtr>
+class node_disposer
+{
+public:
+    virtual void dispose(SmartPtr &&node) = 0;
+
+    static node_disposer *current() noexcept
+    {
+        return installed();
+    }
+
+    class scope
+    {
+    public:
+        explicit scope(node_disposer &disposer) noexcept :
+            previous(installed())
+        {
+            installed() = &disposer;
+        }
+
+        scope(const scope &) = delete;
+        scope &operator=(const scope &) = delete;
+
+        ~scope()
+        {
+            installed() = previous;
+        }
+
+    private:
+        node_disposer *previous;
+    };
+
+protected:
+    ~node_disposer()
+    {
+    }
+
+private:
+    static node_disposer *&installed() noexcept
+    {
+        static thread_local node_disposer *disposer = nullptr;
+        return disposer;
+    }
+};
+
+
+template <class SmartPtr>
+    class incremental_reclaimer;
+
+
+// Mutating operations reported to `mutation_hooks`.
+enum class mutation_kind : unsigned char
+{
+    push_back,
+    remove_if,
+    clear,
+    relocate_to,
+    clone
+};
+
+// Specialize for an abstract type, with `enabled` set, to trace mutations of its hierarchies.
+// `begin()` gets the number of children `node` has when the operation starts, `end()` the number
+// of nodes attached (`push_back`, `relocate_to`), detached with their subtrees (`remove_if`,
+// `clear`) or copied (`clone`). `node` is the composite being changed, the node being relocated
+// or the original being cloned. Operations may nest: `relocate_to` attaches through `push_back`.
+// Disabled hooks are not called, so their arguments are not even computed.
+template <class Abstract>
+struct mutation_hooks
+{
+    static constexpr bool enabled = false;
+
+    static void begin(mutation_kind, const Abstract &, size_t) noexcept
+    {
+    }
+
+    static void end(mutation_kind, const Abstract &, size_t) noexcept
+    {
+    }
+};
+
+
+// Bytes spent by a hierarchy, by component; filled by `memory_accounting`.
+struct memory_footprint
+{
+    size_t nodes{ 0 };
+    size_t allocations{ 0 };
+
+    // Node objects: vtable pointers, fields added by the library classes and mixins, and the rest
+    // of the object, which is the payload stored inline.
+    size_t vtable_pointer_bytes{ 0 };
+    size_t library_field_bytes{ 0 };
+    size_t inline_payload_bytes{ 0 };
+
+    // Heap storage of children containers and indexes: the smart pointers and everything else.
+    size_t smart_pointer_bytes{ 0 };
+    size_t container_bytes{ 0 };
+
+    // Estimated allocator headers and rounding of all allocations.
+    size_t allocation_overhead_bytes{ 0 };
+
+    // Heap memory owned by payloads, as reported by the user.
+    size_t external_payload_bytes{ 0 };
+
+    size_t structure_bytes() const noexcept
+    {
+        return vtable_pointer_bytes + library_field_bytes + smart_pointer_bytes + container_bytes + allocation_overhead_bytes;
+    }
+
+    size_t payload_bytes() const noexcept
+    {
+        return inline_payload_bytes + external_payload_bytes;
+    }
+
+    size_t total_bytes() const noexcept
+    {
+        return structure_bytes() + payload_bytes();
+    }
+
+    memory_footprint &operator+=(const memory_footprint &another) noexcept
+    {
+        nodes += another.nodes;
+        allocations += another.allocations;
+        vtable_pointer_bytes += another.vtable_pointer_bytes;
+        library_field_bytes += another.library_field_bytes;
+        inline_payload_bytes += another.inline_payload_bytes;
+        smart_pointer_bytes += another.smart_pointer_bytes;
+        container_bytes += another.container_bytes;
+        allocation_overhead_bytes += another.allocation_overhead_bytes;
+        external_payload_bytes += another.external_payload_bytes;
+        return *this;
+    }
+};
+
+
+namespace
+{
+
+template <size_t N>
+struct lookup_priority : lookup_priority<N - 1>
+{
+};
+
+template <>
+struct lookup_priority<0>
+{
+};
+
+// Contiguous storage: one buffer, whose unused capacity counts as container bytes.
+template <class Container>
+auto add_container_footprint(const Container &cont, memory_footprint &footprint, lookup_priority<2>)
+    -> decltype(cont.capacity(), void())
+{
+    using value_type = typename Container::value_type;
+    footprint.smart_pointer_bytes += cont.size() * sizeof(value_type);
+    footprint.container_bytes += (cont.capacity() - cont.size()) * sizeof(value_type);
+    footprint.allocations += cont.capacity() > 0 ? 1 : 0;
+}
+
+// One allocation with two links per element.
+template <class T, class Allocator>
+void add_container_footprint(const std::list<T, Allocator> &cont, memory_footprint &footprint, lookup_priority<1>)
+{
+    footprint.smart_pointer_bytes += cont.size() * sizeof(T);
+    footprint.container_bytes += cont.size() * 2 * sizeof(void*);
+    footprint.allocations += cont.size();
+}
+
+// One tree node with three links and a color per element.
+template <class T, class KeyOf, class Compare>
+void add_container_footprint(const sorted_multiset<T, KeyOf, Compare> &cont, memory_footprint &footprint, lookup_priority<1>)
+{
+    footprint.smart_pointer_bytes += cont.size() * sizeof(T);
+    footprint.container_bytes += cont.size() * 4 * sizeof(void*);
+    footprint.allocations += cont.size();
+}
+
+template <class Container>
+void add_container_footprint(const Container &cont, memory_footprint &footprint, lookup_priority<0>)
+{
+    footprint.smart_pointer_bytes += cont.size() * sizeof(typename Container::value_type);
+    footprint.allocations += cont.empty() ? 0 : 1;
+}
+
+}
+
+
+
+template <class Base>
+    class reference;
+
+
+template
+    <
+    class Category,
+    class T,
+    class Distance = ptrdiff_t,
+    class Pointer = T*,
+    class Reference = T&,
+    bool reversed = false
+    >
+    class polymorphic_iterator_template;
+
+
+enum class df_traverse_algorithm
+{
+    pre_order,
+    post_order
+};
+
+
+template
+    <
+    class LinearIterator,
+    const df_traverse_algorithm traverse_algorithm_param,
+    bool reversed = false
+    >
+    class df_hierarchical_iterator_template;
+
+
+template
+    <
+    class LinearIterator,
+    bool reversed = false
+    >
+    class bf_hierarchical_iterator_template;
+
+//
+
+
+template
+<
+    class Base,
+    template <class T> class PointerModel,
+    class BaseIteratorCategory
+>
+class abstract : public Base
+{
+    using self = abstract;
+
+    template <class _Base>
+        friend class leaf;
+
+    template
+        <
+        class _Base,
+        template <class T> class Container
+        >
+        friend class composite;
+
+    template
+        <
+        class _Base,
+        template <class T> class Container
+        >
+        friend class concurrent_composite;
+
+    template <class _Base>
+        friend class reference;
+
+    template <class Composite>
+        friend class versioned_hierarchy;
+
+    template <class SmartPtr>
+        friend class incremental_reclaimer;
+
+    template <class _Base>
+        friend class identifiable;
+
+    template <class _Base>
+        friend class observable;
+
+    template <class _Base, class Aggregate>
+        friend class aggregated;
+
+public:
+    using smart_ptr = typename PointerModel<self>::type;
+    using value_type = smart_ptr;
+    using reference = composite_object::reference<self>;
+    using raw_pointer_to_base_interface = self*;
+
+
+    struct iterator_traits
+    {
+        using iterator_category    = BaseIteratorCategory;
+        using value_type           = smart_ptr;
+        using const_value_type     = const value_type;
+        using reference            = value_type&;
+        using const_reference      = const_value_type&;
+        using raw_pointer          = self*;
+        using pointer              = value_type*;
+        using const_pointer        = const_value_type*;
+        using difference_type      = ptrdiff_t;
+    };
+
+    using iterator = polymorphic_iterator_template
+        <
+        typename iterator_traits::iterator_category,
+        typename iterator_traits::value_type,
+        typename iterator_traits::difference_type,
+        typename iterator_traits::pointer,
+        typename iterator_traits::reference
+        >;
+
+    using const_iterator = polymorphic_iterator_template
+        <
+        typename iterator_traits::iterator_category,
+        typename iterator_traits::const_value_type,
+        typename iterator_traits::difference_type,
+        typename iterator_traits::const_pointer,
+        typename iterator_traits::const_reference
+        >;
+
+    using reverse_iterator = polymorphic_iterator_template
+        <
+        typename iterator_traits::iterator_category,
+        typename iterator_traits::value_type,
+        typename iterator_traits::difference_type,
+        typename iterator_traits::pointer,
+        typename iterator_traits::reference,
+        true
+        >;
+
+    using const_reverse_iterator = polymorphic_iterator_template
+        <
+        typename iterator_traits::iterator_category,
+        typename iterator_traits::const_value_type,
+        typename iterator_traits::difference_type,
+        typename iterator_traits::const_pointer,
+        typename iterator_traits::const_reference,
+        true
+        >;
+
+    using df_pre_order_hierarchical_iterator =
+        df_hierarchical_iterator_template<iterator, df_traverse_algorithm::pre_order>;
+    using const_df_pre_order_hierarchical_iterator =
+        df_hierarchical_iterator_template<const_iterator, df_traverse_algorithm::pre_order>;
+    using reverse_df_pre_order_hierarchical_iterator =
+        df_hierarchical_iterator_template<reverse_iterator, df_traverse_algorithm::pre_order, true>;
+    using const_reverse_df_pre_order_hierarchical_iterator =
+        df_hierarchical_iterator_template<const_reverse_iterator, df_traverse_algorithm::pre_order, true>;
+
+    using df_post_order_hierarchical_iterator =
+        df_hierarchical_iterator_template<iterator, df_traverse_algorithm::post_order>;
+    using const_df_post_order_hierarchical_iterator =
+        df_hierarchical_iterator_template<const_iterator, df_traverse_algorithm::post_order>;
+    using reverse_df_post_order_hierarchical_iterator =
+        df_hierarchical_iterator_template<reverse_iterator, df_traverse_algorithm::post_order, true>;
+    using const_reverse_df_post_order_hierarchical_iterator =
+        df_hierarchical_iterator_template<const_reverse_iterator, df_traverse_algorithm::post_order, true>;
+
+    using bf_hierarchical_iterator =
+        bf_hierarchical_iterator_template<iterator>;
+    using const_bf_hierarchical_iterator =
+        bf_hierarchical_iterator_template<const_iterator>;
+    using reverse_bf_hierarchical_iterator =
+        bf_hierarchical_iterator_template<reverse_iterator, true>;
+    using const_reverse_bf_hierarchical_iterator =
+        bf_hierarchical_iterator_template<const_reverse_iterator, true>;
+
+    // Kind and type-query flags are kept in one byte, so that traversal and
+    // removal loops can query node type without virtual calls.
+
+    enum node_kind : unsigned char
+    {
+        leaf_kind           = 0,
+        composite_kind      = 1,
+        reference_kind      = 2,
+        null_reference_kind = 3
+    };
+
+    enum node_flag : unsigned char
+    {
+        kind_mask           = 0x03,
+        leaf_flag           = 1 << 2,
+        composite_flag      = 1 << 3,
+        null_reference_flag = 1 << 4,
+        traversable_flag    = 1 << 5
+    };
+
+public:
+    virtual void push_back(const value_type &) = 0;
+    virtual void push_back(value_type &&) = 0;
+    virtual void clear() = 0;
+    virtual size_t size() const = 0;
+    virtual bool empty() const = 0;
+    virtual size_t nested_hierarchy_size() const = 0;
+    virtual raw_pointer_to_base_interface clone() const = 0;
+
+    // Copy of this node whose children are shared with the original rather than cloned.
+    // Falls back to `clone()` for pointer models which cannot be copied.
+    raw_pointer_to_base_interface shallow_clone() const
+    {
+        return clone_with(children_copy_mode::shared);
+    }
+
+    virtual iterator begin() = 0;
+    virtual iterator end() = 0;
+    virtual const_iterator cbegin() const = 0;
+    virtual const_iterator cend() const = 0;
+    virtual reverse_iterator rbegin() = 0;
+    virtual reverse_iterator rend() = 0;
+    virtual const_reverse_iterator crbegin() const = 0;
+    virtual const_reverse_iterator crend() const = 0;
+
+    virtual raw_pointer_to_base_interface get_parent() const
+    {
+        return _parent;
+    }
+
+    // Adds the library fields of this node and the storage of its children; see `memory_accounting`.
+    // Exact field sizes, as payload fields of derived classes may be placed in the tail padding.
+    virtual void add_structure_footprint(memory_footprint &footprint) const
+    {
+        footprint.library_field_bytes += sizeof(_parent) + sizeof(_node_flags) + sizeof(_awaits_destruction);
+    }
+
+    node_kind kind() const noexcept
+    {
+        return static_cast<node_kind>(_node_flags & kind_mask);
+    }
+
+    unsigned char node_flags() const noexcept
+    {
+        return _node_flags;
+    }
+
+    bool is_leaf() const noexcept
+    {
+        return (_node_flags & leaf_flag) != 0;
+    }
+
+    bool is_composite() const noexcept
+    {
+        return (_node_flags & composite_flag) != 0;
+    }
+
+    bool is_reference() const noexcept
+    {
+        return kind() >= reference_kind;
+    }
+
+    bool is_null_reference() const noexcept
+    {
+        return (_node_flags & null_reference_flag) != 0;
+    }
+
+    bool is_traversable() const noexcept
+    {
+        return (_node_flags & traversable_flag) != 0;
+    }
+
+    void relocate_to(value_type &another)
+    {
+        if (another->is_composite())
+        {
+            using hooks = mutation_hooks<self>;
+            if (hooks::enabled)
+            {
+                hooks::begin(mutation_kind::relocate_to, *this, size());
+            }
             auto p = get_parent();
             if (p)
             {
-                p->relocate_child(this, another);
+                p->relocate_child(this, another);
+            }
+            else
+            {
+                another->push_back(smart_ptr(this));
+            }
+            if (hooks::enabled)
+            {
+                hooks::end(mutation_kind::relocate_to, *this, 1);
+            }
+        }
+    }
+
+    // Pre-order iterators
+
+    auto df_pre_order_begin()
+    {
+        return df_pre_order_hierarchical_iterator(begin(), end());
+    }
+
+    auto df_pre_order_end()
+    {
+        return df_pre_order_hierarchical_iterator(end(), end());
+    }
+
+    auto cdf_pre_order_begin() const
+    {
+        return const_df_pre_order_hierarchical_iterator(cbegin(), cend());
+    }
+
+    auto cdf_pre_order_end() const
+    {
+        return const_df_pre_order_hierarchical_iterator(cend(), cend());
+    }
+
+    auto rdf_pre_order_begin()
+    {
+        return reverse_df_pre_order_hierarchical_iterator(rbegin(), rend());
+    }
+
+    auto rdf_pre_order_end()
+    {
+        return reverse_df_pre_order_hierarchical_iterator(rend(), rend());
+    }
+
+    auto crdf_pre_order_begin() const
+    {
+        return const_reverse_df_pre_order_hierarchical_iterator(crbegin(), crend());
+    }
+
+    auto crdf_pre_order_end() const
+    {
+        return const_reverse_df_pre_order_hierarchical_iterator(crend(), crend());
+    }
+
+    // Post-order iterators
+
+    auto df_post_order_begin()
+    {
+        return df_post_order_hierarchical_iterator(begin(), end());
+    }
+
+    auto df_post_order_end()
+    {
+        return df_post_order_hierarchical_iterator(end(), end());
+    }
+
+    auto cdf_post_order_begin() const
+    {
+        return const_df_post_order_hierarchical_iterator(cbegin(), cend());
+    }
+
+    auto cdf_post_order_end() const
+    {
+        return const_df_post_order_hierarchical_iterator(cend(), cend());
+    }
+
+    auto rdf_post_order_begin()
+    {
+        return reverse_df_post_order_hierarchical_iterator(rbegin(), rend());
+    }
+
+    auto rdf_post_order_end()
+    {
+        return reverse_df_post_order_hierarchical_iterator(rend(), rend());
+    }
+
+    auto crdf_post_order_begin() const
+    {
+        return const_reverse_df_post_order_hierarchical_iterator(crbegin(), crend());
+    }
+
+    auto crdf_post_order_end() const
+    {
+        return const_reverse_df_post_order_hierarchical_iterator(crend(), crend());
+    }
+
+    // Breadth-first iterators
+
+    auto bf_begin()
+    {
+        return bf_hierarchical_iterator(begin(), end());
+    }
+
+    auto bf_end()
+    {
+        return bf_hierarchical_iterator();
+    }
+
+    auto cbf_begin() const
+    {
+        return const_bf_hierarchical_iterator(cbegin(), cend());
+    }
+
+    auto cbf_end() const
+    {
+        return const_bf_hierarchical_iterator();
+    }
+
+    auto rbf_begin()
+    {
+        return reverse_bf_hierarchical_iterator(rbegin(), rend());
+    }
+
+    auto rbf_end()
+    {
+        return reverse_bf_hierarchical_iterator();
+    }
+
+    auto crbf_begin() const
+    {
+        return const_reverse_bf_hierarchical_iterator(crbegin(), crend());
+    }
+
+    auto crbf_end() const
+    {
+        return const_reverse_bf_hierarchical_iterator();
+    }
+
+    bool awaits_destruction() const noexcept
+    {
+        return _awaits_destruction;
+    }
+
+    // Dispatches to the visitor overload of the class of this node (see `visitor`).
+    template <class Visitor>
+    void accept(Visitor &concrete_visitor)
+    {
+        static_cast<typename Visitor::visitor_type&>(concrete_visitor).dispatch(*this);
+    }
+
+    virtual ~abstract() noexcept
+    {
+    }
+
+protected:
+    virtual void set_parent(self * const ptr_to_parent)
+    {
+        _parent = ptr_to_parent;
+    }
+
+    virtual void mark_for_delete() noexcept
+    {
+        _awaits_destruction = true;
+    }
+
+    // Identifies the `composite` class template instance a composite derives from, so that
+    // whole-hierarchy algorithms of one composite class can tell which children they may descend
+    // into directly; null for other nodes.
+    virtual const void *composite_class_tag() const noexcept
+    {
+        return nullptr;
+    }
+
+    // Identifies the `identifiable` class template instance a node derives from, so that ID
+    // registries only index nodes of their own class; null for other nodes.
+    virtual const void *identity_class_tag() const noexcept
+    {
+        return nullptr;
+    }
+
+    // Identifies the `observable` class template instance a node derives from, so that change
+    // notifications only travel through nodes of their own class; null for other nodes.
+    virtual const void *observable_class_tag() const noexcept
+    {
+        return nullptr;
+    }
+
+    // Identifies the `aggregated` class template instance a node derives from, so that aggregates
+    // only fold in nodes of their own class; null for other nodes.
+    virtual const void *aggregated_class_tag() const noexcept
+    {
+        return nullptr;
+    }
+
+    virtual void erase_awaiting_destruction()
+    {
+    }
+
+    virtual void relocate_child(raw_pointer_to_base_interface const child, value_type &another)
+    {
+    }
+
+    // Hands the children of a detached node to `disposer` without calling any hooks.
+    virtual void release_children(node_disposer<value_type> &disposer)
+    {
+    }
+
+    // Called by composites right after a child is attached and right before it is detached.
+    virtual void on_child_attached(raw_pointer_to_base_interface const child)
+    {
+    }
+
+    virtual void on_child_detached(raw_pointer_to_base_interface const child)
+    {
+    }
+
+    void set_node_flags(const unsigned char flags) noexcept
+    {
+        _node_flags = flags;
+    }
+
+    enum class children_copy_mode
+    {
+        cloned,
+        shared,
+        skipped
+    };
+
+    // Copy of this node without its children, filled in by the iterative copy of composites.
+    raw_pointer_to_base_interface childless_clone() const
+    {
+        return clone_with(children_copy_mode::skipped);
+    }
+
+    // Consumed by the copy constructor of the node being cloned by `clone_with()`.
+    static children_copy_mode take_children_copy_mode() noexcept
+    {
+        const auto mode = requested_children_copy_mode();
+        requested_children_copy_mode() = children_copy_mode::cloned;
+        return mode;
+    }
+
+private:
+    raw_pointer_to_base_interface clone_with(const children_copy_mode mode) const
+    {
+        requested_children_copy_mode() = mode;
+        const auto copy = clone();
+        requested_children_copy_mode() = children_copy_mode::cloned;
+        return copy;
+    }
+
+    static children_copy_mode &requested_children_copy_mode() noexcept
+    {
+        static thread_local children_copy_mode mode = children_copy_mode::cloned;
+        return mode;
+    }
+
+protected:
+    raw_pointer_to_base_interface _parent{ nullptr };
+    unsigned char _node_flags{ 0 };
+
+private:
+    bool _awaits_destruction{ false };
+};
+
+
+
+template <class Base>
+class leaf : public Base
+{
+    using self = leaf;
+    using parent = Base;
+
+public:
+    using value_type = typename Base::iterator_traits::value_type;
+    using raw_pointer_to_base_interface = typename Base::raw_pointer_to_base_interface;
+
+    using iterator = typename Base::iterator;
+    using const_iterator = typename Base::const_iterator;
+    using reverse_iterator = typename Base::reverse_iterator;
+    using const_reverse_iterator = typename Base::const_reverse_iterator;
+
+public:
+    template <class IteratorBaseType>
+    class leaf_iterator_impl : public IteratorBaseType::implementation
+    {
+        using category = typename IteratorBaseType::iterator_category;
+        using reference = typename IteratorBaseType::reference;
+        using pointer = typename IteratorBaseType::pointer;
+        using difference_type = typename IteratorBaseType::difference_type;
+
+        using self = typename IteratorBaseType::implementation;
+        using base_interface = typename IteratorBaseType::implementation::base_interface;
+
+    public:
+        leaf_iterator_impl() : _ptr(nullptr)
+        {
+        }
+
+        reference ref() const override
+        {
+            return *_ptr;
+        }
+
+        pointer ptr() const override
+        {
+            return _ptr;
+        }
+
+        self &inc() override
+        {
+            return *this;
+        }
+
+        self &dec() override
+        {
+            return *this;
+        }
+
+        self *clone() override
+        {
+            return new leaf_iterator_impl();
+        }
+
+        bool equal(const base_interface *another) const override
+        {
+            // always nullptr
+            return true;
+        }
+
+        bool less(const base_interface *another) const override
+        {
+            return false;
+        }
+
+        bool greater(const base_interface *another) const override
+        {
+            return false;
+        }
+
+        reference offset(const difference_type diff) const override
+        {
+            static pointer var = nullptr;
+            return *var;
+        }
+
+    private:
+        typename IteratorBaseType::pointer _ptr;
+    };
+
+public:
+    leaf() : parent()
+    {
+        this->set_node_flags(parent::leaf_kind | parent::leaf_flag | parent::traversable_flag);
+    }
+
+    void push_back(const value_type &another) override
+    {
+
+    }
+
+    void push_back(value_type &&another) override
+    {
+
+    }
+
+    iterator begin() override
+    {
+        return end();
+    }
+
+    iterator end() override
+    {
+        return iterator(std::make_unique<leaf_iterator_impl<iterator>>());
+    }
+
+    const_iterator cbegin() const override
+    {
+        return cend();
+    }
+
+    const_iterator cend() const override
+    {
+        return const_iterator(std::make_unique<leaf_iterator_impl<const_iterator>>());
+    }
+
+    reverse_iterator rbegin() override
+    {
+        return rend();
+    }
+
+    reverse_iterator rend() override
+    {
+        return reverse_iterator(std::make_unique<leaf_iterator_impl<reverse_iterator>>());
+    }
+
+    const_reverse_iterator crbegin() const override
+    {
+        return crend();
+    }
+
+    const_reverse_iterator crend() const override
+    {
+        return const_reverse_iterator(std::make_unique<leaf_iterator_impl<const_reverse_iterator>>());
+    }
+
+    void clear() override
+    {
+    }
+
+    size_t size() const override final
+    {
+        return 0;
+    }
+
+    bool empty() const override final
+    {
+        return true;
+    }
+
+    size_t nested_hierarchy_size() const override final
+    {
+        return 0;
+    }
+
+    raw_pointer_to_base_interface clone() const override
+    {
+        return new self(*this);
+    }
+};
+
+
+
+namespace
+{
+
+template <class Composite, bool is_copy_constructible>
+    struct composite_push_back_impl;
+
+
+template <class IteratorTag, class Iterator>
+    struct composite_iterator_categoty_impl;
+
+}
+
+
+template <class Base, template <class T> class Container>
+class composite : public Base
+{  
+    using self = composite;
+    using parent = Base;
+
+public:
+    using value_type = typename Base::iterator_traits::value_type;
+    using smart_ptr = typename Base::smart_ptr;
+    using raw_pointer_to_base_interface = typename Base::raw_pointer_to_base_interface;
+
+    using iterator = typename Base::iterator;
+    using const_iterator = typename Base::const_iterator;
+    using reverse_iterator = typename Base::reverse_iterator;
+    using const_reverse_iterator = typename Base::const_reverse_iterator;
+
+    using container_type = typename Container<value_type>::type;
+    using initializer_list = std::initializer_list<value_type>;
+
+private:
+    using abstract_type = typename std::remove_pointer<raw_pointer_to_base_interface>::type;
+    using hooks = mutation_hooks<abstract_type>;
+
+public:
+    template <class IteratorBaseType, class UnderlyingContainerIterator>
+    class iterator_impl_template : public IteratorBaseType::implementation
+    {
+    public:
+        using category  = typename IteratorBaseType::iterator_category;
+        using reference = typename IteratorBaseType::reference;
+        using pointer   = typename IteratorBaseType::pointer;
+        using difference_type = typename IteratorBaseType::difference_type;
+
+        using self = typename IteratorBaseType::implementation;
+        using base_interface = typename self::base_interface;
+
+    private:
+        using iterator_impl_specialization = composite_iterator_categoty_impl<category, UnderlyingContainerIterator>;
+
+    public:
+        iterator_impl_template(UnderlyingContainerIterator &it) : _it(it)
+        {
+        }
+
+        iterator_impl_template(UnderlyingContainerIterator &&it) : _it(std::move(it))
+        {
+        }
+
+        reference ref() const override
+        {
+            return *_it;
+        }
+
+        pointer ptr() const override
+        {
+            return _it.operator->();
+        }
+
+        self &inc() override
+        {
+            ++_it; return *this;
+        }
+
+        self &dec() override
+        {
+            --_it; return *this;
+        }
+
+        self *clone() override
+        {
+            return new iterator_impl_template(_it);
+        }
+
+        bool equal(const base_interface *another) const override
+        {
+            return _it == upcast(another)->_it;
+        }
+
+        bool less(const base_interface *another) const override
+        {
+            return iterator_impl_specialization::less(_it, upcast(another)->_it);
+        }
+
+        bool greater(const base_interface *another) const override
+        {
+            return iterator_impl_specialization::greater(_it, upcast(another)->_it);
+        }
+
+        reference offset(const difference_type diff) const override
+        {
+            return iterator_impl_specialization::offset(_it, diff);
+        }
+
+        void advance_forwards(const difference_type diff) override
+        {
+            _it = iterator_impl_specialization::advance_forwards(_it, diff);
+        }
+
+        void advance_backwards(const difference_type diff) override
+        {
+            _it = iterator_impl_specialization::advance_forwards(_it, diff);
+        }
+
+        difference_type difference(const base_interface *another) const override
+        {
+            return iterator_impl_specialization::difference(_it, upcast(another)->_it);
+        }
+
+        UnderlyingContainerIterator get_cont_iterator() const
+        {
+            return _it;
+        }
+
+    private:
+        iterator_impl_template *upcast(const base_interface *ptr) const
+        {
+            return (iterator_impl_template*)ptr;
+        }
+
+    private:
+        UnderlyingContainerIterator _it;
+    };
+
+    using iterator_impl               = iterator_impl_template<iterator, typename container_type::iterator>;
+    using reverse_iterator_impl       = iterator_impl_template<reverse_iterator, typename container_type::reverse_iterator>;
+
+    using const_iterator_impl         = iterator_impl_template<const_iterator, typename container_type::const_iterator>;
+    using const_reverse_iterator_impl = iterator_impl_template<const_reverse_iterator, typename container_type::const_reverse_iterator>;
+
+public:
+    composite() : parent()
+    {
+        init_node_flags();
+    }
+
+    composite(initializer_list &&init_list)
+        : parent(), children(std::move(init_list))
+    {
+        init_node_flags();
+    }
+
+    composite(const self &another)
+    {
+        init_node_flags();
+        this->_parent = another._parent;
+        const auto mode = parent::take_children_copy_mode();
+        if (mode == parent::children_copy_mode::skipped)
+        {
+            return;
+        }
+
+        if (hooks::enabled)
+        {
+            hooks::begin(mutation_kind::clone, another, another.children.size());
+        }
+        size_t copied = 0;
+        if (mode == parent::children_copy_mode::shared)
+        {
+            copied = share_children(another, std::is_copy_constructible<value_type>());
+        }
+        else
+        {
+            copied = clone_children(another);
+        }
+        if (hooks::enabled)
+        {
+            hooks::end(mutation_kind::clone, another, copied);
+        }
+    }
+
+    // Children are dismantled iteratively, so that deep chains do not recurse once per level.
+    ~composite()
+    {
+        if (!children.empty())
+        {
+            incremental_reclaimer<value_type> reclaimer;
+            release_children(reclaimer);
+        }
+    }
+
+    composite(self &&another) :
+        children(std::move(another.children))
+    {
+        init_node_flags();
+        this->_parent = another._parent;
+        for (auto &obj : children)
+        {
+            obj->set_parent(this);
+        }
+    }
+
+    self &operator=(const self &another)
+    {
+        set_parent(another.get_parent());
+        clone_children(another);
+        return *this;
+    }
+
+    self &operator=(self &&another)
+    {
+        set_parent(another.get_parent());
+        another.set_parent(nullptr);
+        children = std::move(another.children);
+    }
+
+    container_type &cont()
+    {
+        return children;
+    }
+
+    const container_type &cont() const
+    {
+        return children;
+    }
+
+    void push_back(const value_type &another) override
+    {
+        composite_push_back_impl<self, std::is_copy_constructible<value_type>::value>::call(this, another);
+    }
+
+    void push_back(value_type &&another) override
+    {
+        if (hooks::enabled)
+        {
+            hooks::begin(mutation_kind::push_back, *this, children.size());
+        }
+        const auto child = another.get();
+        child->set_parent(this);
+        children.push_back(std::move(another));
+        this->on_child_attached(child);
+        if (hooks::enabled)
+        {
+            hooks::end(mutation_kind::push_back, *this, 1);
+        }
+    }
+
+
+    enum references_remove_mode
+    {
+        do_not_track_references,
+        remove_references,
+        nullify_references
+    };
+
+    template <class Pred>
+    void remove_if(Pred &func, const references_remove_mode mode = remove_references)
+    {
+        if (hooks::enabled)
+        {
+            hooks::begin(mutation_kind::remove_if, *this, children.size());
+        }
+
+        size_t removed = remove_if__mark_for_delete(func);
+
+        if (mode != do_not_track_references)
+        {
+            removed += remove_if__handle_references(mode == nullify_references);
+        }
+
+        erase_awaiting_destruction();
+
+        if (hooks::enabled)
+        {
+            hooks::end(mutation_kind::remove_if, *this, removed);
+        }
+    }
+
+    iterator begin() override
+    {
+        return iterator(std::make_unique<iterator_impl>(children.begin()));
+    }
+
+    iterator end() override
+    {
+        return iterator(std::make_unique<iterator_impl>(children.end()));
+    }
+
+    reverse_iterator rbegin() override
+    {
+        return reverse_iterator(std::make_unique<reverse_iterator_impl>(children.rbegin()));
+    }
+
+    reverse_iterator rend() override
+    {
+        return reverse_iterator(std::make_unique<reverse_iterator_impl>(children.rend()));
+    }
+
+    const_iterator cbegin() const override
+    {
+        return const_iterator(std::make_unique<const_iterator_impl>(children.cbegin()));
+    }
+
+    const_iterator cend() const override
+    {
+        return const_iterator(std::make_unique<const_iterator_impl>(children.cend()));
+    }
+
+    const_reverse_iterator crbegin() const override
+    {
+        return const_reverse_iterator(std::make_unique<const_reverse_iterator_impl>(children.crbegin()));
+    }
+
+    const_reverse_iterator crend() const override
+    {
+        return const_reverse_iterator(std::make_unique<const_reverse_iterator_impl>(children.crend()));
+    }
+
+    void clear() override
+    {
+        const size_t removed = children.size();
+        if (hooks::enabled)
+        {
+            hooks::begin(mutation_kind::clear, *this, removed);
+        }
+        for (auto &obj : children)
+        {
+            this->on_child_detached(obj.get());
+        }
+        if (auto disposer = node_disposer<value_type>::current())
+        {
+            for (auto &obj : children)
+            {
+                disposer->dispose(std::move(obj));
+            }
+        }
+        children.clear();
+        ++_structure_version;
+        if (hooks::enabled)
+        {
+            hooks::end(mutation_kind::clear, *this, removed);
+        }
+    }
+
+    // Incremented whenever a child leaves this composite through `remove_if`, `clear` or
+    // `relocate_to`, so that cached paths through this composite can be validated.
+    size_t structure_version() const noexcept
+    {
+        return _structure_version;
+    }
+
+    size_t size() const override
+    {
+        return children.size();
+    }
+
+    bool empty() const override
+    {
+        return children.empty();
+    }
+
+    size_t nested_hierarchy_size() const override final
+    {
+        size_t count = 0;
+        walk_children<true>(this, [&count](const value_type &obj, size_t)
+        {
+            ++count;
+            if (obj->is_reference() || (obj->is_composite() && !is_of_this_class(*obj)))
+            {
+                count += obj->nested_hierarchy_size();
+                return false;
+            }
+            return true;
+        });
+
+        return count;
+    }
+
+    raw_pointer_to_base_interface clone() const override
+    {
+        return new self(*this);
+    }
+
+    void add_structure_footprint(memory_footprint &footprint) const override
+    {
+        parent::add_structure_footprint(footprint);
+        footprint.library_field_bytes += sizeof(self) - sizeof(parent);
+        add_container_footprint(children, footprint, lookup_priority<2>());
+    }
+
+protected:
+    // Pre-order walk over the descendants of `root` on an explicit stack, so that deep hierarchies
+    // do not recurse once per level. `func(child, depth)` is called for every child reached and
+    // returns whether to descend into it; references are never descended into. Composites of this
+    // class are descended into through their containers, other composites through their polymorphic
+    // iterators. With `guarded`, the children of every composite of this class on the current path
+    // stay locked by `lock_children()`; other composites are guarded by their own iterators.
+    template <bool guarded, class Node, class Func>
+    static void walk_children(Node * const root, Func &&func)
+    {
+        static_assert(std::is_same<typename std::remove_const<Node>::type, self>::value,
+            "walks start at composites of this class");
+
+        using iterator_type = decltype(root->children.begin());
+        using foreign_iterator = typename std::conditional<std::is_const<Node>::value, const_iterator, iterator>::type;
+        struct frame
+        {
+            Node *node;         // null for composites of other classes, whose iterators are in `foreign`
+            iterator_type it;
+        };
+        using foreign_frame = std::pair<foreign_iterator, foreign_iterator>;
+
+        std::vector<frame> stack;
+        std::vector<foreign_frame> foreign;
+        auto enter = [&stack, &foreign](const value_type &obj)
+        {
+            if (is_of_this_class(*obj))
+            {
+                const auto node = static_cast<Node*>(obj.get());
+                if (guarded)
+                {
+                    node->lock_children();
+                }
+                stack.push_back(frame{ node, node->children.begin() });
+            }
+            else
+            {
+                foreign.push_back(foreign_children(obj.get(), std::is_const<Node>()));
+                stack.push_back(frame{ nullptr, iterator_type() });
+            }
+        };
+
+        if (guarded)
+        {
+            root->lock_children();
+        }
+        stack.push_back(frame{ root, root->children.begin() });
+        while (!stack.empty())
+        {
+            auto &top = stack.back();
+            if (top.node)
+            {
+                if (top.it == top.node->children.end())
+                {
+                    if (guarded)
+                    {
+                        top.node->unlock_children();
+                    }
+                    stack.pop_back();
+                    continue;
+                }
+
+                auto &obj = *top.it;
+                ++top.it;
+                if (func(obj, stack.size() - 1) && !obj->is_reference() && obj->is_composite())
+                {
+                    enter(obj);
+                }
+            }
+            else
+            {
+                auto &top_foreign = foreign.back();
+                if (top_foreign.first == top_foreign.second)
+                {
+                    foreign.pop_back();
+                    stack.pop_back();
+                    continue;
+                }
+
+                auto &obj = *top_foreign.first;
+                ++top_foreign.first;
+                if (func(obj, stack.size() - 1) && !obj->is_reference() && obj->is_composite())
+                {
+                    enter(obj);
+                }
+            }
+        }
+    }
+
+    // Whether `node` is a composite of this class or of a class derived from it.
+    static bool is_of_this_class(const abstract_type &node) noexcept
+    {
+        return node.composite_class_tag() == class_tag();
+    }
+
+    const void *composite_class_tag() const noexcept override
+    {
+        return class_tag();
+    }
+
+    // Keep the children of this composite from changing during a guarded walk.
+    virtual void lock_children() const
+    {
+    }
+
+    virtual void unlock_children() const
+    {
+    }
+
+    // Called on copies of composites once their children are copied into them.
+    virtual void on_children_copied()
+    {
+    }
+
+private:
+    void init_node_flags() noexcept
+    {
+        this->set_node_flags(parent::composite_kind | parent::composite_flag | parent::traversable_flag);
+    }
+
+    static const void *class_tag() noexcept
+    {
+        static const char tag = 0;
+        return &tag;
+    }
+
+    static std::pair<iterator, iterator> foreign_children(abstract_type * const node, std::false_type)
+    {
+        return std::make_pair(node->begin(), node->end());
+    }
+
+    static std::pair<const_iterator, const_iterator> foreign_children(const abstract_type * const node, std::true_type)
+    {
+        return std::make_pair(node->cbegin(), node->cend());
+    }
+
+    // Copies are attached without hooks, as by the copy constructors of the recursive version.
+    // The composites below this one are complete objects, so they get `on_children_copied()`.
+    // Composites of other classes are cloned whole by their own `clone()`.
+    // Returns the number of copied nodes.
+    size_t clone_children(const self &another)
+    {
+        std::vector<self*> destinations{ this };
+        std::vector<self*> copied;
+        size_t count = 0;
+        walk_children<true>(&another, [&destinations, &copied, &count](const value_type &ptr, const size_t depth)
+        {
+            ++count;
+            destinations.resize(depth + 1);
+            const auto destination = destinations.back();
+            const bool descend = !ptr->is_reference() && ptr->is_composite() && is_of_this_class(*ptr);
+            const auto copy = descend ? ptr->childless_clone() : ptr->clone();
+            copy->set_parent(destination);
+            destination->children.emplace_back(copy);
+            if (descend)
+            {
+                destinations.push_back(static_cast<self*>(copy));
+                copied.push_back(destinations.back());
+            }
+            else if (!ptr->is_reference() && ptr->is_composite())
+            {
+                count += ptr->nested_hierarchy_size();
+            }
+            return descend;
+        });
+
+        for (auto node : copied)
+        {
+            node->on_children_copied();
+        }
+        return count;
+    }
+
+    // Shared children keep their parent.
+    size_t share_children(const self &another, std::true_type)
+    {
+        for (auto &ptr : another.children)
+        {
+            children.push_back(ptr);
+        }
+        return children.size();
+    }
+
+    size_t share_children(const self &another, std::false_type)
+    {
+        return clone_children(another);
+    }
+
+    // Both return the number of marked nodes.
+    template <class Pred>
+    size_t remove_if__mark_for_delete(Pred &func)
+    {
+        size_t marked = 0;
+        walk_children<false>(this, [&func, &marked](value_type &obj, size_t)
+        {
+            if (obj->is_reference())
+            {
+                return false;
+            }
+            if (func(obj))
+            {
+                obj->mark_for_delete();
+                ++marked;
+                return false;
+            }
+            return true;
+        });
+        return marked;
+    }
+
+    size_t remove_if__handle_references(const bool nullify)
+    {
+        size_t marked = 0;
+        walk_children<false>(this, [nullify, &marked](value_type &obj, size_t)
+        {
+            if (obj->is_reference())
+            {
+                auto ref = static_cast<typename parent::reference*>(obj.get());
+                if (nullify)
+                {
+                    ref->reset();
+                }
+                else if (!ref->awaits_destruction())
+                {
+                    ref->mark_for_delete();
+                    ++marked;
+                }
+            }
+            return true;
+        });
+        return marked;
+    }
+
+protected:
+    void relocate_child(raw_pointer_to_base_interface const child, value_type &another) override
+    {
+        // `another` may be a slot of this container, so take its target before erasing.
+        const auto destination = another.get();
+        value_type relocated = detach_child(child);
+        if (relocated)
+        {
+            destination->push_back(std::move(relocated));
+        }
+    }
+
+    // Moves `child` out of the container; returns an empty pointer if it is not a child.
+    value_type detach_child(raw_pointer_to_base_interface const child)
+    {
+        auto it = std::find_if(children.begin(), children.end(),
+            [child](const auto &ptr) {return ptr.get() == child; });
+
+        if (it == children.end())
+        {
+            return value_type();
+        }
+
+        this->on_child_detached(child);
+        value_type detached = std::move(*it);
+        children.erase(it);
+        ++_structure_version;
+        return detached;
+    }
+
+    // Composites of other classes erase their subtrees by their own override.
+    void erase_awaiting_destruction() override
+    {
+        std::vector<abstract_type*> stack{ this };
+        while (!stack.empty())
+        {
+            const auto node = stack.back();
+            stack.pop_back();
+            if (!is_of_this_class(*node))
+            {
+                node->erase_awaiting_destruction();
+                continue;
+            }
+            const auto composite_node = static_cast<self*>(node);
+            composite_node->erase_own_awaiting_destruction();
+
+            // Reversed, so that composites are processed in pre-order as by the recursive version.
+            const auto first = stack.size();
+            for (auto &obj : composite_node->children)
+            {
+                if (!obj->is_reference() && obj->is_composite())
+                {
+                    stack.push_back(obj.get());
+                }
+            }
+            std::reverse(stack.begin() + first, stack.end());
+        }
+    }
+
+    // The walk allocates its stack; running out of memory here terminates, as running out of call
+    // stack did for the recursive version.
+    void mark_for_delete() noexcept override
+    {
+        parent::mark_for_delete();
+        walk_children<false>(this, [](value_type &obj, size_t)
+        {
+            if (obj->is_composite() && !is_of_this_class(*obj))
+            {
+                obj->mark_for_delete();
+                return false;
+            }
+            obj->abstract_type::mark_for_delete();
+            return true;
+        });
+    }
+
+    void release_children(node_disposer<value_type> &disposer) override
+    {
+        for (auto &obj : children)
+        {
+            disposer.dispose(std::move(obj));
+        }
+        children.clear();
+    }
+
+private:
+    void erase_own_awaiting_destruction()
+    {
+        for (auto &obj : children)
+        {
+            if (obj->awaits_destruction())
+            {
+                this->on_child_detached(obj.get());
+                ++_structure_version;
+            }
+        }
+
+        auto it = children.end();
+        if (auto disposer = node_disposer<value_type>::current())
+        {
+            for (auto &obj : children)
+            {
+                if (obj->awaits_destruction())
+                {
+                    disposer->dispose(std::move(obj));
+                }
+            }
+            it = std::remove_if(children.begin(), children.end(),
+                [](const smart_ptr &obj) { return !obj; }
+            );
+        }
+        else
+        {
+            it = std::remove_if(children.begin(), children.end(),
+                [](const smart_ptr &obj) { return obj->awaits_destruction(); }
+            );
+        }
+
+        children.erase(it, children.end());
+    }
+
+protected:
+    container_type children;
+
+private:
+    size_t _structure_version{ 0 };
+};
+
+
+
+namespace
+{
+
+template <class Composite, bool is_copy_constructible>
+struct composite_push_back_impl
+{
+    static void call(Composite *ptr, const typename Composite::value_type &val)
+    {
+        ptr->push_back(typename Composite::value_type(val));
+    }
+};
+
+template <class Composite>
+struct composite_push_back_impl<Composite, false>
+{
+    static void call(Composite *ptr, const typename Composite::value_type &val)
+    {
+    }
+};
+
+
+template <class IteratorTag, class Iterator>
+struct composite_iterator_categoty_impl
+{
+    using difference_type = typename Iterator::difference_type;
+
+    static bool less(const Iterator &a, const Iterator &b)
+    {
+        return a < b;
+    }
+
+    static bool greater(const Iterator &a, const Iterator &b)
+    {
+        return a > b;
+    }
+
+    static typename Iterator::reference offset(const Iterator &it, const difference_type diff)
+    {
+        return it[diff];
+    }
+
+    static Iterator advance_forwards(Iterator &it, const difference_type diff)
+    {
+        return it + diff;
+    }
+
+    static Iterator advance_backwards(Iterator &it, const difference_type diff)
+    {
+        return it - diff;
+    }
+
+    static difference_type difference(const Iterator &a, const Iterator &b)
+    {
+        return a - b;
+    }
+};
+
+
+template <class Iterator>
+struct composite_iterator_categoty_impl<std::bidirectional_iterator_tag, Iterator>
+{
+    using difference_type = typename Iterator::difference_type;
+
+    static bool less(const Iterator &a, const Iterator &b)
+    {
+        return false;
+    }
+
+    static bool greater(const Iterator &a, const Iterator &b)
+    {
+        return false;
+    }
+
+    static typename Iterator::reference offset(const Iterator &it, const difference_type diff)
+    {
+        static typename Iterator::pointer obj = nullptr;
+        return *obj;
+    }
+
+    static Iterator advance_forwards(Iterator &it, const difference_type diff)
+    {
+        return it;
+    }
+
+    static Iterator advance_backwards(Iterator &it, const difference_type diff)
+    {
+        return it;
+    }
+
+    static difference_type difference(const Iterator &a, const Iterator &b)
+    {
+        return difference_type{};
+    }
+};
+
+} // hidden composite impl details namespace
+
+
+
+template <class Base, class KeyOf>
+struct key_of_result
+{
+    using abstract_type = typename std::remove_pointer<typename Base::raw_pointer_to_base_interface>::type;
+    using type = typename std::decay<decltype(std::declval<const KeyOf&>()(std::declval<const abstract_type&>()))>::type;
+};
+
+
+// Composite which keeps a hash index from `KeyOf()(child)` to its children. The index follows
+// `push_back`, `remove_if`, `clear`, `relocate_to` and copying; call `rebuild_index()` after
+// editing `cont()` directly or changing keys of attached children.
+template <class Base, class KeyOf, class Hash, template <class T> class Container>
+class keyed_composite : public composite<Base, Container>
+{
+    using self = keyed_composite;
+    using parent = composite<Base, Container>;
+
+public:
+    using raw_pointer_to_base_interface = typename parent::raw_pointer_to_base_interface;
+    using key_type = typename key_of_result<Base, KeyOf>::type;
+    using key_of_type = KeyOf;
+    using hasher = typename std::conditional<std::is_void<Hash>::value, std::hash<key_type>, Hash>::type;
+    using index_type = std::unordered_multimap<key_type, raw_pointer_to_base_interface, hasher>;
+
+public:
+    keyed_composite()
+    {
+    }
+
+    keyed_composite(typename parent::initializer_list &&init_list) :
+        parent(std::move(init_list))
+    {
+        rebuild_index();
+    }
+
+    keyed_composite(const self &another) :
+        parent(another), key_of(another.key_of)
+    {
+        rebuild_index();
+    }
+
+    keyed_composite(self &&another) :
+        parent(std::move(another)), key_of(std::move(another.key_of)), index(std::move(another.index))
+    {
+        another.index.clear();
+    }
+
+    self &operator=(const self &another)
+    {
+        parent::operator=(another);
+        rebuild_index();
+        return *this;
+    }
+
+    raw_pointer_to_base_interface find(const key_type &key) const
+    {
+        auto it = index.find(key);
+        return it != index.end() ? it->second : nullptr;
+    }
+
+    bool contains(const key_type &key) const
+    {
+        return index.find(key) != index.end();
+    }
+
+    size_t count(const key_type &key) const
+    {
+        return index.count(key);
+    }
+
+    auto equal_range(const key_type &key) const
+    {
+        return index.equal_range(key);
+    }
+
+    const index_type &get_index() const noexcept
+    {
+        return index;
+    }
+
+    void rebuild_index()
+    {
+        index.clear();
+        index.reserve(this->children.size());
+        for (auto &obj : this->children)
+        {
+            index.emplace(key_of(*obj), obj.get());
+        }
+    }
+
+    raw_pointer_to_base_interface clone() const override
+    {
+        return new self(*this);
+    }
+
+    // Counts the index as a node-based hash table.
+    void add_structure_footprint(memory_footprint &footprint) const override
+    {
+        parent::add_structure_footprint(footprint);
+        footprint.library_field_bytes += sizeof(self) - sizeof(parent);
+        footprint.container_bytes += index.bucket_count() * sizeof(void*) +
+            index.size() * (sizeof(typename index_type::value_type) + 2 * sizeof(void*));
+        footprint.allocations += index.size() + (index.bucket_count() > 1 ? 1 : 0);
+    }
+
+protected:
+    void on_children_copied() override
+    {
+        parent::on_children_copied();
+        rebuild_index();
+    }
+
+    void on_child_attached(raw_pointer_to_base_interface const child) override
+    {
+        parent::on_child_attached(child);
+        index.emplace(key_of(*child), child);
+    }
+
+    void on_child_detached(raw_pointer_to_base_interface const child) override
+    {
+        auto range = index.equal_range(key_of(*child));
+        auto it = std::find_if(range.first, range.second, [child](const auto &entry) { return entry.second == child; });
+        if (it == range.second)
+        {
+            // The key has changed since the child was attached.
+            it = std::find_if(index.begin(), index.end(), [child](const auto &entry) { return entry.second == child; });
+        }
+
+        if (it != index.end())
+        {
+            index.erase(it);
+        }
+        parent::on_child_detached(child);
+    }
+
+private:
+    KeyOf key_of;
+    index_type index;
+};
+
+
+
+// Reader/writer spinlock for short critical sections. A waiting writer blocks new readers, but
+// a thread may always take shared ownership it already holds, which iterators rely on, and the
+// thread holding exclusive ownership may take shared ownership too, so that code it calls can
+// read what it has locked; shared ownership is tracked per thread, so it must be released by
+// the acquiring thread. Exclusive ownership is not re-entrant.
+class rw_spinlock
+{
+    static constexpr unsigned writer = 1u << 31;
+    static constexpr unsigned writer_waiting = 1u << 30;
+
+public:
+    rw_spinlock() noexcept
+    {
+    }
+
+    rw_spinlock(const rw_spinlock &) = delete;
+    rw_spinlock &operator=(const rw_spinlock &) = delete;
+
+    void lock() noexcept
+    {
+        unsigned current = state.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            if ((current & ~writer_waiting) == 0)
+            {
+                if (state.compare_exchange_weak(current, writer, std::memory_order_acquire, std::memory_order_relaxed))
+                {
+                    owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+                    return;
+                }
+            }
+            else if (!(current & writer_waiting))
+            {
+                state.compare_exchange_weak(current, current | writer_waiting, std::memory_order_relaxed);
+            }
+            else
+            {
+                std::this_thread::yield();
+                current = state.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void unlock() noexcept
+    {
+        owner.store(std::thread::id(), std::memory_order_relaxed);
+        state.fetch_and(~writer, std::memory_order_release);
+    }
+
+    // Shared ownership taken by the writer outlives its exclusive ownership as a regular one.
+    void lock_shared()
+    {
+        unsigned &held = held_by_this_thread();
+        if (held > 0 || owner.load(std::memory_order_relaxed) == std::this_thread::get_id())
+        {
+            state.fetch_add(1, std::memory_order_acquire);
+            ++held;
+            return;
+        }
+
+        unsigned current = state.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            if (current & (writer | writer_waiting))
+            {
+                std::this_thread::yield();
+                current = state.load(std::memory_order_relaxed);
+            }
+            else if (state.compare_exchange_weak(current, current + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                ++held;
+                return;
+            }
+        }
+    }
+
+    void unlock_shared()
+    {
+        --held_by_this_thread();
+        state.fetch_sub(1, std::memory_order_release);
+    }
+
+    class shared_guard
+    {
+    public:
+        explicit shared_guard(const rw_spinlock &lock) :
+            lock(&const_cast<rw_spinlock&>(lock))
+        {
+            this->lock->lock_shared();
+        }
+
+        shared_guard(const shared_guard &) = delete;
+        shared_guard &operator=(const shared_guard &) = delete;
+
+        ~shared_guard()
+        {
+            if (lock)
+            {
+                lock->unlock_shared();
+            }
+        }
+
+        // Passes the ownership to the caller.
+        rw_spinlock *release() noexcept
+        {
+            auto result = lock;
+            lock = nullptr;
+            return result;
+        }
+
+    private:
+        rw_spinlock *lock;
+    };
+
+private:
+    // A thread holds few locks at a time: the composites on its current traversal path.
+    // Released entries are dropped when a new lock is looked up.
+    unsigned &held_by_this_thread() const
+    {
+        static thread_local std::vector<std::pair<const rw_spinlock*, unsigned>> held;
+
+        for (auto &entry : held)
+        {
+            if (entry.first == this)
+            {
+                return entry.second;
+            }
+        }
+
+        held.erase(std::remove_if(held.begin(), held.end(),
+            [](const auto &entry) { return entry.second == 0; }), held.end());
+        held.emplace_back(this, 0);
+        return held.back().second;
+    }
+
+private:
+    std::atomic<unsigned> state{ 0 };
+    // Only compares equal to the ID of the thread that stored it.
+    std::atomic<std::thread::id> owner{};
+};
+
+
+// Composite for hierarchies with concurrent readers and writers. Every composite has its own
+// reader/writer lock: iterators hold it shared while they exist, `push_back`, `clear` and the
+// source side of `relocate_to` hold it exclusively, and `remove_if` locks its subtree top-down.
+// Locks are only acquired from parents to children: `remove_if` locks each composite while
+// holding the locks of its ancestors, readers descend through iterators of parents they hold,
+// and other writers hold a single lock at a time. Nobody waits for an ancestor's lock while
+// holding a descendant's, so the locking cannot deadlock. The `remove_if` predicate may read
+// the locked subtree, but must not modify it. Readers must reach nodes through
+// iterators of an ancestor they still hold; a thread must not modify a composite it holds
+// iterators into.
+// Copying and moving, `cont()` and mutations of the same node by several writers are not
+// synchronized. All composites of the hierarchy must be of this type.
+template <class Base, template <class T> class Container>
+class concurrent_composite : public composite<Base, Container>
+{
+    using self = concurrent_composite;
+    using parent = composite<Base, Container>;
+
+public:
+    using value_type = typename parent::value_type;
+    using container_type = typename parent::container_type;
+    using raw_pointer_to_base_interface = typename parent::raw_pointer_to_base_interface;
+    using references_remove_mode = typename parent::references_remove_mode;
+
+    using iterator = typename parent::iterator;
+    using const_iterator = typename parent::const_iterator;
+    using reverse_iterator = typename parent::reverse_iterator;
+    using const_reverse_iterator = typename parent::const_reverse_iterator;
+
+private:
+    template <class IteratorBaseType, class UnderlyingContainerIterator>
+    class shared_iterator_impl_template :
+        public parent::template iterator_impl_template<IteratorBaseType, UnderlyingContainerIterator>
+    {
+        using impl = typename parent::template iterator_impl_template<IteratorBaseType, UnderlyingContainerIterator>;
+
+    public:
+        shared_iterator_impl_template(rw_spinlock::shared_guard &guard, UnderlyingContainerIterator &&it) :
+            impl(std::move(it)), lock(guard.release())
+        {
+        }
+
+        ~shared_iterator_impl_template()
+        {
+            lock->unlock_shared();
+        }
+
+        typename impl::self *clone() override
+        {
+            rw_spinlock::shared_guard guard(*lock);
+            return new shared_iterator_impl_template(guard, this->get_cont_iterator());
+        }
+
+    private:
+        rw_spinlock *lock;
+    };
+
+    using iterator_impl = shared_iterator_impl_template<iterator, typename container_type::iterator>;
+    using reverse_iterator_impl = shared_iterator_impl_template<reverse_iterator, typename container_type::reverse_iterator>;
+    using const_iterator_impl = shared_iterator_impl_template<const_iterator, typename container_type::const_iterator>;
+    using const_reverse_iterator_impl = shared_iterator_impl_template<const_reverse_iterator, typename container_type::const_reverse_iterator>;
+
+public:
+    concurrent_composite()
+    {
+    }
+
+    concurrent_composite(const self &another) :
+        parent(another)
+    {
+    }
+
+    concurrent_composite(self &&another) :
+        parent(std::move(another))
+    {
+    }
+
+    void push_back(const value_type &another) override
+    {
+        parent::push_back(another);
+    }
+
+    void push_back(value_type &&another) override
+    {
+        using hooks = mutation_hooks<typename std::remove_pointer<raw_pointer_to_base_interface>::type>;
+        if (hooks::enabled)
+        {
+            hooks::begin(mutation_kind::push_back, *this, size());
+        }
+        const auto child = another.get();
+        child->set_parent(this);
+        {
+            std::lock_guard<rw_spinlock> guard(lock);
+            this->children.push_back(std::move(another));
+        }
+        this->on_child_attached(child);
+        if (hooks::enabled)
+        {
+            hooks::end(mutation_kind::push_back, *this, 1);
+        }
+    }
+
+    // Removed subtrees are unlocked before they are destroyed or handed to the installed
+    // `node_disposer`, so that retired composites stay readable.
+    template <class Pred>
+    void remove_if(Pred &func, const references_remove_mode mode = parent::remove_references)
+    {
+        removed_subtrees removed;
+        lock_subtree(this);
+        {
+            typename node_disposer<value_type>::scope scope(removed);
+            parent::remove_if(func, mode);
+        }
+        unlock_subtree(this);
+        removed.unlock_and_dispose();
+    }
+
+    void clear() override
+    {
+        std::lock_guard<rw_spinlock> guard(lock);
+        parent::clear();
+    }
+
+    size_t size() const override
+    {
+        rw_spinlock::shared_guard guard(lock);
+        return parent::size();
+    }
+
+    bool empty() const override
+    {
+        rw_spinlock::shared_guard guard(lock);
+        return parent::empty();
+    }
+
+    iterator begin() override
+    {
+        rw_spinlock::shared_guard guard(lock);
+        return iterator(std::make_unique<iterator_impl>(guard, this->children.begin()));
+    }
+
+    iterator end() override
+    {
+        rw_spinlock::shared_guard guard(lock);
+        return iterator(std::make_unique<iterator_impl>(guard, this->children.end()));
+    }
+
+    reverse_iterator rbegin() override
+    {
+        rw_spinlock::shared_guard guard(lock);
+        return reverse_iterator(std::make_unique<reverse_iterator_impl>(guard, this->children.rbegin()));
+    }
+
+    reverse_iterator rend() override
+    {
+        rw_spinlock::shared_guard guard(lock);
+        return reverse_iterator(std::make_unique<reverse_iterator_impl>(guard, this->children.rend()));
+    }
+
+    const_iterator cbegin() const override
+    {
+        rw_spinlock::shared_guard guard(lock);
+        return const_iterator(std::make_unique<const_iterator_impl>(guard, this->children.cbegin()));
+    }
+
+    const_iterator cend() const override
+    {
+        rw_spinlock::shared_guard guard(lock);
+        return const_iterator(std::make_unique<const_iterator_impl>(guard, this->children.cend()));
+    }
+
+    const_reverse_iterator crbegin() const override
+    {
+        rw_spinlock::shared_guard guard(lock);
+        return const_reverse_iterator(std::make_unique<const_reverse_iterator_impl>(guard, this->children.crbegin()));
+    }
+
+    const_reverse_iterator crend() const override
+    {
+        rw_spinlock::shared_guard guard(lock);
+        return const_reverse_iterator(std::make_unique<const_reverse_iterator_impl>(guard, this->children.crend()));
+    }
+
+    raw_pointer_to_base_interface clone() const override
+    {
+        rw_spinlock::shared_guard guard(lock);
+        return new self(*this);
+    }
+
+    void add_structure_footprint(memory_footprint &footprint) const override
+    {
+        rw_spinlock::shared_guard guard(lock);
+        parent::add_structure_footprint(footprint);
+        footprint.library_field_bytes += sizeof(self) - sizeof(parent);
+    }
+
+protected:
+    // The child is moved out under this lock and attached to the destination after releasing it.
+    void relocate_child(raw_pointer_to_base_interface const child, value_type &another) override
+    {
+        const auto destination = another.get();
+        value_type relocated;
+        {
+            std::lock_guard<rw_spinlock> guard(lock);
+            relocated = this->detach_child(child);
+        }
+        if (relocated)
+        {
+            destination->push_back(std::move(relocated));
+        }
+    }
+
+    void lock_children() const override
+    {
+        lock.lock_shared();
+    }
+
+    void unlock_children() const override
+    {
+        lock.unlock_shared();
+    }
+
+private:
+    // Holds what `remove_if` removes until the locks of the removed subtrees are released.
+    class removed_subtrees : public node_disposer<value_type>
+    {
+    public:
+        removed_subtrees() :
+            next(node_disposer<value_type>::current())
+        {
+        }
+
+        void dispose(value_type &&node) override
+        {
+            nodes.push_back(std::move(node));
+        }
+
+        void unlock_and_dispose()
+        {
+            for (auto &node : nodes)
+            {
+                if (!node->is_reference() && node->is_composite())
+                {
+                    unlock_subtree(static_cast<self*>(node.get()));
+                }
+            }
+            if (next)
+            {
+                for (auto &node : nodes)
+                {
+                    next->dispose(std::move(node));
+                }
+            }
+            nodes.clear();
+        }
+
+    private:
+        node_disposer<value_type> *next;
+        std::vector<value_type> nodes;
+    };
+
+    static void lock_subtree(self *node)
+    {
+        node->lock.lock();
+        parent::template walk_children<false>(static_cast<parent*>(node), [](value_type &child, size_t)
+        {
+            if (!child->is_reference() && child->is_composite())
+            {
+                static_cast<self*>(child.get())->lock.lock();
+            }
+            return true;
+        });
+    }
+
+    static void unlock_subtree(self *node)
+    {
+        std::vector<self*> locked{ node };
+        parent::template walk_children<false>(static_cast<parent*>(node), [&locked](value_type &child, size_t)
+        {
+            if (!child->is_reference() && child->is_composite())
+            {
+                locked.push_back(static_cast<self*>(child.get()));
+            }
+            return true;
+        });
+        for (auto it = locked.rbegin(); it != locked.rend(); ++it)
+        {
+            (*it)->lock.unlock();
+        }
+    }
+
+private:
+    mutable rw_spinlock lock;
+};
+
+
+
+template <class Base>
+class reference : public Base
+{
+    using self = reference;
+    using parent = Base;
+
+public:
+    using smart_ptr = typename Base::smart_ptr;
+    using value_type = typename Base::value_type;
+    using raw_pointer_to_base_interface = typename Base::raw_pointer_to_base_interface;
+
+    using iterator = typename Base::iterator;
+    using const_iterator = typename Base::const_iterator;
+    using reverse_iterator = typename Base::reverse_iterator;
+    using const_reverse_iterator = typename Base::const_reverse_iterator;
+
+    using null_reference_type = null_reference<Base>;
+
+public:
+    reference()
+    {
+        this->set_node_flags(parent::reference_kind | parent::null_reference_flag);
+    }
+
+    void init()
+    {
+        reset();
+    }
+
+    virtual null_reference_type *obtain_null_reference() = 0;
+
+    virtual void remove_null_reference()
+    {
+        // Mainly useful to delete null_reference objects which were constructed on heap.
+    }
+
+    explicit reference(const smart_ptr &source)
+    {
+        this->set_node_flags(parent::reference_kind | parent::null_reference_flag);
+        assign(source);
+    }
+
+    reference(const self &another)
+    {
+        this->set_node_flags(parent::reference_kind | parent::null_reference_flag);
+        if (!another.is_null())
+        {
+            set_traversable(another.is_traversable());
+            point_to(another.ptr);
+        }
+        else
+        {
+            reset();
+        }
+    }
+
+    reference(self &&another)
+    {
+        this->set_node_flags(parent::reference_kind | parent::null_reference_flag);
+        if (!another.is_null())
+        {
+            set_traversable(another.is_traversable());
+            point_to(another.ptr);
+            another.reset();
+        }
+        else
+        {
+            reset();
+        }
+    }
+
+    self &operator=(const smart_ptr &source)
+    {
+        assign(source);
+        return *this;
+    }
+
+    self &operator=(const self &another)
+    {
+        if (!another.is_null())
+        {
+            set_traversable(another.is_traversable());
+            point_to(another.ptr);
+        }
+        else
+        {
+            reset();
+        }
+
+        return *this;
+    }
+
+    self &operator=(self &&another)
+    {
+        if (!another.is_null())
+        {
+            set_traversable(another.is_traversable());
+            point_to(another.ptr);
+            another.reset();
+        }
+        else
+        {
+            reset();
+        }
+
+        return *this;
+    }
+
+    void assign(const smart_ptr &source)
+    {
+        if (is_null() && !source->is_null_reference())
+        {
+            remove_null_reference();
+        }
+
+        if (!source->is_reference())
+        {          
+            point_to(source.get());
+        }
+        else
+        {
+            self *ref_obj = static_cast<self*>(source.get());
+            if (!ref_obj->is_null())
+            {
+                set_traversable(ref_obj->is_traversable());
+                point_to(ref_obj->ptr);
+            }
+            else
+            {
+                reset();
+            }
+        }
+    }
+
+    void push_back(const value_type &another) override
+    {
+        ptr->push_back(another);
+    }
+
+    void push_back(value_type &&another) override
+    {
+        ptr->push_back(std::move(another));
+    }
+
+    iterator begin() override
+    {
+        return ptr->begin();
+    }
+
+    iterator end() override
+    {
+        return ptr->end();
+    }
+
+    reverse_iterator rbegin() override
+    {
+        return ptr->rbegin();
+    }
+
+    reverse_iterator rend() override
+    {
+        return ptr->rend();
+    }
+
+    const_iterator cbegin() const override
+    {
+        return ptr->cbegin();
+    }
+
+    const_iterator cend() const override
+    {
+        return ptr->cend();
+    }
+
+    const_reverse_iterator crbegin() const override
+    {
+        return ptr->crbegin();
+    }
+
+    const_reverse_iterator crend() const override
+    {
+        return ptr->crend();
+    }
+
+    void clear() override
+    {
+        ptr->clear();
+    }
+
+    size_t size() const override final
+    {
+        return this->is_traversable() ? ptr->size() : 0;
+    }
+
+    bool empty() const override final
+    {
+        return ptr->empty();
+    }
+
+    size_t nested_hierarchy_size() const override final
+    {
+        return this->is_traversable() ? ptr->nested_hierarchy_size() : 0;
+    }
+
+    void reset()
+    {
+        if (ptr && ptr->is_null_reference())
+        {
+            return;
+        }
+
+        point_to(obtain_null_reference());
+    }
+
+    bool is_null() const
+    {
+        return this->is_null_reference();
+    }
+
+    void set_traversable(const bool value)
+    {
+        if (value)
+        {
+            this->_node_flags |= parent::traversable_flag;
+        }
+        else
+        {
+            this->_node_flags &= ~parent::traversable_flag;
+        }
+    }
+
+    bool points_to(const smart_ptr &another_ptr) const noexcept
+    {
+        return ptr == another_ptr.get();
+    }
+
+    raw_pointer_to_base_interface get() const noexcept
+    {
+        return ptr;
+    }
+
+    void add_structure_footprint(memory_footprint &footprint) const override
+    {
+        parent::add_structure_footprint(footprint);
+        footprint.library_field_bytes += sizeof(self) - sizeof(parent);
+    }
+
+protected:
+    // Mirrors the target's type flags, so that reference queries stay non-virtual.
+    void point_to(raw_pointer_to_base_interface const target) noexcept
+    {
+        const unsigned char target_flags = target ?
+            target->_node_flags & (parent::leaf_flag | parent::composite_flag | parent::null_reference_flag) :
+            parent::null_reference_flag;
+
+        ptr = target;
+        this->_node_flags = parent::reference_kind | target_flags |
+            (this->_node_flags & parent::traversable_flag);
+    }
+
+protected:
+    raw_pointer_to_base_interface ptr{nullptr};
+};
+
+
+template <class Base>
+class null_reference : public Base
+{
+    using self = null_reference;
+    using parent = Base;
+
+public:
+    using smart_ptr = typename Base::smart_ptr;
+    using value_type = typename Base::value_type;
+
+    using iterator = typename Base::iterator;
+    using const_iterator = typename Base::const_iterator;
+    using reverse_iterator = typename Base::reverse_iterator;
+    using const_reverse_iterator = typename Base::const_reverse_iterator;
+
+public:
+    null_reference()
+    {
+        this->set_node_flags(parent::null_reference_kind | parent::null_reference_flag);
+    }
+
+    void push_back(const value_type &another) override
+    {
+        
+    }
+
+    void push_back(value_type &&another) override
+    {
+       
+    }
+
+    iterator begin() override
+    {
+        return iterator();
+    }
+
+    iterator end() override
+    {
+        return iterator();
+    }
+
+    reverse_iterator rbegin() override
+    {
+        return reverse_iterator();
+    }
+
+    reverse_iterator rend() override
+    {
+        return reverse_iterator();
+    }
+
+    const_iterator cbegin() const override
+    {
+        return const_iterator();
+    }
+
+    const_iterator cend() const override
+    {
+        return const_iterator();
+    }
+
+    const_reverse_iterator crbegin() const override
+    {
+        return const_reverse_iterator();
+    }
+
+    const_reverse_iterator crend() const override
+    {
+        return const_reverse_iterator();
+    }
+
+    void clear() override
+    {
+        
+    }
+
+    size_t size() const override final
+    {
+        return size_t();
+    }
+
+    bool empty() const override final
+    {
+        return true;
+    }
+
+    size_t nested_hierarchy_size() const override final
+    {
+        return size_t();
+    }
+};
+
+
+
+template <class Category,
+    class T,
+    class Distance,
+    class Pointer,
+    class Reference,
+    bool reversed
+>
+class polymorphic_iterator_template : public std::iterator<Category, T, Distance, Pointer, Reference>
+{
+    using self = polymorphic_iterator_template;
+
+public:
+    using pointer = Pointer;
+    using reference = Reference;
+    using difference_type = Distance;
+    const static bool is_reversed = reversed;
+
+    class common_implementation
+    {
+    public:
+        using self = common_implementation;
+        using base_interface = common_implementation;
+
+    public:
+        virtual reference ref() const = 0;
+        virtual pointer ptr() const = 0;
+        virtual self &inc() = 0;
+        virtual self &dec() = 0;
+        virtual self *clone() = 0;
+        virtual bool equal(const self *another) const = 0;
+        virtual bool less(const self *another) const = 0;
+        virtual bool greater(const self *another) const = 0;
+        virtual void advance_forwards(const difference_type diff) = 0;
+        virtual void advance_backwards(const difference_type diff) = 0;
+        virtual difference_type difference(const self *another) const = 0;
+        virtual reference offset(const difference_type diff) const = 0;
+        virtual ~common_implementation() {}
+
+#if defined(COMPOSITE_OBJECT_TRACK_ALLOCATIONS) || defined(COMPOSITE_OBJECT_TRAVERSAL_STATS)
+        static void *operator new(const size_t size)
+        {
+#ifdef COMPOSITE_OBJECT_TRACK_ALLOCATIONS
+            allocation_stats::record(cloning() ? allocation_category::iterator_clone : allocation_category::iterator_impl, size);
+#endif
+            traversal_recorder::iterator_allocation();
+            return ::operator new(size);
+        }
+
+        static void operator delete(void * const ptr) noexcept
+        {
+            ::operator delete(ptr);
+        }
+#endif
+    };
+
+    using implementation = common_implementation;
+    using pointer_to_implementation = std::unique_ptr<implementation>;
+
+public:
+    polymorphic_iterator_template()
+    {
+    }
+
+    explicit polymorphic_iterator_template(pointer_to_implementation &&iter_impl) :
+        impl(std::move(iter_impl))
+    {
+    }
+
+    polymorphic_iterator_template(const self &another)
+    {
+        if (another.impl)
+        {
+            impl.reset(clone_implementation(*another.impl));
+        }
+    }
+
+    polymorphic_iterator_template(self &&another) :
+        impl(std::move(another.impl))
+    {
+    }
+
+    self &operator=(const self &another)
+    {
+        if (*this != another)
+        {
+            if (another.impl)
+            {
+                impl.reset(clone_implementation(*another.impl));
+            }
+            else
+            {
+                impl.reset();
+            }
+        }
+        return *this;
+    }
+
+    self &operator=(self &&another)
+    {
+        impl = std::move(another.impl);
+        return *this;
+    }
+
+    bool operator==(const self &another) const
+    {
+        if (impl)
+        {
+            return impl->equal(another.impl.get());
+        }
+        else
+        {
+            return another.impl.get() == nullptr;
+        }
+    }
+
+    bool operator!=(const self &another) const
+    {
+        return !(*this == another);
+    }
+
+    reference operator*() const
+    {
+        return impl->ref();
+    }
+
+    pointer operator->() const
+    {
+        return impl->ptr();
+    }
+
+    self& operator++()
+    {
+        impl->inc();
+        return *this;
+    }
+
+    self& operator--()
+    {
+        impl->dec();
+        return *this;
+    }
+
+    self operator++(int) const
+    {
+        self new_it(*this);
+        ++new_it;
+        return new_it;
+    }
+
+    self operator--(int) const
+    {
+        self new_it(*this);
+        --new_it;
+        return new_it;
+    }
+
+    self operator+(const difference_type offset)
+    {
+        self new_it(*this);
+        new_it.impl->advance_forwards(offset);
+        return new_it;
+    }
+
+    self operator-(const difference_type offset)
+    {
+        self new_it(*this);
+        new_it.impl->advance_backwards(offset);
+        return new_it;
+    }
+
+    difference_type operator-(const self &another) const
+    {
+        return impl->difference(another.impl.get());
+    }
+
+    bool operator>(const self &another) const
+    {
+        return impl->greater(another.impl.get());
+    }
+
+    bool operator<(const self &another) const
+    {
+        return impl->less(another.impl.get());
+    }
+
+    bool operator>=(const self &another) const
+    {
+        return !(*this < another);
+    }
+
+    bool operator<=(const self &another) const
+    {
+        return !(*this > another);
+    }
+
+    reference operator[](const difference_type offset) const
+    {
+        return impl->offset(offset);
+    }
+
+    bool empty() const
+    {
+        return impl == nullptr;
+    }
+
+    pointer_to_implementation &get_impl()
+    {
+        return impl;
+    }
+
+    const pointer_to_implementation &get_impl() const
+    {
+        return impl;
+    }
+
+private:
+    static common_implementation *clone_implementation(common_implementation &implementation)
+    {
+#ifdef COMPOSITE_OBJECT_TRACK_ALLOCATIONS
+        cloning() = true;
+        const auto copy = implementation.clone();
+        cloning() = false;
+        return copy;
+#else
+        return implementation.clone();
+#endif
+    }
+
+#ifdef COMPOSITE_OBJECT_TRACK_ALLOCATIONS
+    static bool &cloning() noexcept
+    {
+        static thread_local bool value = false;
+        return value;
+    }
+#endif
+
+protected:
+    pointer_to_implementation impl;
+};
+
+
+
+template
+<
+    class T,
+    class Distance,
+    class Pointer,
+    class Reference,
+    bool reversed
+>
+class polymorphic_iterator_template<std::bidirectional_iterator_tag, T, Distance, Pointer, Reference, reversed>
+    : public polymorphic_iterator_template<std::random_access_iterator_tag, T, Distance, Pointer, Reference, reversed>
+{
+    using parent = polymorphic_iterator_template<std::random_access_iterator_tag, T, Distance, Pointer, Reference, reversed>;
+    using self = polymorphic_iterator_template;
+
+public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using pointer = Pointer;
+    using reference = Reference;
+    using difference_type = Distance;
+    using common_implementation = typename parent::common_implementation;
+
+    class bidirectional_implementation : public common_implementation
+    {
+    public:
+        bool less(const common_implementation *another) const override
+        {
+            return false;
+        }
+
+        bool greater(const common_implementation *another) const override
+        {
+            return false;
+        }
+
+        reference offset(const difference_type diff) const override
+        {
+            static pointer var = nullptr;
+            return *var;
+        }
+
+        virtual void advance_forwards(const difference_type diff) override
+        {
+        }
+
+        virtual void advance_backwards(const difference_type diff) override
+        {
+        }
+
+        virtual difference_type difference(const common_implementation *another) const override
+        {
+            return difference_type{};
+        }
+    };
+
+    using implementation = bidirectional_implementation;
+    using pointer_to_implementation = std::unique_ptr<implementation>;
+
+public:
+    polymorphic_iterator_template() : parent()
+    {
+    }
+
+    explicit polymorphic_iterator_template(pointer_to_implementation &&iter_impl) :
+        parent(std::forward<pointer_to_implementation>(iter_impl))
+    {
+    }
+
+    polymorphic_iterator_template(const self &another) : parent(another)
+    {
+    }
+
+    polymorphic_iterator_template(self &&another)
+        : parent(std::move(another.impl))
+    {
+    }
+
+    self &operator=(const self &another)
+    {
+        parent::operator=(another);
+        return *this;
+    }
+
+    self &operator=(self &&another)
+    {
+        parent::operator=(std::move(another));
+        return *this;
+    }
+
+    bool operator==(const self &another) const
+    {
+        return parent::operator==(another);
+    }
+
+    self operator+(const difference_type offset) = delete;
+    self operator-(const difference_type offset) = delete;
+    difference_type operator-(const self &another) const = delete;
+    bool operator>(const self &another) const = delete;
+    bool operator<(const self &another) const = delete;
+    bool operator>=(const self &another) const = delete;
+    bool operator<=(const self &another) const = delete;
+    reference operator[](const difference_type offset) const = delete;
+};
+
+
+
+template <class Container>
+struct begin
+{
+    void operator()(Container &cont, typename Container::iterator &out)
+    {
+        out = cont.begin();
+    }
+
+    void operator()(const Container &cont, typename Container::const_iterator &out)
+    {
+        out = cont.cbegin();
+    }
+
+    void operator()(Container &cont, typename Container::reverse_iterator &out)
+    {
+        out = cont.rbegin();
+    }
+
+    void operator()(const Container &cont, typename Container::const_reverse_iterator &out)
+    {
+        out = cont.crbegin();
+    }
+};
+
+
+template <class Container>
+struct end
+{
+    void operator()(Container &cont, typename Container::iterator &out)
+    {
+        out = cont.end();
+    }
+
+    void operator()(const Container &cont, typename Container::const_iterator &out)
+    {
+        out = cont.cend();
+    }
+
+    void operator()(Container &cont, typename Container::reverse_iterator &out)
+    {
+        out = cont.rend();
+    }
+
+    void operator()(const Container &cont, typename Container::const_reverse_iterator &out)
+    {
+        out = cont.crend();
+    }
+};
+
+
+
+template <class Source, class Dest>
+struct inherit_const
+{
+    using type = typename std::conditional<std::is_const<Source>::value, typename std::add_const<Dest>::type, Dest>::type;
+};
+
+
+// Hierarchical iterators
+
+namespace
+{
+    template <class Iter, const df_traverse_algorithm a>
+    struct df_traverse_algorithm_impl
+    {
+        static void init(Iter &it) {}
+        static void next(Iter &it) {}
+    };
+
+    template <class Iter>
+    struct df_traverse_algorithm_impl<Iter, df_traverse_algorithm::pre_order>
+    {
+        static void init(Iter &it)
+        {
+        }
+
+        static void next(Iter &it)
+        {
+            if (it.can_go_down())
+            {
+                it.go_down();
+                return;
             }
-            else
+
+            while (it.advance_top() == it.top_it_end())
             {
-                another->push_back(smart_ptr(this));
+                if (it.iters.size() == 1) break;
+                it.return_up();
+            }
+        }
+    };
+
+    template <class Iter>
+    struct df_traverse_algorithm_impl<Iter, df_traverse_algorithm::post_order>
+    {
+        static void init(Iter &it)
+        {
+            if (it.top_it() != it.top_it_end())
+            {
+                while (it.can_go_down())
+                {
+                    it.go_down();
+                }
+            }
+        }
+
+        static void next(Iter &it)
+        {
+            if (it.advance_top() == it.top_it_end())
+            {
+                if (it.iters.size() != 1)
+                {
+                    it.return_up();
+                }
+                return;
+            }
+
+            while (it.can_go_down())
+            {
+                it.go_down();
             }
         }
+    };
+}
+
+
+namespace
+{
+    inline void prefetch_node(const void * const address) noexcept
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(address);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+        (void)address;
+#endif
     }
+}
 
-    // Pre-order iterators
 
-    auto df_pre_order_begin()
+// With COMPOSITE_OBJECT_PREFETCH_DISTANCE set to N > 0, `ahead` runs N children ahead of
+// `current` once `start_prefetch()` is called, prefetching the nodes it passes, so that the
+// node headers read by traversal are in cache when it reaches them.
+template <class Iter>
+struct node_iters
+{
+    Iter current;
+    Iter end;
+#if COMPOSITE_OBJECT_PREFETCH_DISTANCE > 0
+    Iter ahead;
+    bool prefetching{ false };
+#endif
+
+    node_iters()
     {
-        return df_pre_order_hierarchical_iterator(begin(), end());
     }
 
-    auto df_pre_order_end()
+    node_iters(Iter &&a, Iter &&b) :
+        current(std::move(a)), end(std::move(b))
     {
-        return df_pre_order_hierarchical_iterator(end(), end());
     }
 
-    auto cdf_pre_order_begin() const
+    // Copying `current` allocates, so children of `parent` are prefetched only if it has enough of them.
+    template <class Node>
+    void start_prefetch(const Node &parent)
+    {
+#if COMPOSITE_OBJECT_PREFETCH_DISTANCE > 0
+        if (parent.size() > 2 * COMPOSITE_OBJECT_PREFETCH_DISTANCE)
+        {
+            start_prefetch();
+        }
+#else
+        (void)parent;
+#endif
+    }
+
+    void start_prefetch()
+    {
+#if COMPOSITE_OBJECT_PREFETCH_DISTANCE > 0
+        if (current == end)
+        {
+            return;
+        }
+        prefetching = true;
+        ahead = current;
+        for (int i = 0; i < COMPOSITE_OBJECT_PREFETCH_DISTANCE && ahead != end; ++i)
+        {
+            prefetch_node((*ahead).get());
+            ++ahead;
+        }
+#endif
+    }
+
+    Iter &advance()
+    {
+#if COMPOSITE_OBJECT_PREFETCH_DISTANCE > 0
+        if (prefetching && ahead != end)
+        {
+            prefetch_node((*ahead).get());
+            ++ahead;
+        }
+#endif
+        ++current;
+        return current;
+    }
+};
+
+
+template <class LinearIterator, const df_traverse_algorithm traverse_algorithm_param, bool reversed>
+class df_hierarchical_iterator_template :
+    public std::iterator
+    <
+        typename std::forward_iterator_tag,
+        typename LinearIterator::value_type,
+        typename LinearIterator::difference_type,
+        typename LinearIterator::pointer,
+        typename LinearIterator::reference
+    >
+{
+    using self = df_hierarchical_iterator_template;
+
+    using node_iters_type = node_iters<LinearIterator>;
+    using stack_container_type = std::vector<node_iters_type, library_allocator<node_iters_type, allocation_category::traversal_stack>>;
+
+    friend struct df_traverse_algorithm_impl<self, df_traverse_algorithm::pre_order>;
+    friend struct df_traverse_algorithm_impl<self, df_traverse_algorithm::post_order>;
+
+    using traverse_algorithm = df_traverse_algorithm_impl<self, traverse_algorithm_param>;
+
+public:
+    using iterator_category = typename LinearIterator::iterator_category;
+    using value_type = typename LinearIterator::value_type;
+    using pointer = typename LinearIterator::pointer;
+    using reference = typename LinearIterator::reference;
+    using difference_type = typename LinearIterator::difference_type;
+
+public:
+    df_hierarchical_iterator_template()
     {
-        return const_df_pre_order_hierarchical_iterator(cbegin(), cend());
     }
 
-    auto cdf_pre_order_end() const
+    explicit df_hierarchical_iterator_template(LinearIterator &&root_begin, LinearIterator &&root_end)
     {
-        return const_df_pre_order_hierarchical_iterator(cend(), cend());
+        push(node_iters_type(std::move(root_begin), std::move(root_end)));
+        top().start_prefetch();
+        traversal_recorder::depth(1);
+        init();
+        traversal_recorder::visit_unless_end(top_it(), top_it_end());
     }
 
-    auto rdf_pre_order_begin()
+    df_hierarchical_iterator_template(const self &another) :
+        iters(another.iters)
     {
-        return reverse_df_pre_order_hierarchical_iterator(rbegin(), rend());
     }
 
-    auto rdf_pre_order_end()
+    df_hierarchical_iterator_template(self &&another) :
+        iters(std::move(another.iters))
     {
-        return reverse_df_pre_order_hierarchical_iterator(rend(), rend());
     }
 
-    auto crdf_pre_order_begin() const
+    self &operator=(const self &another)
     {
-        return const_reverse_df_pre_order_hierarchical_iterator(crbegin(), crend());
+        iters = another.iters;
+        return *this;
     }
 
-    auto crdf_pre_order_end() const
+    self &operator=(self &&another)
     {
-        return const_reverse_df_pre_order_hierarchical_iterator(crend(), crend());
+        iters = std::move(another.iters);
+        return *this;
     }
 
-    // Post-order iterators
-
-    auto df_post_order_begin()
+    bool operator==(const self &another) const
     {
-        return df_post_order_hierarchical_iterator(begin(), end());
+        return iters.size() == another.iters.size() &&
+            std::equal(iters.crbegin(), iters.crend(), another.iters.crbegin(),
+                [](const auto &a, const auto &b) {return a.current == b.current; }
+        );
     }
 
-    auto df_post_order_end()
+    bool empty() const
     {
-        return df_post_order_hierarchical_iterator(end(), end());
+        return iters.empty();
     }
 
-    auto cdf_post_order_begin() const
+    bool operator!=(const self &another) const
     {
-        return const_df_post_order_hierarchical_iterator(cbegin(), cend());
+        return !(*this == another);
     }
 
-    auto cdf_post_order_end() const
+    reference operator*() const
     {
-        return const_df_post_order_hierarchical_iterator(cend(), cend());
+        return *top_it();
     }
 
-    auto rdf_post_order_begin()
+    pointer operator->() const
     {
-        return reverse_df_post_order_hierarchical_iterator(rbegin(), rend());
+        return top_it().operator->();
     }
 
-    auto rdf_post_order_end()
+    self& operator++()
     {
-        return reverse_df_post_order_hierarchical_iterator(rend(), rend());
+        traverse_algorithm::next(*this);
+        traversal_recorder::visit_unless_end(top_it(), top_it_end());
+        return *this;
     }
 
-    auto crdf_post_order_begin() const
+    self operator++(int)
     {
-        return const_reverse_df_post_order_hierarchical_iterator(crbegin(), crend());
+        self new_it(*this);
+        ++new_it;
+        return new_it;
     }
 
-    auto crdf_post_order_end() const
+    void return_up()
     {
-        return const_reverse_df_post_order_hierarchical_iterator(crend(), crend());
+        pop();
     }
 
-    // Breadth-first iterators
-
-    auto bf_begin()
+    LinearIterator &advance_top()
     {
-        return bf_hierarchical_iterator(begin(), end());
+        return top().advance();
     }
 
-    auto bf_end()
+    void go_down()
     {
-        return bf_hierarchical_iterator();
+        using container_type = typename inherit_const<value_type, typename value_type::element_type>::type;
+        container_type &cont = **top_it();
+        LinearIterator _begin, _end;
+        begin<container_type>()(cont, _begin);
+        end<container_type>()(cont, _end);
+        push(node_iters_type(std::move(_begin), std::move(_end)));
+        top().start_prefetch(cont);
+        traversal_recorder::descent(iters.size());
     }
 
-    auto cbf_begin() const
+    LinearIterator get_linear_iterator() const
     {
-        return const_bf_hierarchical_iterator(cbegin(), cend());
+        return top_it();
     }
 
-    auto cbf_end() const
+    LinearIterator get_linear_iterator_to_parent() const
     {
-        return const_bf_hierarchical_iterator();
+        const size_t size = iters.size();
+        return size > 1 ? iters[size - 2].current : LinearIterator();
     }
 
-    auto rbf_begin()
+private:
+    LinearIterator &top_it()
     {
-        return reverse_bf_hierarchical_iterator(rbegin(), rend());
+        return top().current;
     }
 
-    auto rbf_end()
+    const LinearIterator &top_it() const
     {
-        return reverse_bf_hierarchical_iterator();
+        return top().current;
     }
 
-    auto crbf_begin() const
+    LinearIterator &top_it_end()
     {
-        return const_reverse_bf_hierarchical_iterator(crbegin(), crend());
+        return top().end;
     }
 
-    auto crbf_end() const
+    const LinearIterator &top_it_end() const
     {
-        return const_reverse_bf_hierarchical_iterator();
+        return top().end;
     }
 
-    bool awaits_destruction() const noexcept
+    void init()
     {
-        return _awaits_destruction;
+        traverse_algorithm::init(*this);
     }
 
-    virtual ~abstract() noexcept
+    void push(node_iters_type &&pair)
     {
+        iters.push_back(std::move(pair));
     }
 
-protected:
-    virtual void set_parent(self * const ptr_to_parent)
+    void pop()
     {
-        _parent = ptr_to_parent;
+        iters.pop_back();
     }
 
-    virtual void mark_for_delete() noexcept
+    typename stack_container_type::reference top()
     {
-        _awaits_destruction = true;
+        return iters.back();
     }
 
-    virtual void erase_awaiting_destruction()
+    typename stack_container_type::const_reference top() const
     {
+        return iters.back();
     }
 
-    virtual void relocate_child(raw_pointer_to_base_interface const child, value_type &another)
+    bool can_go_down() const
     {
+        const auto &node = *top_it();
+        if (!node->is_traversable())
+        {
+            return false;
+        }
+        traversal_recorder::size_call();
+        return node->size() > 0;
     }
 
-protected:
-    raw_pointer_to_base_interface _parent{ nullptr };
-
 private:
-    bool _awaits_destruction{ false };
+    stack_container_type iters;
 };
 
 
 
-template <class Base>
-class leaf : public Base
+template <class LinearIterator, bool reversed>
+class bf_hierarchical_iterator_template :
+    public std::iterator
+    <
+        typename std::forward_iterator_tag,
+        typename LinearIterator::value_type,
+        typename LinearIterator::difference_type,
+        typename LinearIterator::pointer,
+        typename LinearIterator::reference
+    >
 {
-    using self = leaf;
-    using parent = Base;
+    using self = bf_hierarchical_iterator_template;
 
-public:
-    using value_type = typename Base::iterator_traits::value_type;
-    using raw_pointer_to_base_interface = typename Base::raw_pointer_to_base_interface;
+    using node_iters_type = node_iters<LinearIterator>;
+    using queue_container_type =
+        std::queue<node_iters_type, std::deque<node_iters_type, library_allocator<node_iters_type, allocation_category::traversal_queue>>>;
 
-    using iterator = typename Base::iterator;
-    using const_iterator = typename Base::const_iterator;
-    using reverse_iterator = typename Base::reverse_iterator;
-    using const_reverse_iterator = typename Base::const_reverse_iterator;
+public:
+    using iterator_category = typename LinearIterator::iterator_category;
+    using value_type = typename LinearIterator::value_type;
+    using pointer = typename LinearIterator::pointer;
+    using reference = typename LinearIterator::reference;
+    using difference_type = typename LinearIterator::difference_type;
 
 public:
-    template <class IteratorBaseType>
-    class leaf_iterator_impl : public IteratorBaseType::implementation
+    bf_hierarchical_iterator_template()
     {
-        using category = typename IteratorBaseType::iterator_category;
-        using reference = typename IteratorBaseType::reference;
-        using pointer = typename IteratorBaseType::pointer;
-        using difference_type = typename IteratorBaseType::difference_type;
+    }
 
-        using self = typename IteratorBaseType::implementation;
-        using base_interface = typename IteratorBaseType::implementation::base_interface;
+    explicit bf_hierarchical_iterator_template(LinearIterator &&root_begin, LinearIterator &&root_end)
+    {
+        push(node_iters_type(std::move(root_begin), std::move(root_end)));
+        front().start_prefetch();
+        traversal_recorder::depth(1);
+        traversal_recorder::visit_unless_end(current_it(), current_it_end());
+    }
 
-    public:
-        leaf_iterator_impl() : _ptr(nullptr)
-        {
-        }
+    bf_hierarchical_iterator_template(const self &another) :
+        iters(another.iters)
+    {
+    }
 
-        reference ref() const override
-        {
-            return *_ptr;
-        }
+    bf_hierarchical_iterator_template(self &&another) :
+        iters(std::move(another.iters))
+    {
+    }
 
-        pointer ptr() const override
-        {
-            return _ptr;
-        }
+    self &operator=(const self &another)
+    {
+        iters = another.iters;
+        return *this;
+    }
 
-        self &inc() override
-        {
-            return *this;
-        }
+    self &operator=(self &&another)
+    {
+        iters = std::move(another.iters);
+        return *this;
+    }
 
-        self &dec() override
+    bool operator==(const self &another) const
+    {
+        bool result = false;
+        if (iters.size() != 0 && another.iters.size() != 0)
         {
-            return *this;
+            result = current_it() == another.current_it();
         }
-
-        self *clone() override
+        else if (iters.size() == 0 && another.iters.size() == 0)
         {
-            return new leaf_iterator_impl();
+            result = true;
         }
 
-        bool equal(const base_interface *another) const override
-        {
-            // always nullptr
-            return true;
-        }
+        return result;
+    }
 
-        bool less(const base_interface *another) const override
+    bool operator!=(const self &another) const
+    {
+        return !(*this == another);
+    }
+
+    reference operator*() const
+    {
+        return *current_it();
+    }
+
+    pointer operator->() const
+    {
+        return current_it().operator->();
+    }
+
+    self& operator++()
+    {
+        if (current_it() != current_it_end())
         {
-            return false;
+            try_to_push_children_to_queue();
+            front().advance();
         }
 
-        bool greater(const base_interface *another) const override
+        if (current_it() == current_it_end())
         {
-            return false;
+            pop();
         }
 
-        reference offset(const difference_type diff) const override
+        if (!empty())
         {
-            static pointer var = nullptr;
-            return *var;
+            traversal_recorder::visit();
         }
+        return *this;
+    }
 
-    private:
-        typename IteratorBaseType::pointer _ptr;
-    };
+    self operator++(int)
+    {
+        self new_it(*this);
+        ++new_it;
+        return new_it;
+    }
 
-public:
-    leaf() : parent()
+    bool empty() const
     {
+        return iters.empty();
     }
 
-    void push_back(const value_type &another) override
+    LinearIterator get_linear_iterator() const
     {
+        return current_it();
+    }
 
+private:
+    LinearIterator &current_it()
+    {
+        return front().current;
     }
 
-    void push_back(value_type &&another) override
+    const LinearIterator &current_it() const
     {
+        return front().current;
+    }
 
+    LinearIterator &current_it_end()
+    {
+        return front().end;
     }
 
-    iterator begin() override
+    const LinearIterator &current_it_end() const
     {
-        return end();
+        return front().end;
     }
 
-    iterator end() override
+    void try_to_push_children_to_queue()
     {
-        return iterator(std::make_unique<leaf_iterator_impl<iterator>>());
+        if (current_has_children())
+        {
+            using container_type = typename inherit_const<value_type, typename value_type::element_type>::type;
+            container_type &cont = **current_it();
+            LinearIterator _begin, _end;
+            begin<container_type>()(cont, _begin);
+            end<container_type>()(cont, _end);
+            iters.emplace(std::move(_begin), std::move(_end));
+            iters.back().start_prefetch(cont);
+            traversal_recorder::descent(iters.size());
+        }
     }
 
-    const_iterator cbegin() const override
+    void push(node_iters_type &&pair)
     {
-        return cend();
+        iters.push(std::move(pair));
     }
 
-    const_iterator cend() const override
+    void pop()
     {
-        return const_iterator(std::make_unique<leaf_iterator_impl<const_iterator>>());
+        iters.pop();
     }
 
-    reverse_iterator rbegin() override
+    typename queue_container_type::reference front()
     {
-        return rend();
+        return iters.front();
     }
 
-    reverse_iterator rend() override
+    typename queue_container_type::const_reference front() const
     {
-        return reverse_iterator(std::make_unique<leaf_iterator_impl<reverse_iterator>>());
+        return iters.front();
     }
 
-    const_reverse_iterator crbegin() const override
+    bool current_has_children()
     {
-        return crend();
+        traversal_recorder::size_call();
+        return (*current_it())->size() > 0;
     }
 
-    const_reverse_iterator crend() const override
+private:
+    queue_container_type iters;
+};
+
+
+
+template <class CompositeObjectIterator>
+class iter_wrapper : public std::iterator
+    <
+    typename CompositeObjectIterator::iterator_category,
+    typename CompositeObjectIterator::value_type::element_type
+    >
+{
+public:
+    using iterator_category = typename CompositeObjectIterator::iterator_category;
+    using value_type = typename CompositeObjectIterator::value_type::element_type;
+    using pointer = value_type*;
+    using reference = value_type&;
+    using difference_type = typename CompositeObjectIterator::difference_type;
+
+public:
+    iter_wrapper() {}
+
+    explicit iter_wrapper(const CompositeObjectIterator &iterator) :
+        it(iterator)
     {
-        return const_reverse_iterator(std::make_unique<leaf_iterator_impl<const_reverse_iterator>>());
     }
 
-    void clear() override
+    iter_wrapper(const iter_wrapper &another) :
+        it(another.it)
     {
     }
 
-    size_t size() const override final
+    iter_wrapper &operator=(const iter_wrapper &another)
     {
-        return 0;
+        if (*this != another)
+        {
+            it = another.it;
+        }
+        return *this;
     }
 
-    bool empty() const override final
+    bool operator==(const iter_wrapper &another) const
     {
-        return true;
+        return it == another.it;
     }
 
-    size_t nested_hierarchy_size() const override final
+    bool operator!=(const iter_wrapper &another) const
     {
-        return 0;
+        return !(*this == another);
     }
 
-    bool is_leaf() const override final
+    reference operator*() const
     {
-        return true;
+        return **it;
     }
 
-    bool is_composite() const override final
+    pointer operator->() const
     {
-        return false;
+        return it->operator->();
     }
 
-    bool is_reference() const noexcept override final
+    iter_wrapper& operator++()
     {
-        return false;
+        ++it;
+        return *this;
     }
 
-    bool is_null_reference() const noexcept override final
+    iter_wrapper& operator--()
     {
-        return false;
+        --it;
+        return *this;
     }
 
-    bool is_traversable() const noexcept override final
+    iter_wrapper operator++(int)
     {
-        return true;
+        iter_wrapper new_it(*this);
+        ++new_it;
+        return new_it;
     }
 
-    raw_pointer_to_base_interface clone() const override
+    iter_wrapper operator--(int)
     {
-        return new self(*this);
+        iter_wrapper new_it(*this);
+        --new_it;
+        return new_it;
     }
-};
 
+private:
+    CompositeObjectIterator it;
+};
 
 
-namespace
+template <class Iterator>
+iter_wrapper<Iterator> wrap_iterator(const Iterator &iter)
 {
+    return iter_wrapper<Iterator>(iter);
+}
 
-template <class Composite, bool is_copy_constructible>
-    struct composite_push_back_impl;
-
-
-template <class IteratorTag, class Iterator>
-    struct composite_iterator_categoty_impl;
 
-}
+// Visitors
 
+namespace detail
+{
 
-template <class Base, template <class T> class Container>
-class composite : public Base
-{  
-    using self = composite;
-    using parent = Base;
+template <class Leaf>
+using visited_abstract = typename std::remove_pointer<typename Leaf::raw_pointer_to_base_interface>::type;
 
+// One node and one batch overload per visited class. Each level brings the overloads of the
+// levels below into scope, so that its batch overload calls the node overloads of its class.
+template <class Abstract, class... Nodes>
+class visit_overloads
+{
 public:
-    using value_type = typename Base::iterator_traits::value_type;
-    using smart_ptr = typename Base::smart_ptr;
-    using raw_pointer_to_base_interface = typename Base::raw_pointer_to_base_interface;
+    virtual void visit(Abstract &)
+    {
+    }
 
-    using iterator = typename Base::iterator;
-    using const_iterator = typename Base::const_iterator;
-    using reverse_iterator = typename Base::reverse_iterator;
-    using const_reverse_iterator = typename Base::const_reverse_iterator;
+    virtual void visit(Abstract * const *nodes, const size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            visit(*nodes[i]);
+        }
+    }
 
-    using container_type = typename Container<value_type>::type;
-    using initializer_list = std::initializer_list<value_type>;
+    virtual ~visit_overloads()
+    {
+    }
+};
 
+template <class Abstract, class Node, class... Nodes>
+class visit_overloads<Abstract, Node, Nodes...> : public visit_overloads<Abstract, Nodes...>
+{
 public:
-    template <class IteratorBaseType, class UnderlyingContainerIterator>
-    class iterator_impl_template : public IteratorBaseType::implementation
+    using visit_overloads<Abstract, Nodes...>::visit;
+
+    virtual void visit(Node &)
     {
-    public:
-        using category  = typename IteratorBaseType::iterator_category;
-        using reference = typename IteratorBaseType::reference;
-        using pointer   = typename IteratorBaseType::pointer;
-        using difference_type = typename IteratorBaseType::difference_type;
+    }
 
-        using self = typename IteratorBaseType::implementation;
-        using base_interface = typename self::base_interface;
+    virtual void visit(Node * const *nodes, const size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            visit(*nodes[i]);
+        }
+    }
+};
 
-    private:
-        using iterator_impl_specialization = composite_iterator_categoty_impl<category, UnderlyingContainerIterator>;
+} // visitors impl details namespace
 
-    public:
-        iterator_impl_template(UnderlyingContainerIterator &it) : _it(it)
+
+// Leaf and Composite are the leaf and composite classes of the visited hierarchy (for example
+// `leaf<impl>` and `composite<impl>`); further leaf and composite classes may be listed as
+// `Nodes`. Nodes are dispatched on their exact class, so every listed class reaches its own
+// overload; nodes of classes derived from or unrelated to the listed ones reach
+// `visit(abstract_type&)`, and references reach the reference overloads. Batch overloads
+// receive runs of consecutive same-class nodes in traversal order; by default they visit
+// nodes one by one.
+template <class Leaf, class Composite, class... Nodes>
+class visitor : public detail::visit_overloads<detail::visited_abstract<Leaf>, Leaf, Composite, Nodes...,
+    typename detail::visited_abstract<Leaf>::reference, null_reference<detail::visited_abstract<Leaf>>>
+{
+public:
+    using visitor_type = visitor;
+    using leaf_type = Leaf;
+    using composite_type = Composite;
+    using abstract_type = detail::visited_abstract<Leaf>;
+    using reference_type = typename abstract_type::reference;
+    using null_reference_type = composite_object::null_reference<abstract_type>;
+
+    // The classes `class_index()` tells apart; the last one stands for all other classes.
+    using class_types = std::tuple<Leaf, Composite, Nodes..., reference_type, null_reference_type, abstract_type>;
+
+public:
+    // Index in `class_types` of the class of `node`.
+    static size_t class_index(const abstract_type &node)
+    {
+        constexpr size_t listed = 2 + sizeof...(Nodes);
+        switch (node.kind())
         {
+        case abstract_type::reference_kind:
+            return listed;
+        case abstract_type::null_reference_kind:
+            return listed + 1;
+        default:
+            break;
         }
 
-        iterator_impl_template(UnderlyingContainerIterator &&it) : _it(std::move(it))
+        static const std::type_info *const classes[] = { &typeid(Leaf), &typeid(Composite), &typeid(Nodes)... };
+        const std::type_info &type = typeid(node);
+        for (size_t i = 0; i < listed; ++i)
         {
+            if (*classes[i] == type)
+            {
+                return i;
+            }
         }
+        return listed + 2;
+    }
 
-        reference ref() const override
+    // Calls the overload for the class of `node`.
+    void dispatch(abstract_type &node)
+    {
+        dispatch(class_index(node), node, std::make_index_sequence<std::tuple_size<class_types>::value>());
+    }
+
+private:
+    template <size_t... I>
+    void dispatch(const size_t index, abstract_type &node, std::index_sequence<I...>)
+    {
+        using function = void (*)(visitor&, abstract_type&);
+        static const function calls[] = { &call<I>... };
+        calls[index](*this, node);
+    }
+
+    template <size_t I>
+    static void call(visitor &v, abstract_type &node)
+    {
+        v.visit(static_cast<typename std::tuple_element<I, class_types>::type&>(node));
+    }
+};
+
+
+namespace
+{
+
+template <class Visitor>
+class visit_dispatcher
+{
+    using visitor_type = typename Visitor::visitor_type;
+    using abstract_type = typename Visitor::abstract_type;
+    using composite_type = typename Visitor::composite_type;
+    using reference_type = typename Visitor::reference_type;
+    using class_types = typename visitor_type::class_types;
+    using class_sequence = std::make_index_sequence<std::tuple_size<class_types>::value>;
+
+    template <class Classes>
+        struct batches_of;
+
+    template <class... Classes>
+    struct batches_of<std::tuple<Classes...>>
+    {
+        using type = std::tuple<std::vector<Classes*>...>;
+    };
+
+    using container_iterator = typename composite_type::container_type::iterator;
+    using foreign_iterator = typename abstract_type::iterator;
+
+public:
+    // Children of a `Composite` are walked on its container, those of other composites
+    // through their polymorphic iterators.
+    class range
+    {
+    public:
+        range()
         {
-            return *_it;
         }
 
-        pointer ptr() const override
+        range(container_iterator first, container_iterator last) :
+            first(first), last(last)
         {
-            return _it.operator->();
         }
 
-        self &inc() override
+        range(foreign_iterator &&first, foreign_iterator &&last) :
+            foreign_first(std::move(first)), foreign_last(std::move(last)), foreign(true)
         {
-            ++_it; return *this;
         }
 
-        self &dec() override
+        bool empty() const
         {
-            --_it; return *this;
+            return foreign ? foreign_first == foreign_last : first == last;
         }
 
-        self *clone() override
+        abstract_type &next()
         {
-            return new iterator_impl_template(_it);
+            if (!foreign)
+            {
+                return **first++;
+            }
+
+            auto &node = **foreign_first;
+            ++foreign_first;
+            return node;
         }
 
-        bool equal(const base_interface *another) const override
+    private:
+        container_iterator first{};
+        container_iterator last{};
+        foreign_iterator foreign_first;
+        foreign_iterator foreign_last;
+        bool foreign{ false };
+    };
+
+public:
+    visit_dispatcher(Visitor &v, const size_t batch_size) :
+        v(v), batch_size(batch_size > 0 ? batch_size : 1)
+    {
+    }
+
+    void operator()(abstract_type &node)
+    {
+        if (batch_size == 1)
         {
-            return _it == upcast(another)->_it;
+            v.dispatch(node);
+            return;
         }
 
-        bool less(const base_interface *another) const override
+        const size_t index = visitor_type::class_index(node);
+        if (index != run_class)
         {
-            return iterator_impl_specialization::less(_it, upcast(another)->_it);
+            flush();
+            run_class = index;
         }
+        add(index, node, class_sequence());
+    }
 
-        bool greater(const base_interface *another) const override
+    // Visits the nodes of the current run; the traversal drivers call it when they finish.
+    void flush()
+    {
+        if (run_class != no_run)
         {
-            return iterator_impl_specialization::greater(_it, upcast(another)->_it);
+            flush(run_class, class_sequence());
         }
+    }
 
-        reference offset(const difference_type diff) const override
+    static range children(abstract_type &node)
+    {
+        abstract_type *source = &node;
+        if (node.kind() == abstract_type::reference_kind)
         {
-            return iterator_impl_specialization::offset(_it, diff);
+            source = node.is_traversable() ? static_cast<reference_type&>(node).get() : nullptr;
         }
 
-        void advance_forwards(const difference_type diff) override
+        if (!source || source->kind() != abstract_type::composite_kind)
         {
-            _it = iterator_impl_specialization::advance_forwards(_it, diff);
+            return range();
         }
 
-        void advance_backwards(const difference_type diff) override
+        if (typeid(*source) == typeid(composite_type))
         {
-            _it = iterator_impl_specialization::advance_forwards(_it, diff);
+            auto &cont = static_cast<composite_type*>(source)->cont();
+            return range(cont.begin(), cont.end());
         }
+        return range(source->begin(), source->end());
+    }
 
-        difference_type difference(const base_interface *another) const override
-        {
-            return iterator_impl_specialization::difference(_it, upcast(another)->_it);
-        }
+private:
+    using dispatcher_function = void (*)(visit_dispatcher&, abstract_type&);
+    using flush_function = void (*)(visit_dispatcher&);
 
-        UnderlyingContainerIterator get_cont_iterator() const
+    static constexpr size_t no_run = static_cast<size_t>(-1);
+
+    template <size_t... I>
+    void add(const size_t index, abstract_type &node, std::index_sequence<I...>)
+    {
+        static const dispatcher_function adders[] = { &add_to<I>... };
+        adders[index](*this, node);
+    }
+
+    template <size_t... I>
+    void flush(const size_t index, std::index_sequence<I...>)
+    {
+        static const flush_function flushers[] = { &flush_batch<I>... };
+        flushers[index](*this);
+    }
+
+    template <size_t I>
+    static void add_to(visit_dispatcher &d, abstract_type &node)
+    {
+        auto &batch = std::get<I>(d.batches);
+        batch.push_back(static_cast<typename std::tuple_element<I, class_types>::type*>(&node));
+        if (batch.size() == d.batch_size)
         {
-            return _it;
+            flush_batch<I>(d);
         }
+    }
 
-    private:
-        iterator_impl_template *upcast(const base_interface *ptr) const
+    template <size_t I>
+    static void flush_batch(visit_dispatcher &d)
+    {
+        auto &batch = std::get<I>(d.batches);
+        if (!batch.empty())
         {
-            return (iterator_impl_template*)ptr;
+            d.v.visit(batch.data(), batch.size());
+            batch.clear();
         }
+    }
 
-    private:
-        UnderlyingContainerIterator _it;
-    };
+private:
+    visitor_type &v;
+    const size_t batch_size;
+    size_t run_class{ no_run };
+    typename batches_of<class_types>::type batches;
+};
 
-    using iterator_impl               = iterator_impl_template<iterator, typename container_type::iterator>;
-    using reverse_iterator_impl       = iterator_impl_template<reverse_iterator, typename container_type::reverse_iterator>;
+} // hidden visitor impl details namespace
 
-    using const_iterator_impl         = iterator_impl_template<const_iterator, typename container_type::const_iterator>;
-    using const_reverse_iterator_impl = iterator_impl_template<const_reverse_iterator, typename container_type::const_reverse_iterator>;
 
-public:
-    composite() : parent()
-    {}
+// Visits the nodes of `df_pre_order_begin()` order with one class dispatch per node.
+template <class Node, class Visitor>
+void visit_df_pre_order(Node &root, Visitor &v, const size_t batch_size = 1)
+{
+    using dispatcher = visit_dispatcher<Visitor>;
 
-    composite(initializer_list &&init_list)
-        : parent(), children(std::move(init_list))
-    {
-    }
+    dispatcher dispatch(v, batch_size);
+    std::vector<typename dispatcher::range> stack;
+    stack.push_back(dispatcher::children(root));
 
-    composite(const self &another)
+    while (!stack.empty())
     {
-        this->_parent = another._parent;
-        for (auto &ptr : another.children)
+        auto &top = stack.back();
+        if (top.empty())
         {
-            children.emplace_back(ptr->clone());
+            stack.pop_back();
+            continue;
         }
-    }
 
-    composite(self &&another) :
-        children(std::move(another.children))
-    {
-        this->_parent = another._parent;
+        auto &node = top.next();
+        dispatch(node);
+
+        auto range = dispatcher::children(node);
+        if (!range.empty())
+        {
+            stack.push_back(std::move(range));
+        }
     }
+    dispatch.flush();
+}
 
-    self &operator=(const self &another)
+
+// Visits the nodes of `bf_begin()` order with one class dispatch per node.
+template <class Node, class Visitor>
+void visit_bf(Node &root, Visitor &v, const size_t batch_size = 1)
+{
+    using dispatcher = visit_dispatcher<Visitor>;
+
+    dispatcher dispatch(v, batch_size);
+    std::queue<typename dispatcher::range> queue;
+    queue.push(dispatcher::children(root));
+
+    while (!queue.empty())
     {
-        set_parent(another.get_parent());
-        for (auto &ptr : another.children)
+        auto &front = queue.front();
+        while (!front.empty())
         {
-            children.emplace_back(ptr->clone());
+            auto &node = front.next();
+            dispatch(node);
+
+            auto range = dispatcher::children(node);
+            if (!range.empty())
+            {
+                queue.push(std::move(range));
+            }
         }
-        return *this;
+        queue.pop();
     }
+    dispatch.flush();
+}
 
-    self &operator=(self &&another)
+
+// Path resolution
+
+namespace
+{
+
+// keyed_composite index, when it is keyed by `NameOf`
+template <class Composite, class NameOf,
+    class = typename std::enable_if<std::is_same<NameOf, typename Composite::key_of_type>::value &&
+        std::is_constructible<typename Composite::key_type, const std::string&>::value>::type>
+auto find_child_by_name(Composite &parent, const std::string &name, const NameOf &, lookup_priority<2>)
+    -> decltype(parent.find(name))
+{
+    return parent.find(name);
+}
+
+// ordered container, when it is ordered by `NameOf`
+template <class Composite, class NameOf,
+    class = typename std::enable_if<std::is_same<NameOf, typename Composite::container_type::key_of_type>::value &&
+        std::is_constructible<typename Composite::container_type::key_type, const std::string&>::value>::type>
+typename Composite::raw_pointer_to_base_interface
+    find_child_by_name(Composite &parent, const std::string &name, const NameOf &, lookup_priority<1>)
+{
+    auto it = parent.cont().find(name);
+    return it != parent.cont().end() ? it->get() : nullptr;
+}
+
+template <class Composite, class NameOf>
+typename Composite::raw_pointer_to_base_interface
+    find_child_by_name(Composite &parent, const std::string &name, const NameOf &name_of, lookup_priority<0>)
+{
+    for (auto &child : parent.cont())
     {
-        set_parent(another.get_parent());
-        another.set_parent(nullptr);
-        children = std::move(another.children);
+        if (name_of(*child) == name)
+        {
+            return child.get();
+        }
     }
+    return nullptr;
+}
 
-    container_type &cont()
+} // hidden path resolution impl details namespace
+
+
+// Resolves separator-delimited paths of child names (`NameOf()(child)`) starting at `root`,
+// keeping an LRU cache of resolved prefixes. A cached prefix stays valid until one of the
+// composites on it loses a child through `remove_if`, `clear` or `relocate_to`. Renaming
+// attached nodes requires `invalidate()`. Keyed and ordered composites whose `KeyOf` is
+// `NameOf` are searched through their indices; other composites are scanned with `NameOf`.
+// Composites of other classes than `Composite` are scanned through their iterators, and paths
+// through them are not cached.
+template <class Composite, class NameOf>
+class path_resolver
+{
+    using self = path_resolver;
+
+public:
+    using raw_pointer_to_base_interface = typename Composite::raw_pointer_to_base_interface;
+    using abstract_type = typename std::remove_pointer<raw_pointer_to_base_interface>::type;
+
+private:
+    using chain_type = std::vector<std::pair<const Composite*, size_t>>;
+    using lru_list = std::list<std::string>;
+
+    struct entry
     {
-        return children;
-    }
+        raw_pointer_to_base_interface node;
+        chain_type chain;
+        typename lru_list::iterator position;
+    };
 
-    const container_type &cont() const
+    struct parsed_path
     {
-        return children;
-    }
+        std::string normalized;
+        std::vector<size_t> begins;
+        std::vector<size_t> ends;
+    };
 
-    void push_back(const value_type &another) override
+public:
+    explicit path_resolver(Composite &root, const size_t capacity = 4096, const char separator = '/') :
+        root(root), capacity(capacity > 0 ? capacity : 1), separator(separator)
     {
-        composite_push_back_impl<self, std::is_copy_constructible<value_type>::value>::call(this, another);
     }
 
-    void push_back(value_type &&another) override
+    raw_pointer_to_base_interface resolve(const std::string &path)
     {
-        another->set_parent(this);
-        children.push_back(std::move(another));
-    }
+        const parsed_path parsed = parse(path);
+        const size_t depth = parsed.ends.size();
+        if (depth == 0)
+        {
+            return &root;
+        }
 
+        raw_pointer_to_base_interface node = &root;
+        chain_type chain;
+        size_t resolved = 0;
 
-    enum references_remove_mode
-    {
-        do_not_track_references,
-        remove_references,
-        nullify_references
-    };
+        for (size_t i = depth; i > 0; --i)
+        {
+            auto it = cache.find(parsed.normalized.substr(0, parsed.ends[i - 1]));
+            if (it == cache.end())
+            {
+                continue;
+            }
 
-    template <class Pred>
-    void remove_if(Pred &func, const references_remove_mode mode = remove_references)
-    {
-        remove_if__mark_for_delete(func);
+            if (!is_valid(it->second))
+            {
+                erase(it);
+                continue;
+            }
 
-        if (mode != do_not_track_references)
+            lru.splice(lru.begin(), lru, it->second.position);
+            node = it->second.node;
+            chain = it->second.chain;
+            resolved = i;
+            break;
+        }
+
+        resolved == depth ? ++_hits : ++_misses;
+
+        bool cacheable = true;
+        for (size_t i = resolved; i < depth && node; ++i)
         {
-            remove_if__handle_references(mode == nullify_references);
+            if (node->kind() != abstract_type::composite_kind)
+            {
+                return nullptr;
+            }
+
+            if (!is_of_resolver_class(*node))
+            {
+                cacheable = false;
+                node = scan_children(*node, parsed, i);
+                continue;
+            }
+
+            auto parent = static_cast<Composite*>(node);
+            chain.emplace_back(parent, parent->structure_version());
+            node = find_child(*parent, parsed, i);
+            if (node && cacheable)
+            {
+                store(parsed.normalized.substr(0, parsed.ends[i]), node, chain);
+            }
         }
 
-        erase_awaiting_destruction();
+        return node;
     }
 
-    iterator begin() override
+    // Resolves a batch of paths in sorted order, reusing the resolved chain of the
+    // previous path for the shared prefix. Results are written in input order.
+    template <class InputIt, class OutputIt>
+    OutputIt resolve(InputIt first, InputIt last, OutputIt out)
     {
-        return iterator(std::make_unique<iterator_impl>(children.begin()));
+        std::vector<parsed_path> paths;
+        for (; first != last; ++first)
+        {
+            paths.push_back(parse(*first));
+        }
+
+        std::vector<size_t> order(paths.size());
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(),
+            [&paths](const size_t a, const size_t b) { return paths[a].normalized < paths[b].normalized; });
+
+        std::vector<raw_pointer_to_base_interface> results(paths.size(), nullptr);
+        std::vector<raw_pointer_to_base_interface> nodes{ &root };
+        const parsed_path *previous = nullptr;
+
+        for (const size_t index : order)
+        {
+            const parsed_path &current = paths[index];
+
+            size_t common = 0;
+            if (previous)
+            {
+                while (common < current.ends.size() && common + 1 < nodes.size() &&
+                    same_component(*previous, current, common))
+                {
+                    ++common;
+                }
+            }
+            nodes.resize(common + 1);
+
+            if (common == 0 && !current.ends.empty())
+            {
+                nodes.push_back(resolve(current.normalized.substr(0, current.ends[0])));
+                ++common;
+            }
+
+            for (size_t i = common; i < current.ends.size(); ++i)
+            {
+                raw_pointer_to_base_interface node = nodes.back();
+                if (!node || node->kind() != abstract_type::composite_kind)
+                {
+                    nodes.push_back(nullptr);
+                }
+                else
+                {
+                    nodes.push_back(is_of_resolver_class(*node) ?
+                        find_child(*static_cast<Composite*>(node), current, i) : scan_children(*node, current, i));
+                }
+            }
+
+            results[index] = current.ends.empty() ? &root : nodes.back();
+            previous = &current;
+        }
+
+        return std::copy(results.begin(), results.end(), out);
     }
 
-    iterator end() override
+    void invalidate()
     {
-        return iterator(std::make_unique<iterator_impl>(children.end()));
+        cache.clear();
+        lru.clear();
     }
 
-    reverse_iterator rbegin() override
+    size_t cache_size() const noexcept
     {
-        return reverse_iterator(std::make_unique<reverse_iterator_impl>(children.rbegin()));
+        return cache.size();
     }
 
-    reverse_iterator rend() override
+    size_t hits() const noexcept
     {
-        return reverse_iterator(std::make_unique<reverse_iterator_impl>(children.rend()));
+        return _hits;
     }
 
-    const_iterator cbegin() const override
+    size_t misses() const noexcept
     {
-        return const_iterator(std::make_unique<const_iterator_impl>(children.cbegin()));
+        return _misses;
     }
 
-    const_iterator cend() const override
+private:
+    parsed_path parse(const std::string &path) const
     {
-        return const_iterator(std::make_unique<const_iterator_impl>(children.cend()));
+        parsed_path parsed;
+        parsed.normalized.reserve(path.size());
+
+        size_t pos = 0;
+        while (pos < path.size())
+        {
+            const size_t next = std::min(path.find(separator, pos), path.size());
+            if (next > pos)
+            {
+                if (!parsed.normalized.empty())
+                {
+                    parsed.normalized.push_back(separator);
+                }
+                parsed.begins.push_back(parsed.normalized.size());
+                parsed.normalized.append(path, pos, next - pos);
+                parsed.ends.push_back(parsed.normalized.size());
+            }
+            pos = next + 1;
+        }
+
+        return parsed;
     }
 
-    const_reverse_iterator crbegin() const override
+    static bool same_component(const parsed_path &a, const parsed_path &b, const size_t i)
     {
-        return const_reverse_iterator(std::make_unique<const_reverse_iterator_impl>(children.crbegin()));
+        return i < a.ends.size() &&
+            a.ends[i] - a.begins[i] == b.ends[i] - b.begins[i] &&
+            a.normalized.compare(a.begins[i], a.ends[i] - a.begins[i], b.normalized, b.begins[i], b.ends[i] - b.begins[i]) == 0;
     }
 
-    const_reverse_iterator crend() const override
+    // Exact, unlike the composite class tag: keyed composites share it with the plain composites
+    // they derive from, and only `Composite`s have its index.
+    static bool is_of_resolver_class(const abstract_type &node) noexcept
     {
-        return const_reverse_iterator(std::make_unique<const_reverse_iterator_impl>(children.crend()));
+        return typeid(node) == typeid(Composite);
     }
 
-    void clear() override
+    static std::string component(const parsed_path &parsed, const size_t i)
     {
-        children.clear();
+        return parsed.normalized.substr(parsed.begins[i], parsed.ends[i] - parsed.begins[i]);
     }
 
-    size_t size() const override
+    raw_pointer_to_base_interface find_child(Composite &parent, const parsed_path &parsed, const size_t i) const
     {
-        return children.size();
+        return find_child_by_name(parent, component(parsed, i), name_of, lookup_priority<2>());
     }
 
-    bool empty() const override final
+    raw_pointer_to_base_interface scan_children(abstract_type &parent, const parsed_path &parsed, const size_t i) const
     {
-        return children.empty();
+        const std::string name = component(parsed, i);
+        for (auto it = parent.begin(); it != parent.end(); ++it)
+        {
+            if (name_of(**it) == name)
+            {
+                return it->get();
+            }
+        }
+        return nullptr;
     }
 
-    size_t nested_hierarchy_size() const override final
+    // Checked from the root down: an unchanged parent guarantees its cached child is alive.
+    static bool is_valid(const entry &e)
     {
-        size_t count = size();
-        for (auto it = cbegin(); it != cend(); ++it)
+        for (const auto &link : e.chain)
         {
-            count += (*it)->nested_hierarchy_size();
+            if (link.first->structure_version() != link.second)
+            {
+                return false;
+            }
         }
-
-        return count;
+        return true;
     }
 
-    bool is_leaf() const override final
+    void store(std::string &&key, raw_pointer_to_base_interface node, const chain_type &chain)
     {
-        return false;
+        auto it = cache.find(key);
+        if (it != cache.end())
+        {
+            erase(it);
+        }
+
+        if (cache.size() >= capacity)
+        {
+            cache.erase(lru.back());
+            lru.pop_back();
+        }
+
+        lru.push_front(key);
+        cache.emplace(std::move(key), entry{ node, chain, lru.begin() });
     }
 
-    bool is_composite() const override final
+    void erase(typename std::unordered_map<std::string, entry>::iterator it)
     {
-        return true;
+        lru.erase(it->second.position);
+        cache.erase(it);
     }
 
-    bool is_reference() const noexcept override final
+private:
+    Composite &root;
+    const size_t capacity;
+    const char separator;
+    NameOf name_of;
+    std::unordered_map<std::string, entry> cache;
+    lru_list lru;
+    size_t _hits{ 0 };
+    size_t _misses{ 0 };
+};
+
+
+
+// Resumable traversal
+
+// Pre-order walk over the descendants of `root` which can stop after a node or time budget and
+// resume later from the same position, e.g. to spread maintenance of a large hierarchy over frames.
+// References are not descended into, and all composites must be `Composite`s.
+// The hierarchy may change between steps but not during them. Children added to composites,
+// also inside ordered ones, are visited if they come after the child the cursor passed last.
+// Removals are detected by `structure_version()`: the cursor then continues at the same child
+// index of the deepest unchanged composite on its path, so nodes may be skipped or visited twice.
+template <class Composite>
+class traversal_cursor
+{
+public:
+    using value_type = typename Composite::value_type;
+
+private:
+    using container_type = typename Composite::container_type;
+    using container_iterator = typename container_type::iterator;
+    using raw_pointer_to_base_interface = typename Composite::raw_pointer_to_base_interface;
+
+    struct frame
+    {
+        Composite *node;
+        size_t version;
+        size_t index;
+        container_iterator it;
+        container_iterator passed;              // the child passed last, if `index` is not zero
+        raw_pointer_to_base_interface last;     // the same child, which contiguous containers may move
+    };
+
+public:
+    explicit traversal_cursor(Composite &root) :
+        root(root)
     {
-        return false;
+        reset();
     }
 
-    bool is_null_reference() const noexcept override final
+    // Restarts from the first child of the root.
+    void reset()
     {
-        return false;
+        stack.clear();
+        enter(&root);
     }
 
-    bool is_traversable() const noexcept override final
+    bool done() const noexcept
     {
-        return true;
+        return stack.empty();
     }
 
-    raw_pointer_to_base_interface clone() const override
+    // Calls `func(child)` for at most `budget` nodes; returns the number of nodes visited.
+    template <class Func>
+    size_t step(Func &&func, const size_t budget)
     {
-        return new self(*this);
+        revalidate();
+        size_t visited = 0;
+        while (visited < budget && visit(func))
+        {
+            ++visited;
+        }
+        return visited;
     }
 
-private:
-    template <class Pred>
-    void remove_if__mark_for_delete(Pred &func)
+    // Visits nodes until `budget` elapses. The clock is read every 16 nodes, so at least
+    // that many nodes are visited unless the traversal ends first.
+    template <class Func, class Rep, class Period>
+    size_t step_for(Func &&func, const std::chrono::duration<Rep, Period> &budget)
     {
-        for (auto &obj : children)
+        static constexpr size_t clock_interval = 16;
+        const auto deadline = std::chrono::steady_clock::now() + budget;
+        revalidate();
+        size_t visited = 0;
+        do
         {
-            if (!obj->is_reference())
+            for (size_t i = 0; i < clock_interval; ++i, ++visited)
             {
-                if (func(obj))
-                {
-                    obj->mark_for_delete();
-                }
-                else if (obj->is_composite())
+                if (!visit(func))
                 {
-                    static_cast<self*>(obj.get())->remove_if__mark_for_delete(func);
+                    return visited;
                 }
             }
-        }
+        } while (std::chrono::steady_clock::now() < deadline);
+        return visited;
     }
 
-    void remove_if__handle_references(const bool nullify)
+private:
+    void enter(Composite * const node)
     {
-        for (auto &obj : children)
+        stack.push_back(frame{ node, node->structure_version(), 0, node->cont().begin(), node->cont().end(), nullptr });
+    }
+
+    template <class Func>
+    bool visit(Func &func)
+    {
+        while (!stack.empty())
         {
-            if (obj->is_reference())
+            auto &top = stack.back();
+            if (top.it == top.node->cont().end())
             {
-                auto ref = static_cast<typename parent::reference*>(obj.get());
-                if (nullify)
-                {
-                    ref->reset();
-                }
-                else
-                {
-                    ref->mark_for_delete();
-                }
+                stack.pop_back();
+                continue;
             }
-            else if (obj->is_composite())
+
+            value_type &child = *top.it;
+            top.passed = top.it;
+            ++top.it;
+            ++top.index;
+            top.last = child.get();
+            func(child);
+            if (!child->is_reference() && child->is_composite())
             {
-                static_cast<self*>(obj.get())->remove_if__handle_references(nullify);
+                enter(static_cast<Composite*>(child.get()));
             }
+            return true;
         }
+        return false;
     }
 
-protected:
-    void relocate_child(raw_pointer_to_base_interface const child, value_type &another) override
+    // Checked from the root down: an unchanged parent guarantees that the next frame's node is alive.
+    void revalidate()
     {
-        auto it = std::find_if(children.begin(), children.end(),
-            [child](const auto &ptr) {return ptr.get() == child; });
-
-        another->push_back(*it); //move
-        children.erase(it);
+        for (size_t i = 0; i < stack.size(); ++i)
+        {
+            auto &current = stack[i];
+            auto &children = current.node->cont();
+            if (current.node->structure_version() != current.version)
+            {
+                current.version = current.node->structure_version();
+                current.index = std::min(current.index, children.size());
+                current.it = std::next(children.begin(), current.index);
+                current.passed = current.index > 0 ? std::prev(current.it) : children.end();
+                current.last = current.index > 0 ? current.passed->get() : nullptr;
+                stack.resize(i + 1);
+                return;
+            }
+            reposition(current, children, typename std::iterator_traits<container_iterator>::iterator_category());
+        }
     }
 
-    void erase_awaiting_destruction() override
+    // Additions may invalidate iterators of contiguous containers, and insertions in front of
+    // the cursor, e.g. into ordered ones, move the child passed last further on.
+    static void reposition(frame &current, container_type &children, std::random_access_iterator_tag)
     {
-        auto it = std::remove_if(children.begin(), children.end(),
-            [](const smart_ptr &obj) { return obj->awaits_destruction(); }
-        );
-
-        children.erase(it, children.end());
-
-        for (auto &obj : children)
+        const auto first = children.begin();
+        if (current.index > 0 && first[current.index - 1].get() != current.last)
         {
-            obj->erase_awaiting_destruction();
+            size_t position = current.index;
+            while (position < children.size() && first[position].get() != current.last)
+            {
+                ++position;
+            }
+            current.index = std::min(position + 1, children.size());
         }
+        current.it = first + current.index;
     }
 
-    void mark_for_delete() noexcept override
+    // Iterators of node-based containers survive additions, so the cursor continues right
+    // after the child passed last, wherever children were added.
+    static void reposition(frame &current, container_type &children, std::bidirectional_iterator_tag)
     {
-        parent::mark_for_delete();
-        for (auto &obj : children)
-        {
-            obj->mark_for_delete();
-        }
+        current.it = current.index > 0 ? std::next(current.passed) : children.begin();
     }
 
-protected:
-    container_type children;
+private:
+    Composite &root;
+    std::vector<frame> stack;
 };
 
 
 
-namespace
-{
+// Node identities
 
-template <class Composite, bool is_copy_constructible>
-struct composite_push_back_impl
-{
-    static void call(Composite const *ptr, const typename Composite::value_type &val)
-    {
-        ptr->cont().push_back(val);
-        ptr->cont().back()->set_parent(ptr);
-    }
-};
+template <class Node>
+    class node_id_registry;
 
-template <class Composite>
-struct composite_push_back_impl<Composite, false>
+
+// Gives nodes a 64-bit ID: `leaf<identifiable<impl>>`, `composite<identifiable<impl>>`.
+// Nodes entering a hierarchy attached to a `node_id_registry` are registered together with
+// their subtrees; zero and conflicting IDs are replaced by fresh ones, so clones attached to
+// the same hierarchy get new identities. Reference nodes are not registered. Registration
+// follows `identifiable` composites only: nodes of other classes are skipped together with
+// their subtrees, and children of such nodes are not registered.
+template <class Base>
+class identifiable : public Base
 {
-    static void call(Composite const *ptr, const typename Composite::value_type &val)
-    {
-    }
-};
+    using self = identifiable;
+    using parent = Base;
 
+    template <class Node>
+        friend class node_id_registry;
 
-template <class IteratorTag, class Iterator>
-struct composite_iterator_categoty_impl
-{
-    using difference_type = typename Iterator::difference_type;
+public:
+    using id_type = std::uint64_t;
+    using registry_type = node_id_registry<self>;
+    using raw_pointer_to_base_interface = typename Base::raw_pointer_to_base_interface;
 
-    static bool less(const Iterator &a, const Iterator &b)
+public:
+    identifiable()
     {
-        return a < b;
     }
 
-    static bool greater(const Iterator &a, const Iterator &b)
+    identifiable(const self &another) :
+        parent(another), _id(another._id)
     {
-        return a > b;
     }
 
-    static typename Iterator::reference offset(const Iterator &it, const difference_type diff)
+    self &operator=(const self &another)
     {
-        return it[diff];
+        parent::operator=(another);
+        return *this;
     }
 
-    static Iterator advance_forwards(Iterator &it, const difference_type diff)
+    ~identifiable()
     {
-        return it + diff;
+        if (_registry)
+        {
+            _registry->erase(this);
+        }
     }
 
-    static Iterator advance_backwards(Iterator &it, const difference_type diff)
+    id_type id() const noexcept
     {
-        return it - diff;
+        return _id;
     }
 
-    static difference_type difference(const Iterator &a, const Iterator &b)
+    // Returns false if the registry replaced a conflicting ID.
+    bool set_id(const id_type id)
     {
-        return a - b;
-    }
-};
-
+        if (!_registry)
+        {
+            _id = id;
+            return true;
+        }
 
-template <class Iterator>
-struct composite_iterator_categoty_impl<std::bidirectional_iterator_tag, Iterator>
-{
-    using difference_type = typename Iterator::difference_type;
+        _registry->erase(this);
+        _id = id;
+        _registry->insert(this);
+        return _id == id;
+    }
 
-    static bool less(const Iterator &a, const Iterator &b)
+    registry_type *registry() const noexcept
     {
-        return false;
+        return _registry;
     }
 
-    static bool greater(const Iterator &a, const Iterator &b)
+    void add_structure_footprint(memory_footprint &footprint) const override
     {
-        return false;
+        parent::add_structure_footprint(footprint);
+        footprint.library_field_bytes += sizeof(self) - sizeof(parent);
     }
 
-    static typename Iterator::reference offset(const Iterator &it, const difference_type diff)
+protected:
+    void set_parent(raw_pointer_to_base_interface const ptr_to_parent) override
     {
-        static typename Iterator::pointer obj = nullptr;
-        return *obj;
+        parent::set_parent(ptr_to_parent);
+
+        registry_type *target = ptr_to_parent && is_identifiable(*ptr_to_parent) ?
+            static_cast<self*>(ptr_to_parent)->_registry : nullptr;
+        if (target != _registry)
+        {
+            registry_type::rebind_subtree(this, target);
+        }
     }
 
-    static Iterator advance_forwards(Iterator &it, const difference_type diff)
+    const void *identity_class_tag() const noexcept override
     {
-        return it;
+        return class_tag();
     }
 
-    static Iterator advance_backwards(Iterator &it, const difference_type diff)
+private:
+    using abstract_type = typename std::remove_pointer<raw_pointer_to_base_interface>::type;
+
+    static const void *class_tag() noexcept
     {
-        return it;
+        static const char tag = 0;
+        return &tag;
     }
 
-    static difference_type difference(const Iterator &a, const Iterator &b)
+    static bool is_identifiable(const abstract_type &node) noexcept
     {
-        return difference_type{};
+        return node.identity_class_tag() == class_tag();
     }
-};
-
-} // hidden composite impl details namespace
 
+private:
+    id_type _id{ 0 };
+    registry_type *_registry{ nullptr };
+};
 
 
-template <class Base>
-class reference : public Base
+// Per-hierarchy index from node ID to node with O(1) lookup.
+template <class Node>
+class node_id_registry
 {
-    using self = reference;
-    using parent = Base;
+    using self = node_id_registry;
 
 public:
-    using smart_ptr = typename Base::smart_ptr;
-    using value_type = typename Base::value_type;
-    using raw_pointer_to_base_interface = typename Base::raw_pointer_to_base_interface;
-
-    using iterator = typename Base::iterator;
-    using const_iterator = typename Base::const_iterator;
-    using reverse_iterator = typename Base::reverse_iterator;
-    using const_reverse_iterator = typename Base::const_reverse_iterator;
-
-    using null_reference_type = null_reference<Base>;
+    using id_type = typename Node::id_type;
+    using index_type = std::unordered_map<id_type, Node*>;
 
 public:
-    reference()
+    node_id_registry()
     {
     }
 
-    void init()
-    {
-        reset();
-    }
+    node_id_registry(const self &) = delete;
+    self &operator=(const self &) = delete;
 
-    virtual null_reference_type *obtain_null_reference() = 0;
-
-    virtual void remove_null_reference()
+    ~node_id_registry()
     {
-        // Mainly useful to delete null_reference objects which were constructed on heap.
+        for (auto &entry : index)
+        {
+            entry.second->_registry = nullptr;
+        }
     }
 
-    explicit reference(const smart_ptr &source)
+    // Registers `root` with its subtree; descendants attached later are registered automatically.
+    void attach(Node &root)
     {
-        assign(source);
+        rebind_subtree(&root, this);
     }
 
-    reference(const self &another)
+    void detach(Node &root)
     {
-        if (!another.is_null())
-        {
-            ptr = another.ptr;
-            _traversable = another._traversable;
-        }
-        else
+        if (root._registry == this)
         {
-            reset();
+            rebind_subtree(&root, nullptr);
         }
     }
 
-    reference(self &&another)
+    Node *find(const id_type id) const
     {
-        if (!another.is_null())
-        {
-            ptr = another.ptr;
-            _traversable = another._traversable;
-            another.reset();
-        }
-        else
-        {
-            reset();
-        }
+        auto it = index.find(id);
+        return it != index.end() ? it->second : nullptr;
     }
 
-    self &operator=(const smart_ptr &source)
+    size_t size() const noexcept
     {
-        assign(source);
-        return *this;
+        return index.size();
     }
 
-    self &operator=(const self &another)
+    id_type last_id() const noexcept
     {
-        if (!another.is_null())
-        {
-            ptr = another.ptr;
-            _traversable = another._traversable;
-        }
-        else
-        {
-            reset();
-        }
-
-        return *this;
+        return _last_id;
     }
 
-    self &operator=(self &&another)
+private:
+    void insert(Node *node)
     {
-        if (!another.is_null())
+        if (node->_id == 0 || !index.emplace(node->_id, node).second)
         {
-            ptr = another.ptr;
-            _traversable = another._traversable;
-            another.reset();
+            node->_id = next_free_id();
+            index.emplace(node->_id, node);
         }
-        else
+        _last_id = std::max(_last_id, node->_id);
+    }
+
+    // The ID after the largest one given out. Once a node took the largest representable ID,
+    // a second cursor wraps around, skipping zero and the IDs in use.
+    id_type next_free_id()
+    {
+        if (_last_id != std::numeric_limits<id_type>::max())
         {
-            reset();
+            return ++_last_id;
         }
 
-        return *this;
+        do
+        {
+            ++_wrapped_id;
+        } while (_wrapped_id == 0 || index.count(_wrapped_id) != 0);
+        return _wrapped_id;
     }
 
-    void assign(const smart_ptr &source)
+    void erase(Node *node)
     {
-        if (is_null() && !source->is_null_reference())
+        auto it = index.find(node->_id);
+        if (it != index.end() && it->second == node)
         {
-            remove_null_reference();
+            index.erase(it);
         }
+    }
 
-        if (!source->is_reference())
-        {          
-            ptr = source.get();
-        }
-        else
+    static void rebind_subtree(Node *root, self *target)
+    {
+        std::vector<Node*> stack{ root };
+        while (!stack.empty())
         {
-            self *ref_obj = static_cast<self*>(source.get());
-            if (!ref_obj->is_null())
+            Node *node = stack.back();
+            stack.pop_back();
+
+            if (node->_registry)
             {
-                ptr = ref_obj->ptr;
-                _traversable = ref_obj->_traversable;
+                node->_registry->erase(node);
             }
-            else
+            node->_registry = target;
+            if (target)
             {
-                reset();
+                target->insert(node);
+            }
+
+            if (node->kind() == Node::composite_kind)
+            {
+                for (auto it = node->begin(); it != node->end(); ++it)
+                {
+                    if (!(*it)->is_reference() && Node::is_identifiable(**it))
+                    {
+                        stack.push_back(static_cast<Node*>(it->get()));
+                    }
+                }
             }
         }
     }
 
-    void push_back(const value_type &another) override
-    {
-        ptr->push_back(another);
-    }
+    friend Node;
 
-    void push_back(value_type &&another) override
-    {
-        ptr->push_back(std::move(another));
-    }
+private:
+    index_type index;
+    id_type _last_id{ 0 };
+    id_type _wrapped_id{ 0 };
+};
 
-    iterator begin() override
-    {
-        return ptr->begin();
-    }
 
-    iterator end() override
-    {
-        return ptr->end();
-    }
 
-    reverse_iterator rbegin() override
-    {
-        return ptr->rbegin();
-    }
+// Subtree aggregates
 
-    reverse_iterator rend() override
+// Caches a bottom-up value per node: `leaf<aggregated<impl, Aggregate>>`, ...
+// `Aggregate` provides `value_type`, `value_type local(const node&)` for the node's own
+// contribution and `void combine(value_type&, const value_type&)` to fold in a child's aggregate.
+// Dirty nodes always have dirty ancestors, so invalidation walks up only to the first dirty one
+// and reads recompute only dirty subtrees. Attaching and detaching children invalidates the
+// parent; payload setters call `invalidate_aggregate()`. Reference nodes and nodes of other
+// classes are not aggregated, and invalidation stops at the first ancestor of another class.
+template <class Base, class Aggregate>
+class aggregated : public Base
+{
+    using self = aggregated;
+    using parent = Base;
+
+public:
+    using aggregate_type = Aggregate;
+    using value_type_of_aggregate = typename Aggregate::value_type;
+    using raw_pointer_to_base_interface = typename Base::raw_pointer_to_base_interface;
+
+public:
+    aggregated()
     {
-        return ptr->rend();
     }
 
-    const_iterator cbegin() const override
+    aggregated(const self &another) :
+        parent(another)
     {
-        return ptr->cbegin();
     }
 
-    const_iterator cend() const override
+    self &operator=(const self &another)
     {
-        return ptr->cend();
+        parent::operator=(another);
+        invalidate_aggregate();
+        return *this;
     }
 
-    const_reverse_iterator crbegin() const override
+    // Collects the dirty subtree parents first, then recomputes it in reverse, so that every
+    // node combines the aggregates of children already recomputed.
+    const value_type_of_aggregate &aggregate() const
     {
-        return ptr->crbegin();
+        if (!_dirty)
+        {
+            return _aggregate;
+        }
+
+        std::vector<const self*> dirty{ this };
+        for (size_t i = 0; i < dirty.size(); ++i)
+        {
+            for_each_aggregated_child(dirty[i], [&dirty](const self *child)
+            {
+                if (child->_dirty)
+                {
+                    dirty.push_back(child);
+                }
+            });
+        }
+
+        Aggregate policy;
+        for (auto it = dirty.rbegin(); it != dirty.rend(); ++it)
+        {
+            const self *node = *it;
+            value_type_of_aggregate value = policy.local(*node);
+            for_each_aggregated_child(node, [&policy, &value](const self *child)
+            {
+                policy.combine(value, child->_aggregate);
+            });
+            node->_aggregate = std::move(value);
+            node->_dirty = false;
+        }
+        return _aggregate;
     }
 
-    const_reverse_iterator crend() const override
+    void invalidate_aggregate() noexcept
     {
-        return ptr->crend();
+        for (const self *node = this; node && !node->_dirty; node = aggregated_parent(node))
+        {
+            node->_dirty = true;
+        }
     }
 
-    void clear() override
+    bool is_aggregate_dirty() const noexcept
     {
-        ptr->clear();
+        return _dirty;
     }
 
-    size_t size() const override final
+    void add_structure_footprint(memory_footprint &footprint) const override
     {
-        return is_traversable() ? ptr->size() : 0;
+        parent::add_structure_footprint(footprint);
+        footprint.library_field_bytes += sizeof(self) - sizeof(parent);
     }
 
-    bool empty() const override final
+protected:
+    void on_child_attached(raw_pointer_to_base_interface const child) override
     {
-        return ptr->empty();
+        parent::on_child_attached(child);
+        invalidate_aggregate();
     }
 
-    size_t nested_hierarchy_size() const override final
+    void on_child_detached(raw_pointer_to_base_interface const child) override
     {
-        return is_traversable() ? ptr->nested_hierarchy_size() : 0;
+        parent::on_child_detached(child);
+        invalidate_aggregate();
     }
 
-    bool is_leaf() const override final
+    const void *aggregated_class_tag() const noexcept override
     {
-        return ptr->is_leaf();
+        return class_tag();
     }
 
-    bool is_composite() const override final
-    {
-        return ptr->is_composite();
-    }
+private:
+    using abstract_type = typename std::remove_pointer<raw_pointer_to_base_interface>::type;
 
-    bool is_reference() const noexcept override final
+    static const void *class_tag() noexcept
     {
-        return true;
+        static const char tag = 0;
+        return &tag;
     }
 
-    bool is_null_reference() const noexcept override final
+    static bool is_aggregated(const abstract_type &node) noexcept
     {
-        return ptr ? ptr->is_null_reference() : true;
+        return !node.is_reference() && node.aggregated_class_tag() == class_tag();
     }
 
-    bool is_traversable() const noexcept override final
+    static const self *aggregated_parent(const self *node) noexcept
     {
-        return _traversable;
+        auto p = node->get_parent();
+        return p && is_aggregated(*p) ? static_cast<const self*>(p) : nullptr;
     }
 
-    void reset()
+    template <class Func>
+    static void for_each_aggregated_child(const self *node, Func &&func)
     {
-        if (ptr && ptr->is_null_reference())
+        if (node->is_composite())
         {
-            return;
+            for (auto it = node->cbegin(); it != node->cend(); ++it)
+            {
+                if (is_aggregated(**it))
+                {
+                    func(static_cast<const self*>(it->get()));
+                }
+            }
         }
-
-        ptr = obtain_null_reference();
-    }
-
-    bool is_null() const
-    {
-        return is_null_reference();
     }
 
-    void set_traversable(const bool value)
-    {
-        _traversable = value;
-    }
+private:
+    mutable value_type_of_aggregate _aggregate{};
+    mutable bool _dirty{ true };
+};
 
-    bool points_to(const smart_ptr &another_ptr) const noexcept
-    {
-        return ptr == another_ptr.get();
-    }
 
-    raw_pointer_to_base_interface get() const noexcept
-    {
-        return ptr;
-    }
 
-protected:
-    raw_pointer_to_base_interface ptr{nullptr};
+// Change notifications
 
-private:
-    bool _traversable{false};
-};
+template <class Node>
+    class change_notifier;
 
 
+// Reports structural changes to the `change_notifier` attached to the nearest observed ancestor:
+// `leaf<observable<impl>>`, `composite<observable<impl>>`. Payload setters call
+// `notify_payload_changed()`. Nodes of other classes in the hierarchy are not reported, and
+// changes below them do not reach notifiers above them.
 template <class Base>
-class null_reference : public Base
+class observable : public Base
 {
-    using self = null_reference;
+    using self = observable;
     using parent = Base;
 
-public:
-    using smart_ptr = typename Base::smart_ptr;
-    using value_type = typename Base::value_type;
-
-    using iterator = typename Base::iterator;
-    using const_iterator = typename Base::const_iterator;
-    using reverse_iterator = typename Base::reverse_iterator;
-    using const_reverse_iterator = typename Base::const_reverse_iterator;
+    template <class Node>
+        friend class change_notifier;
 
 public:
-    null_reference()
-    {
-    }
-
-    void push_back(const value_type &another) override
-    {
-        
-    }
-
-    void push_back(value_type &&another) override
-    {
-       
-    }
-
-    iterator begin() override
-    {
-        return iterator();
-    }
+    using notifier_type = change_notifier<self>;
+    using raw_pointer_to_base_interface = typename Base::raw_pointer_to_base_interface;
 
-    iterator end() override
+public:
+    observable()
     {
-        return iterator();
     }
 
-    reverse_iterator rbegin() override
+    observable(const self &another) :
+        parent(another)
     {
-        return reverse_iterator();
     }
 
-    reverse_iterator rend() override
+    self &operator=(const self &another)
     {
-        return reverse_iterator();
+        parent::operator=(another);
+        return *this;
     }
 
-    const_iterator cbegin() const override
+    ~observable()
     {
-        return const_iterator();
+        if (_tracker)
+        {
+            _tracker->destroyed(this);
+        }
+        if (_notifier)
+        {
+            _notifier->root = nullptr;
+        }
     }
 
-    const_iterator cend() const override
+    void notify_payload_changed()
     {
-        return const_iterator();
+        if (auto notifier = find_notifier(this))
+        {
+            notifier->payload_changed(this);
+        }
     }
 
-    const_reverse_iterator crbegin() const override
+    notifier_type *notifier() const noexcept
     {
-        return const_reverse_iterator();
+        return find_notifier(this);
     }
 
-    const_reverse_iterator crend() const override
+    void add_structure_footprint(memory_footprint &footprint) const override
     {
-        return const_reverse_iterator();
+        parent::add_structure_footprint(footprint);
+        footprint.library_field_bytes += sizeof(self) - sizeof(parent);
     }
 
-    void clear() override
+protected:
+    void on_child_attached(raw_pointer_to_base_interface const child) override
     {
-        
+        parent::on_child_attached(child);
+        if (!is_observable(*child))
+        {
+            return;
+        }
+        if (auto notifier = find_notifier(this))
+        {
+            notifier->attached(this, static_cast<self*>(child));
+        }
     }
 
-    size_t size() const override final
+    void on_child_detached(raw_pointer_to_base_interface const child) override
     {
-        return size_t();
+        if (is_observable(*child))
+        {
+            if (auto notifier = find_notifier(this))
+            {
+                notifier->detached(this, static_cast<self*>(child));
+            }
+        }
+        parent::on_child_detached(child);
     }
 
-    bool empty() const override final
+    const void *observable_class_tag() const noexcept override
     {
-        return true;
+        return class_tag();
     }
 
-    size_t nested_hierarchy_size() const override final
-    {
-        return size_t();
-    }
+private:
+    using abstract_type = typename std::remove_pointer<raw_pointer_to_base_interface>::type;
 
-    bool is_leaf() const override final
+    static const void *class_tag() noexcept
     {
-        return false;
+        static const char tag = 0;
+        return &tag;
     }
 
-    bool is_composite() const override final
+    static bool is_observable(const abstract_type &node) noexcept
     {
-        return false;
+        return node.observable_class_tag() == class_tag();
     }
 
-    bool is_reference() const noexcept override final
+    // Nodes of other classes neither report changes nor pass them on to their ancestors.
+    static self *observed_parent(const self *node) noexcept
     {
-        return true;
+        auto p = node->get_parent();
+        return p && is_observable(*p) ? static_cast<self*>(p) : nullptr;
     }
 
-    bool is_null_reference() const noexcept override final
+    static notifier_type *find_notifier(const self *node) noexcept
     {
-        return true;
+        for (; node; node = observed_parent(node))
+        {
+            if (node->_notifier)
+            {
+                return node->_notifier;
+            }
+        }
+        return nullptr;
     }
 
-    bool is_traversable() const noexcept override final
-    {
-        return false;
-    }
+private:
+    notifier_type *_notifier{ nullptr };
+    notifier_type *_tracker{ nullptr };
 };
 
 
-
-template <class Category,
-    class T,
-    class Distance,
-    class Pointer,
-    class Reference,
-    bool reversed
->
-class polymorphic_iterator_template : public std::iterator<Category, T, Distance, Pointer, Reference>
+// Collects changes under an attached root and delivers them to listeners as one coalesced batch
+// at the end of the outermost transaction or on `flush()`; nothing is delivered synchronously.
+// Per node only the net effect is reported: added and then removed nodes are dropped, nodes
+// moved several times are reported as one relocation, and additions and payload changes below
+// a node added in the same batch are implied by it. Nodes of `removed` changes may be destroyed
+// and serve as keys only.
+template <class Node>
+class change_notifier
 {
-    using self = polymorphic_iterator_template;
+    using self = change_notifier;
 
 public:
-    using pointer = Pointer;
-    using reference = Reference;
-    using difference_type = Distance;
-    const static bool is_reversed = reversed;
-
-    class common_implementation
+    enum class change_kind : unsigned char
     {
-    public:
-        using self = common_implementation;
-        using base_interface = common_implementation;
-
-    public:
-        virtual reference ref() const = 0;
-        virtual pointer ptr() const = 0;
-        virtual self &inc() = 0;
-        virtual self &dec() = 0;
-        virtual self *clone() = 0;
-        virtual bool equal(const self *another) const = 0;
-        virtual bool less(const self *another) const = 0;
-        virtual bool greater(const self *another) const = 0;
-        virtual void advance_forwards(const difference_type diff) = 0;
-        virtual void advance_backwards(const difference_type diff) = 0;
-        virtual difference_type difference(const self *another) const = 0;
-        virtual reference offset(const difference_type diff) const = 0;
-        virtual ~common_implementation() {}
+        added,
+        removed,
+        relocated,
+        payload_changed
     };
 
-    using implementation = common_implementation;
-    using pointer_to_implementation = std::unique_ptr<implementation>;
-
-public:
-    polymorphic_iterator_template()
+    struct change
     {
-    }
+        change_kind kind;
+        Node *node;
+        Node *from;
+        Node *to;
+    };
 
-    explicit polymorphic_iterator_template(pointer_to_implementation &&iter_impl) :
-        impl(std::move(iter_impl))
-    {
-    }
+    using batch_type = std::vector<change>;
+    using listener_type = std::function<void(const batch_type&)>;
 
-    polymorphic_iterator_template(const self &another)
-    {
-        if (another.impl)
-        {
-            impl.reset(another.impl->clone());
-        }
-    }
+private:
+    struct record
+    {
+        Node *node;
+        Node *from;
+        Node *to;
+        bool structural;
+        bool payload;
+        bool destroyed;
+    };
 
-    polymorphic_iterator_template(self &&another) :
-        impl(std::move(another.impl))
+public:
+    change_notifier()
     {
     }
 
-    self &operator=(const self &another)
+    change_notifier(const self &) = delete;
+    self &operator=(const self &) = delete;
+
+    ~change_notifier()
     {
-        if (*this != another)
-        {
-            if (another.impl)
-            {
-                impl.reset(another.impl->clone());
-            }
-            else
-            {
-                impl.reset();
-            }
-        }
-        return *this;
+        detach();
+        untrack();
     }
 
-    self &operator=(self &&another)
+    void attach(Node &root_node)
     {
-        impl = std::move(another.impl);
-        return *this;
+        detach();
+        root = &root_node;
+        root->_notifier = this;
     }
 
-    bool operator==(const self &another) const
+    void detach()
     {
-        if (impl)
-        {
-            return impl->equal(another.impl.get());
-        }
-        else
+        if (root)
         {
-            return another.impl.get() == nullptr;
+            root->_notifier = nullptr;
+            root = nullptr;
         }
     }
 
-    bool operator!=(const self &another) const
-    {
-        return !(*this == another);
-    }
-
-    reference operator*() const
+    size_t subscribe(listener_type listener)
     {
-        return impl->ref();
+        listeners.emplace_back(++last_listener_id, std::move(listener));
+        return last_listener_id;
     }
 
-    pointer operator->() const
+    void unsubscribe(const size_t id)
     {
-        return impl->ptr();
+        listeners.erase(std::remove_if(listeners.begin(), listeners.end(),
+            [id](const auto &entry) { return entry.first == id; }), listeners.end());
     }
 
-    self& operator++()
+    void begin()
     {
-        impl->inc();
-        return *this;
+        ++depth;
     }
 
-    self& operator--()
+    void commit()
     {
-        impl->dec();
-        return *this;
+        if (depth > 0 && --depth == 0)
+        {
+            flush();
+        }
     }
 
-    self operator++(int) const
+    class transaction
     {
-        self new_it(*this);
-        ++new_it;
-        return new_it;
-    }
+    public:
+        explicit transaction(self &notifier) :
+            notifier(notifier)
+        {
+            notifier.begin();
+        }
 
-    self operator--(int) const
-    {
-        self new_it(*this);
-        --new_it;
-        return new_it;
-    }
+        transaction(const transaction &) = delete;
+        transaction &operator=(const transaction &) = delete;
 
-    self operator+(const difference_type offset)
-    {
-        self new_it(*this);
-        new_it.impl->advance_forwards(offset);
-        return new_it;
-    }
+        ~transaction()
+        {
+            notifier.commit();
+        }
 
-    self operator-(const difference_type offset)
-    {
-        self new_it(*this);
-        new_it.impl->advance_backwards(offset);
-        return new_it;
-    }
+    private:
+        self &notifier;
+    };
 
-    difference_type operator-(const self &another) const
+    size_t pending() const noexcept
     {
-        return impl->difference(another.impl.get());
+        return records.size();
     }
 
-    bool operator>(const self &another) const
+    void flush()
     {
-        return impl->greater(another.impl.get());
+        batch_type batch = collect();
+        if (batch.empty())
+        {
+            return;
+        }
+
+        auto current = listeners;
+        for (auto &entry : current)
+        {
+            entry.second(batch);
+        }
     }
 
-    bool operator<(const self &another) const
+private:
+    record &track(Node *node, Node *from)
     {
-        return impl->less(another.impl.get());
+        auto it = index.find(node);
+        if (it != index.end())
+        {
+            return records[it->second];
+        }
+
+        index.emplace(node, records.size());
+        node->_tracker = this;
+        records.push_back(record{ node, from, from, false, false, false });
+        return records.back();
     }
 
-    bool operator>=(const self &another) const
+    void attached(Node *parent, Node *child)
     {
-        return !(*this < another);
+        record &r = track(child, nullptr);
+        r.to = parent;
+        r.structural = true;
     }
 
-    bool operator<=(const self &another) const
+    void detached(Node *parent, Node *child)
     {
-        return !(*this > another);
+        record &r = track(child, parent);
+        r.to = nullptr;
+        r.structural = true;
     }
 
-    reference operator[](const difference_type offset) const
+    void payload_changed(Node *node)
     {
-        return impl->offset(offset);
+        track(node, Node::observed_parent(node)).payload = true;
     }
 
-    bool empty() const
+    // The address may be reused by a node created later in the same batch.
+    void destroyed(Node *node)
     {
-        return impl == nullptr;
+        auto it = index.find(node);
+        if (it != index.end())
+        {
+            record &r = records[it->second];
+            r.to = nullptr;
+            r.destroyed = true;
+            index.erase(it);
+        }
     }
 
-    pointer_to_implementation &get_impl()
+    void untrack()
     {
-        return impl;
+        for (auto &r : records)
+        {
+            if (!r.destroyed)
+            {
+                r.node->_tracker = nullptr;
+            }
+        }
+        records.clear();
+        index.clear();
     }
 
-    const pointer_to_implementation &get_impl() const
+    batch_type collect()
     {
-        return impl;
+        std::unordered_map<const Node*, bool> added;
+        for (const auto &r : records)
+        {
+            if (r.structural && !r.from && r.to)
+            {
+                added.emplace(r.node, true);
+            }
+        }
+
+        auto implied = [&added](const Node *node) {
+            for (auto p = Node::observed_parent(node); p; p = Node::observed_parent(p))
+            {
+                if (added.count(p))
+                {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        batch_type batch;
+        for (const auto &r : records)
+        {
+            if (r.structural && r.from != r.to)
+            {
+                if (!r.from)
+                {
+                    if (!implied(r.node))
+                    {
+                        batch.push_back(change{ change_kind::added, r.node, nullptr, r.to });
+                    }
+                    continue;
+                }
+
+                batch.push_back(change{ r.to ? change_kind::relocated : change_kind::removed, r.node, r.from, r.to });
+            }
+
+            if (r.payload && !r.destroyed && r.to == r.node->get_parent() && !implied(r.node))
+            {
+                batch.push_back(change{ change_kind::payload_changed, r.node, r.to, r.to });
+            }
+        }
+
+        untrack();
+        return batch;
     }
 
-protected:
-    pointer_to_implementation impl;
+    friend Node;
+
+private:
+    Node *root{ nullptr };
+    std::vector<record> records;
+    std::unordered_map<const Node*, size_t> index;
+    std::vector<std::pair<size_t, listener_type>> listeners;
+    size_t last_listener_id{ 0 };
+    size_t depth{ 0 };
 };
 
 
 
-template
-<
-    class T,
-    class Distance,
-    class Pointer,
-    class Reference,
-    bool reversed
->
-class polymorphic_iterator_template<std::bidirectional_iterator_tag, T, Distance, Pointer, Reference, reversed>
-    : public polymorphic_iterator_template<std::random_access_iterator_tag, T, Distance, Pointer, Reference, reversed>
+// Versioned snapshots
+
+// Multi-version hierarchy for readers which must not wait for the writer. `pin()` returns an
+// immutable snapshot which is traversed with the usual iterators and without locks; a writer
+// edits a `draft` which copies only the nodes on the paths to its changes and shares all other
+// subtrees with the previous version, and `commit()` publishes it atomically. Versions and
+// nodes are reclaimed when the last snapshot referring to them is released.
+// Requires `shared_pointer_model`. Shared nodes keep the parent of the version that created them,
+// so `get_parent()` is not meaningful inside snapshots.
+template <class Composite>
+class versioned_hierarchy
 {
-    using parent = polymorphic_iterator_template<std::random_access_iterator_tag, T, Distance, Pointer, Reference, reversed>;
-    using self = polymorphic_iterator_template;
+    using self = versioned_hierarchy;
 
 public:
-    using iterator_category = std::bidirectional_iterator_tag;
-    using pointer = Pointer;
-    using reference = Reference;
-    using difference_type = Distance;
-    using common_implementation = typename parent::common_implementation;
+    using value_type = typename Composite::value_type;
+    using raw_pointer_to_base_interface = typename Composite::raw_pointer_to_base_interface;
+    using abstract_type = typename std::remove_pointer<raw_pointer_to_base_interface>::type;
+    using version_type = std::uint64_t;
 
-    class bidirectional_implementation : public common_implementation
+private:
+    struct state
+    {
+        value_type root;
+        version_type version;
+    };
+
+    using state_pointer = std::shared_ptr<const state>;
+
+public:
+    class snapshot
     {
     public:
-        bool less(const common_implementation *another) const override
+        snapshot()
         {
-            return false;
         }
 
-        bool greater(const common_implementation *another) const override
+        const Composite &root() const
         {
-            return false;
+            return static_cast<const Composite&>(*_state->root);
         }
 
-        reference offset(const difference_type diff) const override
+        version_type version() const noexcept
         {
-            static pointer var = nullptr;
-            return *var;
+            return _state->version;
         }
 
-        virtual void advance_forwards(const difference_type diff) override
+        explicit operator bool() const noexcept
         {
+            return static_cast<bool>(_state);
         }
 
-        virtual void advance_backwards(const difference_type diff) override
+    private:
+        explicit snapshot(state_pointer &&pinned) :
+            _state(std::move(pinned))
         {
         }
 
-        virtual difference_type difference(const common_implementation *another) const override
+        friend class versioned_hierarchy;
+
+    private:
+        state_pointer _state;
+    };
+
+    // Nodes are made writable top-down: `root()` first, then `edit(parent, child)` for children
+    // of writable composites. New children are attached with `push_back` on writable composites
+    // and detached with `remove()`; `remove_if`, `clear` and `relocate_to` would reach into
+    // shared subtrees and must not be used.
+    class draft
+    {
+    public:
+        draft(const draft &) = delete;
+        draft &operator=(const draft &) = delete;
+
+        draft(draft &&) = default;
+
+        Composite &root()
         {
-            return difference_type{};
+            if (!_root)
+            {
+                _root = value_type(base->root->shallow_clone());
+                writable.emplace(_root.get(), true);
+            }
+            return static_cast<Composite&>(*_root);
         }
-    };
 
-    using implementation = bidirectional_implementation;
-    using pointer_to_implementation = std::unique_ptr<implementation>;
+        // Returns the writable copy of `child`, or nullptr if `parent` is not writable or
+        // `child` is not its child.
+        raw_pointer_to_base_interface edit(Composite &parent, const abstract_type *child)
+        {
+            if (writable.count(child))
+            {
+                return const_cast<raw_pointer_to_base_interface>(child);
+            }
 
-public:
-    polymorphic_iterator_template() : parent()
-    {
-    }
+            auto slot = find_slot(parent, child);
+            if (slot == parent.cont().end())
+            {
+                return nullptr;
+            }
 
-    explicit polymorphic_iterator_template(pointer_to_implementation &&iter_impl) :
-        parent(std::forward<pointer_to_implementation>(iter_impl))
-    {
-    }
+            const auto copy = child->shallow_clone();
+            versioned_hierarchy::attach_copy(parent, copy);
+            *slot = value_type(copy);
+            writable.emplace(copy, true);
+            return copy;
+        }
 
-    polymorphic_iterator_template(const self &another) : parent(another)
+        bool remove(Composite &parent, const abstract_type *child)
+        {
+            auto slot = find_slot(parent, child);
+            if (slot == parent.cont().end())
+            {
+                return false;
+            }
+
+            parent.cont().erase(slot);
+            return true;
+        }
+
+        // Fails if another draft was committed after this one was started.
+        bool commit()
+        {
+            if (!_root)
+            {
+                return true;
+            }
+
+            state_pointer expected = base;
+            state_pointer next = std::make_shared<const state>(state{ std::move(_root), base->version + 1 });
+            const bool published = std::atomic_compare_exchange_strong(&owner.current, &expected, next);
+
+            base = published ? std::move(next) : std::move(expected);
+            _root = value_type();
+            writable.clear();
+            return published;
+        }
+
+    private:
+        draft(self &owner, state_pointer &&base) :
+            owner(owner), base(std::move(base))
+        {
+        }
+
+        typename Composite::container_type::iterator find_slot(Composite &parent, const abstract_type *child)
+        {
+            auto &children = parent.cont();
+            if (!writable.count(&parent))
+            {
+                return children.end();
+            }
+            return std::find_if(children.begin(), children.end(),
+                [child](const value_type &ptr) { return ptr.get() == child; });
+        }
+
+        friend class versioned_hierarchy;
+
+    private:
+        self &owner;
+        state_pointer base;
+        value_type _root;
+        std::unordered_map<const abstract_type*, bool> writable;
+    };
+
+public:
+    explicit versioned_hierarchy(value_type root = value_type(new Composite())) :
+        current(std::make_shared<const state>(state{ std::move(root), 0 }))
     {
     }
 
-    polymorphic_iterator_template(self &&another)
-        : parent(std::move(another.impl))
+    versioned_hierarchy(const self &) = delete;
+    self &operator=(const self &) = delete;
+
+    snapshot pin() const
     {
+        return snapshot(std::atomic_load(&current));
     }
 
-    self &operator=(const self &another)
+    draft edit()
     {
-        parent::operator=(another);
-        return *this;
+        return draft(*this, std::atomic_load(&current));
     }
 
-    self &operator=(self &&another)
+    version_type version() const
     {
-        parent::operator=(std::move(another));
-        return *this;
+        return std::atomic_load(&current)->version;
     }
 
-    bool operator==(const self &another) const
+private:
+    static void attach_copy(Composite &parent, raw_pointer_to_base_interface copy)
     {
-        return parent::operator==(another);
+        copy->set_parent(&parent);
     }
 
-    self operator+(const difference_type offset) = delete;
-    self operator-(const difference_type offset) = delete;
-    difference_type operator-(const self &another) const = delete;
-    bool operator>(const self &another) const = delete;
-    bool operator<(const self &another) const = delete;
-    bool operator>=(const self &another) const = delete;
-    bool operator<=(const self &another) const = delete;
-    reference operator[](const difference_type offset) const = delete;
+private:
+    state_pointer current;
 };
 
 
 
-template <class Container>
-struct begin
+// Deferred reclamation
+
+// Epoch-based reclamation: readers wrap accesses in a `critical_section`, and nodes retired by
+// the writer are destroyed by `collect()` once every reader which could have seen them has left.
+// Readers only publish an epoch number on entry and exit. A `retire_scope` makes `remove_if` and
+// `clear` on the current thread retire removed subtrees; the containers themselves still have to
+// be synchronized, e.g. with `concurrent_composite`, if readers iterate them during removal.
+class epoch_domain
 {
-    void operator()(Container &cont, typename Container::iterator &out)
-    {
-        out = cont.begin();
-    }
+    using epoch_type = std::uint64_t;
 
-    void operator()(const Container &cont, typename Container::const_iterator &out)
+    struct alignas(64) reader_slot
     {
-        out = cont.cbegin();
-    }
+        std::atomic<epoch_type> epoch{ 0 };
+        std::atomic<bool> used{ false };
+    };
 
-    void operator()(Container &cont, typename Container::reverse_iterator &out)
+    struct retired_item
     {
-        out = cont.rbegin();
-    }
+        virtual ~retired_item()
+        {
+        }
+    };
 
-    void operator()(const Container &cont, typename Container::const_reverse_iterator &out)
+    template <class T>
+    struct retired_holder : retired_item
     {
-        out = cont.crbegin();
-    }
-};
+        explicit retired_holder(T &&value) :
+            value(std::move(value))
+        {
+        }
 
+        T value;
+    };
 
-template <class Container>
-struct end
-{
-    void operator()(Container &cont, typename Container::iterator &out)
+    struct retired_entry
     {
-        out = cont.end();
-    }
+        std::unique_ptr<retired_item> item;
+        epoch_type epoch;
+    };
 
-    void operator()(const Container &cont, typename Container::const_iterator &out)
+public:
+    // Slots are allocated at cache line boundaries, so that readers do not share lines.
+    explicit epoch_domain(const size_t max_readers = 128) :
+        slot_count(max_readers > 0 ? max_readers : 1)
     {
-        out = cont.cend();
+        slots = static_cast<reader_slot*>(aligned_allocate(slot_count * sizeof(reader_slot), alignof(reader_slot)));
+        for (size_t i = 0; i < slot_count; ++i)
+        {
+            new (&slots[i]) reader_slot();
+        }
     }
 
-    void operator()(Container &cont, typename Container::reverse_iterator &out)
-    {
-        out = cont.rend();
-    }
+    epoch_domain(const epoch_domain &) = delete;
+    epoch_domain &operator=(const epoch_domain &) = delete;
 
-    void operator()(const Container &cont, typename Container::const_reverse_iterator &out)
+    // Destroys everything retired; no reader may be active.
+    ~epoch_domain()
     {
-        out = cont.crend();
+        retired.clear();
+        for (size_t i = 0; i < slot_count; ++i)
+        {
+            slots[i].~reader_slot();
+        }
+        aligned_deallocate(slots);
     }
-};
-
-
 
-template <class Source, class Dest>
-struct inherit_const
-{
-    using type = typename std::conditional<std::is_const<Source>::value, typename std::add_const<Dest>::type, Dest>::type;
-};
+    class critical_section
+    {
+    public:
+        explicit critical_section(epoch_domain &domain) :
+            slot(domain.enter())
+        {
+        }
 
+        critical_section(const critical_section &) = delete;
+        critical_section &operator=(const critical_section &) = delete;
 
-// Hierarchical iterators
+        ~critical_section()
+        {
+            slot.epoch.store(0, std::memory_order_release);
+            slot.used.store(false, std::memory_order_release);
+        }
 
-namespace
-{
-    template <class Iter, const df_traverse_algorithm a>
-    struct df_traverse_algorithm_impl
-    {
-        static void init(Iter &it) {}
-        static void next(Iter &it) {}
+    private:
+        reader_slot &slot;
     };
 
-    template <class Iter>
-    struct df_traverse_algorithm_impl<Iter, df_traverse_algorithm::pre_order>
+    template <class SmartPtr>
+    class retire_scope : private node_disposer<SmartPtr>
     {
-        static void init(Iter &it)
+    public:
+        explicit retire_scope(epoch_domain &domain) :
+            domain(domain), scope(*this)
         {
         }
 
-        static void next(Iter &it)
-        {
-            if (it.can_go_down())
-            {
-                it.go_down();
-                return;
-            }
-
-            while ((++it.top_it()) == it.top_it_end())
-            {
-                if (it.iters.size() == 1) break;
-                it.return_up();
-            }
+    private:
+        void dispose(SmartPtr &&node) override
+        {
+            domain.retire(std::move(node));
         }
+
+    private:
+        epoch_domain &domain;
+        typename node_disposer<SmartPtr>::scope scope;
     };
 
-    template <class Iter>
-    struct df_traverse_algorithm_impl<Iter, df_traverse_algorithm::post_order>
+    template <class T>
+    void retire(T &&value)
     {
-        static void init(Iter &it)
+        const epoch_type epoch = global_epoch.fetch_add(1);
+        std::lock_guard<std::mutex> guard(retired_mutex);
+        retired.push_back(retired_entry{ std::unique_ptr<retired_item>(new retired_holder<typename std::decay<T>::type>(std::forward<T>(value))), epoch });
+    }
+
+    // Destroys retired items no active reader can observe; returns their number.
+    size_t collect()
+    {
+        epoch_type oldest = global_epoch.load();
+        for (size_t i = 0; i < slot_count; ++i)
         {
-            if (it.top_it() != it.top_it_end())
+            const epoch_type epoch = slots[i].epoch.load();
+            if (epoch != 0 && epoch < oldest)
             {
-                while (it.can_go_down())
-                {
-                    it.go_down();
-                }
+                oldest = epoch;
             }
         }
 
-        static void next(Iter &it)
+        std::vector<retired_entry> reclaimable;
+        {
+            std::lock_guard<std::mutex> guard(retired_mutex);
+            auto it = std::partition(retired.begin(), retired.end(),
+                [oldest](const retired_entry &entry) { return entry.epoch >= oldest; });
+            std::move(it, retired.end(), std::back_inserter(reclaimable));
+            retired.erase(it, retired.end());
+        }
+        return reclaimable.size();
+    }
+
+    size_t pending() const
+    {
+        std::lock_guard<std::mutex> guard(retired_mutex);
+        return retired.size();
+    }
+
+private:
+    reader_slot &enter()
+    {
+        const size_t start = std::hash<std::thread::id>()(std::this_thread::get_id()) % slot_count;
+        for (size_t attempt = 0;; ++attempt)
         {
-            if ((++it.top_it()) == it.top_it_end())
+            reader_slot &slot = slots[(start + attempt) % slot_count];
+            bool expected = false;
+            if (!slot.used.load(std::memory_order_relaxed) &&
+                slot.used.compare_exchange_strong(expected, true, std::memory_order_acquire))
             {
-                if (it.iters.size() != 1)
+                // Republish until stable: either `collect()` sees this reader, or the reader
+                // starts after the epoch of everything retired so far.
+                epoch_type epoch = global_epoch.load();
+                for (;;)
                 {
-                    it.return_up();
+                    slot.epoch.store(epoch);
+                    const epoch_type now = global_epoch.load();
+                    if (now == epoch)
+                    {
+                        break;
+                    }
+                    epoch = now;
                 }
-                return;
+                return slot;
             }
-
-            while (it.can_go_down())
+            if ((attempt + 1) % slot_count == 0)
             {
-                it.go_down();
+                std::this_thread::yield();
             }
         }
-    };
-}
-
-
-template <class Iter>
-struct node_iters
-{
-    Iter current;
-    Iter end;
-
-    node_iters()
-    {
     }
 
-    node_iters(Iter &&a, Iter &&b) :
-        current(std::move(a)), end(std::move(b))
-    {
-    }
+private:
+    reader_slot *slots;
+    const size_t slot_count;
+    std::atomic<epoch_type> global_epoch{ 1 };
+    mutable std::mutex retired_mutex;
+    std::vector<retired_entry> retired;
 };
 
 
-template <class LinearIterator, const df_traverse_algorithm traverse_algorithm_param, bool reversed>
-class df_hierarchical_iterator_template :
-    public std::iterator
-    <
-        typename std::forward_iterator_tag,
-        typename LinearIterator::value_type,
-        typename LinearIterator::difference_type,
-        typename LinearIterator::pointer,
-        typename LinearIterator::reference
-    >
+namespace
 {
-    using self = df_hierarchical_iterator_template;
 
-    using node_iters_type = node_iters<LinearIterator>;
-    using stack_container_type = std::vector<node_iters_type>;
+// Unknown pointer models are never dismantled.
+template <class Ptr>
+bool sole_owner(const Ptr &) noexcept
+{
+    return false;
+}
 
-    friend struct df_traverse_algorithm_impl<self, df_traverse_algorithm::pre_order>;
-    friend struct df_traverse_algorithm_impl<self, df_traverse_algorithm::post_order>;
+template <class T, class Deleter>
+bool sole_owner(const std::unique_ptr<T, Deleter> &) noexcept
+{
+    return true;
+}
 
-    using traverse_algorithm = df_traverse_algorithm_impl<self, traverse_algorithm_param>;
+template <class T>
+bool sole_owner(const std::shared_ptr<T> &ptr) noexcept
+{
+    return ptr.use_count() == 1;
+}
 
-public:
-    using iterator_category = typename LinearIterator::iterator_category;
-    using value_type = typename LinearIterator::value_type;
-    using pointer = typename LinearIterator::pointer;
-    using reference = typename LinearIterator::reference;
-    using difference_type = typename LinearIterator::difference_type;
+}
 
+// Destroys subtrees handed over by `remove_if` and `clear` a bounded number of nodes per
+// `step()`, so that freeing a large subtree can be spread over several frames or requests.
+// Nodes are dismantled iteratively, which also keeps deep chains off the call stack. Nodes
+// still shared with another owner are only released, never dismantled.
+template <class SmartPtr>
+class incremental_reclaimer : public node_disposer<SmartPtr>
+{
 public:
-    df_hierarchical_iterator_template()
+    incremental_reclaimer()
     {
     }
 
-    explicit df_hierarchical_iterator_template(LinearIterator &&root_begin, LinearIterator &&root_end)
-    {
-        push(node_iters_type(std::move(root_begin), std::move(root_end)));
-        init();
-    }
+    incremental_reclaimer(const incremental_reclaimer &) = delete;
+    incremental_reclaimer &operator=(const incremental_reclaimer &) = delete;
 
-    df_hierarchical_iterator_template(const self &another) :
-        iters(another.iters)
+    ~incremental_reclaimer()
     {
+        step(std::numeric_limits<size_t>::max());
     }
 
-    df_hierarchical_iterator_template(self &&another) :
-        iters(std::move(another.iters))
+    void dispose(SmartPtr &&node) override
     {
+        if (node)
+        {
+            nodes.push_back(std::move(node));
+        }
     }
 
-    self &operator=(const self &another)
+    // Destroys at most `budget` nodes; returns the number of nodes destroyed.
+    size_t step(const size_t budget)
     {
-        iters = another.iters;
-        return *this;
+        size_t destroyed = 0;
+        while (destroyed < budget && !nodes.empty())
+        {
+            SmartPtr node = std::move(nodes.back());
+            nodes.pop_back();
+            if (sole_owner(node))
+            {
+                node->release_children(*this);
+            }
+            node.reset();
+            ++destroyed;
+        }
+        return destroyed;
     }
 
-    self &operator=(self &&another)
+    size_t pending() const noexcept
     {
-        iters = std::move(another.iters);
-        return *this;
+        return nodes.size();
     }
 
-    bool operator==(const self &another) const
-    {
-        return iters.size() == another.iters.size() &&
-            std::equal(iters.crbegin(), iters.crend(), another.iters.crbegin(),
-                [](const auto &a, const auto &b) {return a.current == b.current; }
-        );
-    }
+private:
+    std::vector<SmartPtr> nodes;
+};
 
-    bool empty() const
+// Destroys subtrees handed over by `remove_if` and `clear` on a dedicated thread. Node
+// destructors then run concurrently with the owner, so they must not touch state shared
+// with the live hierarchy, e.g. `observable` or `identifiable` nodes must not be reclaimed here.
+template <class SmartPtr>
+class background_reclaimer : public node_disposer<SmartPtr>
+{
+public:
+    background_reclaimer() :
+        worker([this]() { run(); })
     {
-        return iters.empty();
     }
 
-    bool operator!=(const self &another) const
-    {
-        return !(*this == another);
-    }
+    background_reclaimer(const background_reclaimer &) = delete;
+    background_reclaimer &operator=(const background_reclaimer &) = delete;
 
-    reference operator*() const
+    // Destroys everything handed over so far before returning.
+    ~background_reclaimer()
     {
-        return *top_it();
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
     }
 
-    pointer operator->() const
+    void dispose(SmartPtr &&node) override
     {
-        return top_it().operator->();
+        if (!node)
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            queue.push_back(std::move(node));
+        }
+        wake.notify_one();
     }
 
-    self& operator++()
+    // Blocks until every subtree handed over so far is destroyed.
+    void wait_idle()
     {
-        traverse_algorithm::next(*this);
-        return *this;
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]() { return queue.empty() && !busy; });
     }
 
-    self operator++(int)
+    size_t pending() const
     {
-        self new_it(*this);
-        ++new_it;
-        return new_it;
+        std::lock_guard<std::mutex> guard(mutex);
+        return queue.size();
     }
 
-    void return_up()
+private:
+    void run()
     {
-        pop();
-    }
+        incremental_reclaimer<SmartPtr> dismantler;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
 
-    void go_down()
-    {
-        using container_type = typename inherit_const<value_type, typename value_type::element_type>::type;
-        container_type &cont = **top_it();
-        LinearIterator _begin, _end;
-        begin<container_type>()(cont, _begin);
-        end<container_type>()(cont, _end);
-        push(node_iters_type(std::move(_begin), std::move(_end)));
-    }
+            std::vector<SmartPtr> batch;
+            batch.swap(queue);
+            busy = true;
+            lock.unlock();
 
-    LinearIterator get_linear_iterator() const
-    {
-        return top_it();
-    }
+            for (auto &node : batch)
+            {
+                dismantler.dispose(std::move(node));
+            }
+            batch.clear();
+            dismantler.step(std::numeric_limits<size_t>::max());
 
-    LinearIterator get_linear_iterator_to_parent() const
-    {
-        const size_t size = iters.size();
-        return size > 1 ? iters[size - 2].current : LinearIterator();
+            lock.lock();
+            busy = false;
+            if (queue.empty())
+            {
+                idle.notify_all();
+            }
+        }
     }
 
 private:
-    LinearIterator &top_it()
-    {
-        return top().current;
-    }
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::vector<SmartPtr> queue;
+    bool busy{ false };
+    bool stopping{ false };
+    std::thread worker;
+};
 
-    const LinearIterator &top_it() const
-    {
-        return top().current;
-    }
 
-    LinearIterator &top_it_end()
-    {
-        return top().end;
-    }
 
-    const LinearIterator &top_it_end() const
-    {
-        return top().end;
-    }
+// Memory accounting
 
-    void init()
+// Reports the memory of a hierarchy by component and by concrete node type. Types are told apart
+// with `typeid`; register them with `add_type<T>()`, so that their object size is known. Nodes of
+// unregistered types are reported with their library fields only. Every allocation is charged
+// `allocation_overhead` bytes for allocator headers and rounding; the root counts as allocated too.
+// References are not followed.
+template <class Abstract>
+class memory_accounting
+{
+public:
+    struct type_footprint
     {
-        traverse_algorithm::init(*this);
-    }
+        std::string name;
+        size_t object_size;
+        memory_footprint footprint;
+    };
 
-    void push(node_iters_type &&pair)
+    struct report
     {
-        iters.push_back(std::move(pair));
-    }
+        memory_footprint total;
+        // Sorted by total bytes, largest first.
+        std::vector<type_footprint> types;
+        size_t unregistered_nodes{ 0 };
+    };
 
-    void pop()
+    explicit memory_accounting(const size_t allocation_overhead = 2 * sizeof(void*)) :
+        allocation_overhead(allocation_overhead)
     {
-        iters.pop_back();
     }
 
-    typename stack_container_type::reference top()
+    template <class T>
+    void add_type(std::string name = typeid(T).name())
     {
-        return iters.back();
+        registered[std::type_index(typeid(T))] = type_footprint{ std::move(name), sizeof(T), memory_footprint() };
     }
 
-    typename stack_container_type::const_reference top() const
+    report measure(const Abstract &root) const
     {
-        return iters.back();
+        return measure(root, [](const Abstract &) { return size_t(0); });
     }
 
-    bool can_go_down() const
+    // `payload_of(node)` returns the heap bytes owned by the payload of `node`.
+    template <class PayloadOf>
+    report measure(const Abstract &root, PayloadOf payload_of) const
     {
-        const auto &node = *top_it();
-        return node->is_traversable() && node->size() > 0;
+        report result;
+        std::unordered_map<std::type_index, size_t> type_slots;
+
+        std::vector<const Abstract*> stack{ &root };
+        while (!stack.empty())
+        {
+            const auto node = stack.back();
+            stack.pop_back();
+
+            memory_footprint footprint;
+            footprint.nodes = 1;
+            footprint.allocations = 1;
+            footprint.vtable_pointer_bytes = sizeof(void*);
+            node->add_structure_footprint(footprint);
+            footprint.external_payload_bytes = payload_of(*node);
+
+            const std::type_index type(typeid(*node));
+            auto slot = type_slots.find(type);
+            if (slot == type_slots.end())
+            {
+                auto known = registered.find(type);
+                slot = type_slots.emplace(type, result.types.size()).first;
+                result.types.push_back(known != registered.end() ? known->second : type_footprint{ type.name(), 0, memory_footprint() });
+            }
+
+            auto &entry = result.types[slot->second];
+            const size_t object_fields = footprint.vtable_pointer_bytes + footprint.library_field_bytes;
+            if (entry.object_size > object_fields)
+            {
+                footprint.inline_payload_bytes = entry.object_size - object_fields;
+            }
+            else if (entry.object_size == 0)
+            {
+                ++result.unregistered_nodes;
+            }
+            footprint.allocation_overhead_bytes = footprint.allocations * allocation_overhead;
+
+            entry.footprint += footprint;
+            result.total += footprint;
+
+            if (node->is_composite() && !node->is_reference())
+            {
+                for (auto it = node->cbegin(); it != node->cend(); ++it)
+                {
+                    stack.push_back(it->get());
+                }
+            }
+        }
+
+        std::sort(result.types.begin(), result.types.end(), [](const type_footprint &a, const type_footprint &b)
+        {
+            return a.footprint.total_bytes() > b.footprint.total_bytes();
+        });
+        return result;
     }
 
 private:
-    stack_container_type iters;
+    size_t allocation_overhead;
+    std::unordered_map<std::type_index, type_footprint> registered;
 };
 
 
 
-template <class LinearIterator, bool reversed>
-class bf_hierarchical_iterator_template :
-    public std::iterator
-    <
-        typename std::forward_iterator_tag,
-        typename LinearIterator::value_type,
-        typename LinearIterator::difference_type,
-        typename LinearIterator::pointer,
-        typename LinearIterator::reference
-    >
-{
-    using self = bf_hierarchical_iterator_template;
+// Hot/cold layout
 
-    using node_iters_type = node_iters<LinearIterator>;
-    using queue_container_type = std::queue<node_iters_type>;
+// Allocates nodes at `Alignment` boundaries: `leaf<cache_aligned<impl>>`, `composite<cache_aligned<impl>>`.
+// Children of composites are laid out after the payload of `impl`, so a node object is read by
+// traversal with a single cache line only if it fits one; keep larger payloads in `cold` fields.
+template <class Base, size_t Alignment = 64>
+class cache_aligned : public Base
+{
+    static_assert(Alignment >= sizeof(void*) && (Alignment & (Alignment - 1)) == 0,
+        "Alignment must be a power of two not smaller than a pointer");
 
 public:
-    using iterator_category = typename LinearIterator::iterator_category;
-    using value_type = typename LinearIterator::value_type;
-    using pointer = typename LinearIterator::pointer;
-    using reference = typename LinearIterator::reference;
-    using difference_type = typename LinearIterator::difference_type;
+    using Base::Base;
 
-public:
-    bf_hierarchical_iterator_template()
+    static void *operator new(const size_t size)
     {
+        return aligned_allocate(size, Alignment);
     }
 
-    explicit bf_hierarchical_iterator_template(LinearIterator &&root_begin, LinearIterator &&root_end)
+    static void operator delete(void * const ptr) noexcept
     {
-        push(node_iters_type(std::move(root_begin), std::move(root_end)));
+        aligned_deallocate(ptr);
     }
+};
 
-    bf_hierarchical_iterator_template(const self &another) :
-        iters(another.iters)
+// Payload field stored out of line, so that nodes hold one pointer instead of the payload and
+// traversal, which never reads payloads, touches fewer cache lines per node. Copies are deep,
+// so clones of nodes get their own payload; moving leaves the source empty.
+template <class T>
+class cold
+{
+public:
+    cold() :
+        ptr(new T())
+    {
+    }
+
+    explicit cold(const T &value) :
+        ptr(new T(value))
     {
     }
 
-    bf_hierarchical_iterator_template(self &&another) :
-        iters(std::move(another.iters))
+    explicit cold(T &&value) :
+        ptr(new T(std::move(value)))
     {
     }
 
-    self &operator=(const self &another)
+    cold(const cold &another) :
+        ptr(another.ptr ? new T(*another.ptr) : nullptr)
     {
-        iters = another.iters;
-        return *this;
     }
 
-    self &operator=(self &&another)
+    cold(cold &&another) noexcept = default;
+
+    cold &operator=(cold another) noexcept
     {
-        iters = std::move(another.iters);
+        ptr.swap(another.ptr);
         return *this;
     }
 
-    bool operator==(const self &another) const
+    T &operator*() noexcept
     {
-        bool result = false;
-        if (iters.size() != 0 && another.iters.size() != 0)
-        {
-            result = current_it() == another.current_it();
-        }
-        else if (iters.size() == 0 && another.iters.size() == 0)
-        {
-            result = true;
-        }
-
-        return result;
+        return *ptr;
     }
 
-    bool operator!=(const self &another) const
+    const T &operator*() const noexcept
     {
-        return !(*this == another);
+        return *ptr;
     }
 
-    reference operator*() const
+    T *operator->() noexcept
     {
-        return *current_it();
+        return ptr.get();
     }
 
-    pointer operator->() const
+    const T *operator->() const noexcept
     {
-        return current_it().operator->();
+        return ptr.get();
     }
 
-    self& operator++()
+    T *get() noexcept
     {
-        if (current_it() != current_it_end())
-        {
-            try_to_push_children_to_queue();
-            ++current_it();
-        }
-
-        if (current_it() == current_it_end())
-        {
-            pop();
-        }
-
-        return *this;
+        return ptr.get();
     }
 
-    self operator++(int)
+    const T *get() const noexcept
     {
-        self new_it(*this);
-        ++new_it;
-        return new_it;
+        return ptr.get();
     }
 
-    bool empty() const
+    explicit operator bool() const noexcept
     {
-        return iters.empty();
+        return static_cast<bool>(ptr);
     }
 
-    LinearIterator get_linear_iterator() const
+    // For the `payload_of` function of `memory_accounting`.
+    size_t heap_bytes() const noexcept
     {
-        return current_it();
+        return ptr ? sizeof(T) : 0;
     }
 
 private:
-    LinearIterator &current_it()
-    {
-        return front().current;
-    }
+    std::unique_ptr<T> ptr;
+};
 
-    const LinearIterator &current_it() const
-    {
-        return front().current;
-    }
 
-    LinearIterator &current_it_end()
-    {
-        return front().end;
-    }
 
-    const LinearIterator &current_it_end() const
+// Parallel algorithms
+
+// Minimal fork-join pool: `for_each_index()` runs `func(i)` for every index on the pool
+// workers and the calling thread, and returns when all indices are processed.
+// If `func` throws, no further indices are handed out, and the first exception is rethrown on
+// the calling thread once every worker has left the job.
+// Calls are serialized; jobs must not call back into the same pool.
+class thread_pool
+{
+public:
+    explicit thread_pool(size_t threads = std::thread::hardware_concurrency())
     {
-        return front().end;
+        for (size_t i = 1; i < threads; ++i)
+        {
+            workers.emplace_back([this]() { work(); });
+        }
     }
 
-    void try_to_push_children_to_queue()
+    thread_pool(const thread_pool &) = delete;
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    ~thread_pool()
     {
-        if (current_has_children())
         {
-            using container_type = typename inherit_const<value_type, typename value_type::element_type>::type;
-            container_type &cont = **current_it();
-            LinearIterator _begin, _end;
-            begin<container_type>()(cont, _begin);
-            end<container_type>()(cont, _end);
-            iters.emplace(std::move(_begin), std::move(_end));
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+
+        for (auto &worker : workers)
+        {
+            worker.join();
         }
     }
 
-    void push(node_iters_type &&pair)
+    size_t size() const noexcept
     {
-        iters.push(std::move(pair));
+        return workers.size() + 1;
     }
 
-    void pop()
+    template <class Func>
+    void for_each_index(const size_t count, Func &&func)
     {
-        iters.pop();
+        std::lock_guard<std::mutex> call_lock(call_mutex);
+
+        if (workers.empty() || count < 2)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                func(i);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = std::ref(func);
+            job_size = count;
+            next_index = 0;
+            busy_workers = workers.size();
+            error = nullptr;
+            ++generation;
+        }
+        wake.notify_all();
+
+        run_job();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]() { return busy_workers == 0; });
+        job = nullptr;
+        if (error)
+        {
+            std::exception_ptr thrown = nullptr;
+            std::swap(thrown, error);
+            lock.unlock();
+            std::rethrow_exception(thrown);
+        }
     }
 
-    typename queue_container_type::reference front()
+    static thread_pool &shared()
     {
-        return iters.front();
+        static thread_pool pool;
+        return pool;
     }
 
-    typename queue_container_type::const_reference front() const
+private:
+    void work()
     {
-        return iters.front();
+        size_t seen_generation = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return stopping || generation != seen_generation; });
+                if (stopping)
+                {
+                    return;
+                }
+                seen_generation = generation;
+            }
+
+            run_job();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy_workers == 0)
+            {
+                done.notify_one();
+            }
+        }
     }
 
-    bool current_has_children()
+    // Keeps exceptions on this side of the pool, so that `job` outlives every call into it.
+    void run_job() noexcept
     {
-        return (*current_it())->size() > 0;
+        try
+        {
+            for (size_t i = next_index++; i < job_size; i = next_index++)
+            {
+                job(i);
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+            next_index = job_size;
+        }
     }
 
 private:
-    queue_container_type iters;
+    std::vector<std::thread> workers;
+    std::mutex call_mutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::function<void(size_t)> job;
+    size_t job_size{ 0 };
+    std::atomic<size_t> next_index{ 0 };
+    std::exception_ptr error;
+    size_t busy_workers{ 0 };
+    size_t generation{ 0 };
+    bool stopping{ false };
 };
 
 
+struct parallel_options
+{
+    thread_pool *pool = nullptr;            // nullptr selects thread_pool::shared()
+    size_t sequential_threshold = 16384;    // hierarchies with fewer nodes are reduced on the calling thread
+    size_t partitions = 256;                // does not depend on the pool size, so results are reproducible
+};
 
-template <class CompositeObjectIterator>
-class iter_wrapper : public std::iterator
-    <
-    typename CompositeObjectIterator::iterator_category,
-    typename CompositeObjectIterator::value_type::element_type
-    >
+
+// Named, unlike other impl details namespaces: `transform_reduce` captures these types in a
+// lambda, which must not have a field of a type with internal linkage.
+namespace detail
 {
-public:
-    using iterator_category = typename CompositeObjectIterator::iterator_category;
-    using value_type = typename CompositeObjectIterator::value_type;
-    using pointer = typename CompositeObjectIterator::pointer;
-    using reference = typename CompositeObjectIterator::reference;
-    using difference_type = typename CompositeObjectIterator::difference_type;
 
-public:
-    iter_wrapper() {}
+template <class Abstract>
+struct reduce_unit
+{
+    const Abstract *node;
+    bool with_descendants;
+};
 
-    explicit iter_wrapper(const CompositeObjectIterator &iterator) :
-        it(iterator)
+template <class Abstract>
+bool has_traversable_children(const Abstract &node)
+{
+    return node.is_traversable() && node.size() > 0;
+}
+
+template <class Abstract>
+void push_children_units(const Abstract &node, std::vector<reduce_unit<Abstract>> &units)
+{
+    for (auto it = node.cbegin(); it != node.cend(); ++it)
     {
+        units.push_back(reduce_unit<Abstract>{ it->get(), true });
     }
+}
 
-    iter_wrapper(const iter_wrapper &another) :
-        it(another.it)
+} // parallel algorithms impl details namespace
+
+
+// Reduces `map(node)` over the nodes of `cdf_pre_order_begin()` order of `root`. Subtrees are
+// reduced in parallel and partial results are combined in pre-order, so for an associative
+// `combine` the result equals the sequential left fold, and it never depends on scheduling.
+// `map` is called concurrently from several threads.
+template <class Node, class T, class Map, class Combine>
+T transform_reduce(const Node &root, T identity, Map map, Combine combine,
+    const parallel_options &options = parallel_options())
+{
+    using abstract_type = typename std::remove_pointer<typename Node::raw_pointer_to_base_interface>::type;
+    using unit = detail::reduce_unit<abstract_type>;
+
+    const abstract_type &top = root;
+
+    size_t count = 0;
+    for (auto it = top.cdf_pre_order_begin(), end = top.cdf_pre_order_end();
+        it != end && count < options.sequential_threshold; ++it)
     {
+        ++count;
     }
 
-    iter_wrapper &operator=(const iter_wrapper &another)
+    if (count < options.sequential_threshold || options.partitions < 2)
     {
-        if (*this != another)
+        T result = identity;
+        for (auto it = top.cdf_pre_order_begin(), end = top.cdf_pre_order_end(); it != end; ++it)
         {
-            it = another.it;
+            result = combine(std::move(result), map(**it));
         }
-        return *this;
+        return result;
     }
 
-    bool operator==(const iter_wrapper &another) const
+    // Split the top of the hierarchy into pre-order units until there are enough of them.
+    std::vector<unit> units, expanded;
+    detail::push_children_units(top, units);
+
+    bool changed = true;
+    while (changed && units.size() < options.partitions)
     {
-        return it == another.it;
+        changed = false;
+        expanded.clear();
+        for (const auto &u : units)
+        {
+            if (u.with_descendants && detail::has_traversable_children(*u.node))
+            {
+                expanded.push_back(unit{ u.node, false });
+                detail::push_children_units(*u.node, expanded);
+                changed = true;
+            }
+            else
+            {
+                expanded.push_back(u);
+            }
+        }
+        units.swap(expanded);
     }
 
-    bool operator!=(const iter_wrapper &another) const
+    const size_t tasks = std::min(options.partitions, units.size());
+    std::vector<T> partial(tasks, identity);
+
+    thread_pool &pool = options.pool ? *options.pool : thread_pool::shared();
+    pool.for_each_index(tasks, [&](const size_t task)
     {
-        return !(*this == another);
+        const size_t first = task * units.size() / tasks;
+        const size_t last = (task + 1) * units.size() / tasks;
+
+        T result = identity;
+        for (size_t i = first; i < last; ++i)
+        {
+            const abstract_type &node = *units[i].node;
+            result = combine(std::move(result), map(node));
+            if (units[i].with_descendants)
+            {
+                for (auto it = node.cdf_pre_order_begin(), end = node.cdf_pre_order_end(); it != end; ++it)
+                {
+                    result = combine(std::move(result), map(**it));
+                }
+            }
+        }
+        partial[task] = std::move(result);
+    });
+
+    T result = std::move(identity);
+    for (auto &value : partial)
+    {
+        result = combine(std::move(result), std::move(value));
     }
+    return result;
+}
 
-    reference operator*() const
+
+
+// Incremental parent-to-child propagation of inherited state (transforms, styles, visibility).
+// Subtrees under nodes marked with `mark_changed()` are recomputed level by level: the kernel
+// is called as `kernel(Node* const* nodes, Node* const* parents, size_t count)` on contiguous
+// batches in which every parent has already been processed (the parent of a hierarchy root is
+// nullptr). Large levels are split into `options.partitions` batches that run on the pool, so
+// independent subtrees proceed in parallel. Marks on descendants of marked nodes are merged, and
+// marked nodes must stay alive until `propagate()`. Reference nodes are not descended into.
+// The kernel receives nodes and parents as `Node*`, so the marked subtrees and the parents of
+// marked nodes must consist of `Node` objects only; debug builds assert it.
+template <class Node>
+class top_down_propagator
+{
+    using base_pointer = decltype(std::declval<const Node&>().get_parent());
+
+public:
+    void mark_changed(Node &node)
     {
-        return **it;
+        marked.push_back(&node);
     }
 
-    pointer operator->() const
+    size_t pending() const noexcept
     {
-        return it->operator->();
+        return marked.size();
     }
 
-    iter_wrapper& operator++()
+    void clear() noexcept
     {
-        ++it;
-        return *this;
+        marked.clear();
     }
 
-    iter_wrapper& operator--()
+    // Returns the number of nodes passed to the kernel.
+    template <class Kernel>
+    size_t propagate(Kernel kernel, const parallel_options &options = {})
     {
-        --it;
-        return *this;
+        std::vector<Node*> nodes = take_roots();
+        std::vector<Node*> parents;
+        parents.reserve(nodes.size());
+        for (auto node : nodes)
+        {
+            parents.push_back(checked(node->get_parent()));
+        }
+
+        size_t processed = 0;
+        std::vector<Node*> next_nodes, next_parents;
+        while (!nodes.empty())
+        {
+            processed += nodes.size();
+            next_nodes.clear();
+            next_parents.clear();
+
+            if (nodes.size() < options.sequential_threshold || options.partitions < 2)
+            {
+                kernel(nodes.data(), parents.data(), nodes.size());
+                gather_children(nodes.data(), nodes.size(), next_nodes, next_parents);
+            }
+            else
+            {
+                const size_t tasks = std::min(options.partitions, nodes.size());
+                std::vector<std::pair<std::vector<Node*>, std::vector<Node*>>> children(tasks);
+
+                thread_pool &pool = options.pool ? *options.pool : thread_pool::shared();
+                pool.for_each_index(tasks, [&](const size_t task)
+                {
+                    const size_t first = task * nodes.size() / tasks;
+                    const size_t last = (task + 1) * nodes.size() / tasks;
+
+                    kernel(nodes.data() + first, parents.data() + first, last - first);
+                    gather_children(nodes.data() + first, last - first, children[task].first, children[task].second);
+                });
+
+                for (auto &chunk : children)
+                {
+                    next_nodes.insert(next_nodes.end(), chunk.first.begin(), chunk.first.end());
+                    next_parents.insert(next_parents.end(), chunk.second.begin(), chunk.second.end());
+                }
+            }
+
+            nodes.swap(next_nodes);
+            parents.swap(next_parents);
+        }
+
+        return processed;
     }
 
-    iter_wrapper operator++(int)
+private:
+    // Drops marks that are covered by a marked ancestor.
+    std::vector<Node*> take_roots()
     {
-        iter_wrapper new_it(*this);
-        ++new_it;
-        return new_it;
+        std::unordered_map<const typename std::remove_pointer<base_pointer>::type*, bool> marks;
+        for (auto node : marked)
+        {
+            marks.emplace(node, true);
+        }
+
+        std::vector<Node*> roots;
+        for (auto node : marked)
+        {
+            auto it = marks.find(node);
+            if (!it->second)
+            {
+                continue;
+            }
+            it->second = false;
+
+            bool covered = false;
+            for (auto p = node->get_parent(); p && !covered; p = p->get_parent())
+            {
+                covered = marks.count(p) != 0;
+            }
+            if (!covered)
+            {
+                roots.push_back(node);
+            }
+        }
+
+        marked.clear();
+        return roots;
     }
 
-    iter_wrapper operator--(int)
+    static Node *checked(const base_pointer node) noexcept
     {
-        iter_wrapper new_it(*this);
-        --new_it;
-        return new_it;
+        assert(!node || dynamic_cast<Node*>(node));
+        return static_cast<Node*>(node);
     }
 
-private:
-    CompositeObjectIterator it;
-};
+    static void gather_children(Node* const* nodes, const size_t count, std::vector<Node*> &children, std::vector<Node*> &parents)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            Node *node = nodes[i];
+            if (!node->is_composite())
+            {
+                continue;
+            }
 
+            for (auto it = node->begin(); it != node->end(); ++it)
+            {
+                if (!(*it)->is_reference())
+                {
+                    children.push_back(checked(it->get()));
+                    parents.push_back(node);
+                }
+            }
+        }
+    }
 
-template <class Iterator>
-iter_wrapper<Iterator> wrap_iterator(const Iterator &iter)
-{
-    return iter_wrapper<Iterator>(iter);
-}
+private:
+    std::vector<Node*> marked;
+};
 
 
 } // composite_object namespace end
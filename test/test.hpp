@@ -9,6 +9,8 @@
 #include "composite_object.hpp"
 #include <cassert>
 #include <iostream>
+#include <numeric>
+#include <stdexcept>
 
 
 namespace composite_object
@@ -96,6 +98,91 @@ namespace unittest
     };
 
 
+    struct value_of
+    {
+        int operator()(const test_class_interface &obj) const
+        {
+            return obj.get_value();
+        }
+    };
+
+    struct name_of
+    {
+        std::string operator()(const test_class_interface &obj) const
+        {
+            return std::to_string(obj.get_value());
+        }
+    };
+
+    struct hex_name_of
+    {
+        std::string operator()(const test_class_interface &obj) const
+        {
+            static const char digits[] = "0123456789abcdef";
+            std::string name;
+            unsigned value = static_cast<unsigned>(obj.get_value());
+            do
+            {
+                name.insert(name.begin(), digits[value % 16]);
+                value /= 16;
+            } while (value);
+            return name;
+        }
+    };
+
+
+    class test_class_keyed_composite :
+        public composite_object::keyed_composite<test_class_composite_base_impl, value_of>
+    {
+        using self = test_class_keyed_composite;
+        using parent = composite_object::keyed_composite<test_class_composite_base_impl, value_of>;
+    public:
+        test_class_keyed_composite() {}
+
+        test_class_keyed_composite(int v)
+        {
+            set_value(v);
+        }
+
+        test_class_keyed_composite(const self &another)
+            : parent(another)
+        {
+            set_value(another.get_value());
+        }
+
+        raw_pointer_to_base_interface clone() const override
+        {
+            return new self(*this);
+        }
+    };
+
+
+    class test_class_ordered_composite :
+        public composite_object::composite<test_class_composite_base_impl, composite_object::ordered_by<value_of>::container_type>
+    {
+    public:
+        test_class_ordered_composite() {}
+
+        test_class_ordered_composite(int v)
+        {
+            set_value(v);
+        }
+    };
+
+
+    class test_class_multiset_ordered_composite :
+        public composite_object::composite<test_class_composite_base_impl, composite_object::multiset_ordered_by<value_of>::container_type>
+    {
+    public:
+        test_class_multiset_ordered_composite() {}
+
+        test_class_multiset_ordered_composite(int v)
+        {
+            set_value(v);
+        }
+    };
+
+
     class test_class_leaf : public composite_object::leaf<test_class_composite_base_impl>
     {
     public:
@@ -400,6 +487,37 @@ namespace unittest
         }
     };
 
+    struct node_kind_flags : public test, public basic_test_setup
+    {
+        const char * name() const override { return "Node kind flags"; }
+
+        void run() override
+        {
+            using abstract = test_class_composite_interface;
+
+            assert(obj.kind() == abstract::composite_kind);
+            assert(obj.is_traversable() && !obj.is_reference());
+            assert((*obj.cbegin())->kind() == abstract::leaf_kind);
+            assert((*obj.cbegin())->is_traversable());
+
+            assert(leaf_a.kind() == abstract::reference_kind);
+            assert(leaf_a.is_reference() && leaf_a.is_leaf() && !leaf_a.is_composite());
+            assert(composite_c.is_composite() && !composite_c.is_leaf());
+            assert(!leaf_a.is_traversable());
+            composite_c.set_traversable(true);
+            assert(composite_c.is_traversable() && composite_c.is_composite());
+
+            composite_c.reset();
+            assert(composite_c.is_null_reference() && !composite_c.is_composite());
+            assert(composite_c.is_traversable());
+
+            test_class_null_reference null_obj;
+            assert(null_obj.kind() == abstract::null_reference_kind);
+            assert(null_obj.is_reference() && null_obj.is_null_reference());
+            assert(!null_obj.is_traversable() && !null_obj.is_leaf() && !null_obj.is_composite());
+        }
+    };
+
     struct clear_function : public test, public basic_test_setup
     {
         const char * name() const override { return "`clear()` function"; }
@@ -587,6 +705,8 @@ namespace unittest
             leaf_a->relocate_to(composite_c);
             assert(obj.size() == size_before_relocation - 1);
             assert((*composite_c->rbegin())->get_parent() == composite_c.get());
+            assert((*composite_c->rbegin())->get_value() == 1);
+            assert(composite_c->size() == 2);
 
             using smart_ptr = typename test_class_composite_interface::smart_ptr;
             obj.push_back(smart_ptr(new test_class_leaf(100500)));
@@ -597,6 +717,1982 @@ namespace unittest
         }
     };
 
+    struct recording_visitor : public composite_object::visitor<test_class_leaf, test_class_composite>
+    {
+        void visit(leaf_type &node) override { values.push_back(node.get_value()); }
+        void visit(composite_type &node) override { values.push_back(node.get_value()); }
+        void visit(reference_type &node) override { values.push_back(node.get_value()); }
+
+        void visit(leaf_type * const *nodes, const size_t count) override
+        {
+            batches.push_back(count);
+            visitor::visit(nodes, count);
+        }
+
+        std::vector<int> values;
+        std::vector<size_t> batches;
+    };
+
+    struct class_recording_visitor :
+        public composite_object::visitor<test_class_leaf, test_class_composite, test_class_keyed_composite>
+    {
+        void visit(leaf_type &) override { classes.push_back("leaf"); }
+        void visit(composite_type &) override { classes.push_back("composite"); }
+        void visit(test_class_keyed_composite &) override { classes.push_back("keyed"); }
+        void visit(abstract_type &) override { classes.push_back("other"); }
+
+        void visit(abstract_type * const *nodes, const size_t count) override
+        {
+            batches.push_back(count);
+            visitor::visit(nodes, count);
+        }
+
+        std::vector<std::string> classes;
+        std::vector<size_t> batches;
+    };
+
+    struct visitor_traversal : public test, public basic_test_setup
+    {
+        const char * name() const override { return "Visitor traversal"; }
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+            obj.push_back(smart_ptr(new test_class_leaf(5)));
+
+            std::vector<int> expected;
+            for (auto it = obj.df_pre_order_begin(); it != obj.df_pre_order_end(); ++it)
+            {
+                expected.push_back((*it)->get_value());
+            }
+
+            recording_visitor df;
+            composite_object::visit_df_pre_order(obj, df);
+            assert(df.values == expected);
+            assert(df.batches.empty());
+
+            recording_visitor batched;
+            composite_object::visit_df_pre_order(obj, batched, 8);
+            assert(batched.values == expected);
+            assert((batched.batches == std::vector<size_t>{ 2, 2 }));
+
+            expected.clear();
+            for (auto it = obj.bf_begin(); it != obj.bf_end(); ++it)
+            {
+                expected.push_back((*it)->get_value());
+            }
+
+            recording_visitor bf;
+            composite_object::visit_bf(obj, bf, 8);
+            assert(bf.values == expected);
+
+            recording_visitor single;
+            leaf_a.accept(single);
+            leaf_a.get()->accept(single);
+            assert((single.values == std::vector<int>{ 1, 1 }));
+
+            // every listed class reaches its own overload, other classes the abstract one
+            test_class_composite mixed;
+            mixed.push_back(smart_ptr(new test_class_keyed_composite()));
+            mixed.begin()->get()->push_back(smart_ptr(new test_class_leaf(1)));
+            mixed.begin()->get()->push_back(smart_ptr(new composite_object::leaf<test_class_composite_base_impl>()));
+            mixed.begin()->get()->push_back(smart_ptr(new composite_object::composite<test_class_composite_base_impl>()));
+            mixed.rbegin()->get()->rbegin()->get()->push_back(smart_ptr(new test_class_composite()));
+            mixed.push_back(smart_ptr(new test_class_leaf(2)));
+
+            const std::vector<std::string> df_classes{ "keyed", "leaf", "other", "other", "composite", "leaf" };
+            class_recording_visitor mixed_df;
+            composite_object::visit_df_pre_order(mixed, mixed_df);
+            assert(mixed_df.classes == df_classes);
+
+            class_recording_visitor mixed_batched;
+            composite_object::visit_df_pre_order(mixed, mixed_batched, 8);
+            assert(mixed_batched.classes == df_classes);
+            assert((mixed_batched.batches == std::vector<size_t>{ 2 }));
+
+            class_recording_visitor mixed_bf;
+            composite_object::visit_bf(mixed, mixed_bf, 8);
+            assert((mixed_bf.classes == std::vector<std::string>{ "keyed", "leaf", "leaf", "other", "other", "composite" }));
+
+            // a throwing visit leaves the pending batch unvisited
+            struct throwing_visitor : public recording_visitor
+            {
+                void visit(composite_type &) override { throw std::runtime_error("visit"); }
+            };
+            throwing_visitor throwing;
+            bool thrown = false;
+            try
+            {
+                composite_object::visit_df_pre_order(obj, throwing, 8);
+            }
+            catch (const std::runtime_error &)
+            {
+                thrown = true;
+            }
+            assert(thrown && (throwing.values == std::vector<int>{ 1, 2 }));
+        }
+    };
+
+    struct keyed_composite_index : public test
+    {
+        const char * name() const override { return "Keyed composite index"; }
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            test_class_keyed_composite dir(0);
+            for (int i = 1; i <= 1000; ++i)
+            {
+                dir.push_back(i % 10 ? smart_ptr(new test_class_leaf(i)) : smart_ptr(new test_class_keyed_composite(i)));
+            }
+
+            assert(dir.get_index().size() == 1000);
+            assert(dir.find(500)->get_value() == 500);
+            assert(dir.find(500)->is_composite());
+            assert(dir.find(1001) == nullptr);
+
+            dir.find(500)->push_back(smart_ptr(new test_class_leaf(5001)));
+            assert(static_cast<test_class_keyed_composite*>(dir.find(500))->contains(5001));
+
+            // clone
+            std::unique_ptr<test_class_keyed_composite> copy(static_cast<test_class_keyed_composite*>(dir.clone()));
+            assert(copy->get_index().size() == 1000);
+            assert(copy->find(42) != dir.find(42));
+            assert(copy->find(42)->get_parent() == copy.get());
+            auto nested_copy = static_cast<test_class_keyed_composite*>(copy->find(500));
+            assert(nested_copy->find(5001) == &**nested_copy->cbegin());
+
+            // remove_if
+            auto odd = [](const smart_ptr &obj) { return obj->get_value() % 2 == 1; };
+            dir.remove_if(odd);
+            assert(dir.size() == 500 && dir.get_index().size() == 500);
+            assert(!dir.contains(7) && dir.contains(8));
+            assert(!static_cast<test_class_keyed_composite*>(dir.find(500))->contains(5001));
+
+            // relocate_to
+            smart_ptr &target = *std::find_if(dir.cont().begin(), dir.cont().end(),
+                [](const smart_ptr &obj) { return obj->get_value() == 20; });
+            dir.find(8)->relocate_to(target);
+            assert(!dir.contains(8) && dir.size() == 499);
+            assert(static_cast<test_class_keyed_composite*>(dir.find(20))->find(8)->get_parent() == dir.find(20));
+
+            // clear
+            dir.clear();
+            assert(dir.get_index().empty());
+            assert(copy->find(42)->get_value() == 42);
+        }
+    };
+
+    struct ordered_children : public test
+    {
+        const char * name() const override { return "Ordered children container"; }
+
+        void run() override
+        {
+            check<test_class_ordered_composite>();
+            check<test_class_multiset_ordered_composite>();
+        }
+
+        template <class Composite>
+        static void check()
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            Composite dir(0);
+            for (int i = 0; i < 100; ++i)
+            {
+                const int value = (i * 37) % 100;
+                dir.push_back(value % 10 ? smart_ptr(new test_class_leaf(value)) : smart_ptr(new Composite(value)));
+            }
+
+            auto &cont = dir.cont();
+            assert(std::is_sorted(cont.begin(), cont.end(),
+                [](const smart_ptr &a, const smart_ptr &b) { return a->get_value() < b->get_value(); }));
+
+            assert((*cont.find(42))->get_value() == 42);
+            assert(cont.find(100) == cont.end());
+            assert(cont.count(5) == 1);
+
+            auto range = cont.range(10, 20);
+            assert(std::distance(range.first, range.second) == 10);
+            assert((*range.first)->get_value() == 10);
+
+            (*cont.find(30))->push_back(smart_ptr(new test_class_leaf(3)));
+            (*cont.find(30))->push_back(smart_ptr(new test_class_leaf(1)));
+            (*cont.find(30))->push_back(smart_ptr(new test_class_leaf(2)));
+
+            std::vector<int> values;
+            for (auto it = dir.df_pre_order_begin(); it != dir.df_pre_order_end(); ++it)
+            {
+                values.push_back((*it)->get_value());
+            }
+            assert(values.size() == 103);
+            assert(values[30] == 30 && values[31] == 1 && values[32] == 2 && values[33] == 3 && values[34] == 31);
+
+            int previous = 100;
+            for (auto it = dir.rbegin(); it != dir.rend(); ++it)
+            {
+                assert((*it)->get_value() < previous);
+                previous = (*it)->get_value();
+            }
+
+            auto odd = [](const smart_ptr &obj) { return obj->get_value() % 2 == 1; };
+            dir.remove_if(odd);
+            assert(dir.size() == 50 && cont.find(41) == cont.end() && cont.find(40) != cont.end());
+            assert(dir.nested_hierarchy_size() == 51);
+
+            std::unique_ptr<test_class_composite_interface> copy(dir.clone());
+            assert(copy->nested_hierarchy_size() == 51 && (*copy->begin())->get_value() == 0);
+        }
+    };
+
+    struct node_ids : public test
+    {
+        const char * name() const override { return "Node IDs"; }
+
+        using node = composite_object::identifiable<test_class_composite_base_impl>;
+        using id_leaf = composite_object::leaf<node>;
+        using id_composite = composite_object::composite<node>;
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            composite_object::node_id_registry<node> registry;
+            id_composite root;
+            registry.attach(root);
+            assert(root.id() != 0 && registry.find(root.id()) == &root);
+
+            std::vector<node*> nodes;
+            for (int i = 0; i < 10; ++i)
+            {
+                auto dir = new id_composite();
+                for (int j = 0; j < 10; ++j)
+                {
+                    dir->push_back(smart_ptr(new id_leaf()));
+                }
+                root.push_back(smart_ptr(dir));
+            }
+            assert(registry.size() == 111);
+            for (auto it = root.df_pre_order_begin(); it != root.df_pre_order_end(); ++it)
+            {
+                auto obj = static_cast<node*>(it->get());
+                assert(registry.find(obj->id()) == obj);
+                nodes.push_back(obj);
+            }
+
+            // relocation inside the hierarchy keeps identities
+            node *first_leaf = nodes[1];
+            const auto first_leaf_id = first_leaf->id();
+            first_leaf->relocate_to(*root.rbegin());
+            assert(first_leaf->id() == first_leaf_id && registry.find(first_leaf_id) == first_leaf);
+
+            // loaded IDs are kept unless they conflict
+            auto loaded = new id_leaf();
+            assert(loaded->set_id(100500));
+            root.push_back(smart_ptr(loaded));
+            assert(registry.find(100500) == loaded);
+            assert(!loaded->set_id(root.id()) && loaded->id() != root.id());
+            assert(registry.find(loaded->id()) == loaded);
+
+            // clones attached to the same hierarchy get fresh IDs
+            const auto original_id = static_cast<node*>(root.begin()->get())->id();
+            root.push_back(smart_ptr((*root.begin())->clone()));
+            auto clone = static_cast<node*>(root.rbegin()->get());
+            assert(clone->id() != original_id && registry.find(clone->id()) == clone);
+            assert(static_cast<node*>(clone->begin()->get())->registry() == &registry);
+            assert(registry.size() == 122);
+
+            // removal
+            const auto removed_id = static_cast<node*>(root.begin()->get())->id();
+            auto pred = [&root](const smart_ptr &obj) { return obj.get() == root.begin()->get(); };
+            root.remove_if(pred);
+            assert(registry.find(removed_id) == nullptr);
+            assert(registry.size() == 112);
+
+            root.clear();
+            assert(registry.size() == 1);
+            registry.detach(root);
+            assert(registry.size() == 0 && root.registry() == nullptr);
+
+            // nodes of other classes are not registered, nor are their children
+            composite_object::node_id_registry<node> other;
+            other.attach(root);
+            smart_ptr plain(new test_class_composite(0));
+            plain->push_back(smart_ptr(new id_leaf()));
+            auto hidden = static_cast<node*>(plain->begin()->get());
+            root.push_back(std::move(plain));
+            assert(other.size() == 1 && hidden->registry() == nullptr);
+
+            // fresh IDs skip zero and the IDs in use once the largest one is taken
+            auto last = new id_leaf();
+            assert(last->set_id(std::numeric_limits<node::id_type>::max()));
+            root.push_back(smart_ptr(last));
+            assert(other.last_id() == std::numeric_limits<node::id_type>::max());
+            root.push_back(smart_ptr(new id_leaf()));
+            root.push_back(smart_ptr(new id_leaf()));
+            const auto first_wrapped = static_cast<node*>(std::prev(root.end(), 2)->get())->id();
+            const auto second_wrapped = static_cast<node*>(root.rbegin()->get())->id();
+            assert(first_wrapped != 0 && second_wrapped != 0 && first_wrapped != second_wrapped);
+            assert(first_wrapped != root.id() && second_wrapped != root.id());
+            assert(other.size() == 4 && other.find(second_wrapped) == root.rbegin()->get());
+        }
+    };
+
+    struct parallel_transform_reduce : public test
+    {
+        const char * name() const override { return "Parallel `transform_reduce()`"; }
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            test_class_composite obj;
+            int value = 0;
+            for (int i = 0; i < 20; ++i)
+            {
+                smart_ptr dir(new test_class_composite(++value));
+                for (int j = 0; j < 30; ++j)
+                {
+                    smart_ptr subdir(new test_class_composite(++value));
+                    for (int k = 0; k < 40; ++k)
+                    {
+                        subdir->push_back(smart_ptr(new test_class_leaf(++value)));
+                    }
+                    dir->push_back(std::move(subdir));
+                }
+                obj.push_back(std::move(dir));
+            }
+
+            auto map = [](const test_class_composite_interface &node) { return static_cast<long long>(node.get_value()); };
+            auto combine = [](long long a, long long b) { return a + b; };
+
+            const long long expected = std::accumulate(
+                composite_object::wrap_iterator(obj.cdf_pre_order_begin()),
+                composite_object::wrap_iterator(obj.cdf_pre_order_end()), 0LL,
+                [](long long acc, const test_class_composite_interface &node) { return acc + node.get_value(); });
+
+            composite_object::thread_pool pool(4);
+            composite_object::parallel_options options;
+            options.pool = &pool;
+            options.sequential_threshold = 1000;
+            assert(composite_object::transform_reduce(obj, 0LL, map, combine, options) == expected);
+
+            options.partitions = 7;
+            assert(composite_object::transform_reduce(obj, 0LL, map, combine, options) == expected);
+
+            // Concatenation is not commutative, so this checks that partial results keep pre-order.
+            auto to_list = [](const test_class_composite_interface &node) { return std::vector<int>{ node.get_value() }; };
+            auto concat = [](std::vector<int> a, const std::vector<int> &b) { a.insert(a.end(), b.begin(), b.end()); return a; };
+            const auto order = composite_object::transform_reduce(obj, std::vector<int>(), to_list, concat, options);
+            assert(order.size() == obj.nested_hierarchy_size());
+            assert(std::is_sorted(order.begin(), order.end()));
+
+            // An exception thrown by `map` on any thread reaches the caller, and the pool stays usable.
+            auto throwing_map = [](const test_class_composite_interface &node)
+            {
+                if (node.get_value() % 500 == 0)
+                {
+                    throw std::runtime_error("map");
+                }
+                return static_cast<long long>(node.get_value());
+            };
+            bool thrown = false;
+            try
+            {
+                composite_object::transform_reduce(obj, 0LL, throwing_map, combine, options);
+            }
+            catch (const std::runtime_error &)
+            {
+                thrown = true;
+            }
+            assert(thrown);
+            assert(composite_object::transform_reduce(obj, 0LL, map, combine, options) == expected);
+
+            basic_test_setup small;
+            assert(composite_object::transform_reduce(small.obj, 0LL, map, combine) == 10);
+        }
+    };
+
+    struct path_resolution : public test
+    {
+        const char * name() const override { return "Path resolution"; }
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            test_class_composite root;
+            for (int i = 0; i < 3; ++i)
+            {
+                smart_ptr dir(new test_class_composite(i));
+                for (int j = 0; j < 3; ++j)
+                {
+                    smart_ptr subdir(new test_class_composite(j));
+                    for (int k = 0; k < 3; ++k)
+                    {
+                        subdir->push_back(smart_ptr(new test_class_leaf(10 + k)));
+                    }
+                    dir->push_back(std::move(subdir));
+                }
+                root.push_back(std::move(dir));
+            }
+
+            composite_object::path_resolver<test_class_composite, name_of> resolver(root);
+            assert(resolver.resolve("") == &root);
+            assert(resolver.resolve("/") == &root);
+
+            auto leaf = resolver.resolve("/1/2/10");
+            assert(leaf && leaf->is_leaf() && leaf->get_parent()->get_value() == 2);
+            assert(resolver.resolve("1//2/10/") == leaf);
+            assert(resolver.hits() == 1 && resolver.cache_size() == 3);
+
+            // cached prefix
+            auto sibling = resolver.resolve("1/2/11");
+            assert(sibling && sibling->get_value() == 11 && sibling->get_parent() == leaf->get_parent());
+            assert(resolver.resolve("1/3") == nullptr);
+            assert(resolver.resolve("1/2/10/0") == nullptr);
+
+            // relocation invalidates paths through the source composite only
+            const auto hits = resolver.hits();
+            auto moved = resolver.resolve("1/2");
+            moved->relocate_to(*(*root.begin())->begin());
+            assert(resolver.hits() == hits + 1);
+            assert(resolver.resolve("1/2/10") == nullptr);
+            assert(resolver.resolve("0/0/2/10") == leaf);
+            assert(resolver.resolve("0/0") != nullptr && resolver.hits() == hits + 2);
+
+            // removal invalidates cached descendants
+            resolver.resolve("2/1/11");
+            auto pred = [](const smart_ptr &obj) { return obj->get_value() == 1; };
+            static_cast<test_class_composite*>(resolver.resolve("2"))->remove_if(pred);
+            assert(resolver.resolve("2/1/11") == nullptr);
+            assert(resolver.resolve("2/1") == nullptr);
+            assert(resolver.resolve("2/0/11") != nullptr);
+
+            // batch resolution keeps input order
+            std::vector<std::string> paths{ "2/2/12", "0", "0/0/2/11", "missing", "0/1/11", "" };
+            std::vector<test_class_composite_interface*> results;
+            resolver.invalidate();
+            resolver.resolve(paths.begin(), paths.end(), std::back_inserter(results));
+            assert(results.size() == paths.size());
+            for (size_t i = 0; i < paths.size(); ++i)
+            {
+                assert(results[i] == resolver.resolve(paths[i]));
+            }
+            assert(results[3] == nullptr && results[5] == &root);
+
+            // bounded cache
+            composite_object::path_resolver<test_class_composite, name_of> small(root, 2);
+            small.resolve("0/1/12");
+            assert(small.cache_size() == 2);
+            assert(small.resolve("0/1/12") != nullptr);
+
+            // keyed composites are scanned by names other than their keys
+            test_class_keyed_composite keyed;
+            for (int i = 0; i < 5; ++i)
+            {
+                keyed.push_back(smart_ptr(new test_class_leaf(i)));
+            }
+            composite_object::path_resolver<test_class_keyed_composite, name_of> keyed_resolver(keyed);
+            assert(keyed_resolver.resolve("3") == keyed.find(3));
+
+            // and searched through their index when keyed by the names
+            using name_keyed_composite = composite_object::keyed_composite<test_class_composite_base_impl, name_of>;
+            name_keyed_composite named;
+            for (int i = 0; i < 5; ++i)
+            {
+                named.push_back(smart_ptr(new test_class_leaf(i)));
+            }
+            composite_object::path_resolver<name_keyed_composite, name_of> named_resolver(named);
+            assert(named_resolver.resolve("3") == named.find("3"));
+
+            // composites of other classes are scanned, and paths through them are not cached
+            named.push_back(smart_ptr(new test_class_composite(5)));
+            named.rbegin()->get()->push_back(smart_ptr(new name_keyed_composite()));
+            auto below_plain = named.rbegin()->get()->begin()->get();
+            below_plain->set_value(6);
+            below_plain->push_back(smart_ptr(new test_class_leaf(7)));
+            named_resolver.invalidate();
+            assert(named_resolver.resolve("5/6/7") == below_plain->begin()->get());
+            assert(named_resolver.cache_size() == 1);
+            assert(named_resolver.resolve("5/6/8") == nullptr && named_resolver.resolve("5/7") == nullptr);
+            std::vector<std::string> mixed{ "5/6/7", "5/6", "3" };
+            results.clear();
+            named_resolver.resolve(mixed.begin(), mixed.end(), std::back_inserter(results));
+            assert((results == std::vector<test_class_composite_interface*>{ below_plain->begin()->get(), below_plain, named.find("3") }));
+
+            composite_object::path_resolver<name_keyed_composite, hex_name_of> hex_resolver(named);
+            named.push_back(smart_ptr(new test_class_leaf(26)));
+            assert(hex_resolver.resolve("1a") == named.find("26"));
+            assert(hex_resolver.resolve("26") == nullptr);
+
+            // the same for ordered composites
+            using name_ordered_composite = composite_object::composite<test_class_composite_base_impl,
+                composite_object::ordered_by<name_of>::container_type>;
+            name_ordered_composite ordered;
+            ordered.push_back(smart_ptr(new test_class_leaf(26)));
+            ordered.push_back(smart_ptr(new test_class_leaf(3)));
+            composite_object::path_resolver<name_ordered_composite, name_of> ordered_resolver(ordered);
+            composite_object::path_resolver<name_ordered_composite, hex_name_of> ordered_hex_resolver(ordered);
+            assert(ordered_resolver.resolve("26") == ordered.cont().begin()->get());
+            assert(ordered_hex_resolver.resolve("1a") == ordered.cont().begin()->get());
+            assert(ordered_hex_resolver.resolve("26") == nullptr);
+        }
+    };
+
+    struct change_notifications : public test
+    {
+        const char * name() const override { return "Change notifications"; }
+
+        using node = composite_object::observable<test_class_composite_base_impl>;
+        using observed_leaf = composite_object::leaf<node>;
+        using observed_composite = composite_object::composite<node>;
+        using notifier_type = composite_object::change_notifier<node>;
+        using change_kind = notifier_type::change_kind;
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            observed_composite root;
+            root.push_back(smart_ptr(new observed_composite()));
+            root.push_back(smart_ptr(new observed_composite()));
+            auto a = static_cast<observed_composite*>(root.begin()->get());
+            auto b = static_cast<observed_composite*>(root.rbegin()->get());
+
+            notifier_type notifier;
+            notifier.attach(root);
+            std::vector<notifier_type::batch_type> batches;
+            const auto id = notifier.subscribe([&batches](const notifier_type::batch_type &batch) { batches.push_back(batch); });
+
+            // bulk edit below a new node is one change
+            {
+                notifier_type::transaction transaction(notifier);
+                root.push_back(smart_ptr(new observed_composite()));
+                auto bulk = root.rbegin()->get();
+                for (int i = 0; i < 10000; ++i)
+                {
+                    bulk->push_back(smart_ptr(new observed_leaf()));
+                }
+                a->push_back(smart_ptr(new observed_leaf()));
+                assert(batches.empty());
+            }
+            assert(batches.size() == 1 && batches[0].size() == 2);
+            assert(batches[0][0].kind == change_kind::added && batches[0][0].to == &root);
+            assert(batches[0][0].node->size() == 10000);
+            assert(batches[0][1].kind == change_kind::added && batches[0][1].to == a);
+
+            // net effects only
+            batches.clear();
+            auto leaf = static_cast<node*>(a->begin()->get());
+            notifier.begin();
+            notifier.begin();
+            b->push_back(smart_ptr(new observed_leaf()));
+            auto transient = [](const smart_ptr &obj) { return obj->is_leaf() && obj->get_parent()->size() == 1 && obj->get_value() == 0; };
+            b->remove_if(transient);
+            assert(b->size() == 0);
+            leaf->set_value(1);
+            leaf->notify_payload_changed();
+            leaf->set_value(2);
+            leaf->notify_payload_changed();
+            leaf->relocate_to(*root.rbegin());
+            leaf->relocate_to(*(++root.begin()));
+            notifier.commit();
+            assert(batches.empty());
+            notifier.commit();
+            assert(batches.size() == 1 && batches[0].size() == 2);
+            assert(batches[0][0].kind == change_kind::relocated && batches[0][0].node == leaf);
+            assert(batches[0][0].from == a && batches[0][0].to == b);
+            assert(batches[0][1].kind == change_kind::payload_changed && batches[0][1].node == leaf);
+
+            // removal, delivered on flush
+            batches.clear();
+            auto relocated = [](const smart_ptr &obj) { return obj->get_value() == 2; };
+            b->remove_if(relocated);
+            assert(batches.empty() && notifier.pending() == 1);
+            notifier.flush();
+            assert(batches.size() == 1 && batches[0].size() == 1);
+            assert(batches[0][0].kind == change_kind::removed && batches[0][0].node == leaf && batches[0][0].from == b);
+
+            // nodes outside the observed hierarchy are not reported
+            batches.clear();
+            observed_composite detached;
+            detached.push_back(smart_ptr(new observed_leaf()));
+            notifier.flush();
+            assert(batches.empty());
+
+            // neither are copies of observed nodes
+            a->push_back(smart_ptr(new observed_composite()));
+            a->rbegin()->get()->push_back(smart_ptr(new observed_leaf()));
+            notifier.flush();
+            batches.clear();
+            std::unique_ptr<test_class_composite_interface> copy(a->clone());
+            assert(copy->nested_hierarchy_size() == 2);
+            notifier.flush();
+            assert(batches.empty());
+
+            // plain nodes are not reported, and neither are observed nodes below them
+            batches.clear();
+            root.push_back(smart_ptr(new test_class_leaf(1)));
+            root.push_back(smart_ptr(new test_class_composite()));
+            auto plain = root.rbegin()->get();
+            plain->push_back(smart_ptr(new observed_composite()));
+            auto below_plain = static_cast<observed_composite*>(plain->begin()->get());
+            below_plain->push_back(smart_ptr(new observed_leaf()));
+            static_cast<node*>(below_plain->begin()->get())->notify_payload_changed();
+            assert(below_plain->notifier() == nullptr);
+            notifier.flush();
+            assert(batches.empty());
+            auto is_plain = [](const smart_ptr &obj) { return dynamic_cast<node*>(obj.get()) == nullptr; };
+            root.remove_if(is_plain);
+            notifier.flush();
+            assert(batches.empty());
+
+            notifier.unsubscribe(id);
+            root.clear();
+            notifier.flush();
+            assert(batches.empty() && notifier.pending() == 0);
+        }
+    };
+
+    struct subtree_aggregates : public test
+    {
+        const char * name() const override { return "Subtree aggregates"; }
+
+        struct value_sum
+        {
+            using value_type = long long;
+
+            static size_t &evaluations()
+            {
+                static size_t count = 0;
+                return count;
+            }
+
+            value_type local(const test_class_interface &node) const
+            {
+                ++evaluations();
+                return node.get_value();
+            }
+
+            void combine(value_type &acc, const value_type &child) const
+            {
+                acc += child;
+            }
+        };
+
+        using node = composite_object::aggregated<test_class_composite_base_impl, value_sum>;
+        using aggregated_leaf = composite_object::leaf<node>;
+        using aggregated_composite = composite_object::composite<node>;
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            aggregated_composite root;
+            node *leaf = nullptr;
+            for (int i = 0; i < 10; ++i)
+            {
+                smart_ptr dir(new aggregated_composite());
+                for (int j = 0; j < 10; ++j)
+                {
+                    smart_ptr subdir(new aggregated_composite());
+                    for (int k = 0; k < 10; ++k)
+                    {
+                        subdir->push_back(smart_ptr(new aggregated_leaf()));
+                        subdir->rbegin()->get()->set_value(1);
+                    }
+                    dir->push_back(std::move(subdir));
+                }
+                root.push_back(std::move(dir));
+            }
+            leaf = static_cast<node*>(root.begin()->get()->begin()->get()->begin()->get());
+
+            value_sum::evaluations() = 0;
+            assert(root.aggregate() == 1000);
+            assert(value_sum::evaluations() == root.nested_hierarchy_size() + 1);
+
+            // a single edit recomputes only the path to the root
+            value_sum::evaluations() = 0;
+            leaf->set_value(11);
+            leaf->invalidate_aggregate();
+            assert(root.is_aggregate_dirty() && !static_cast<node*>(root.rbegin()->get())->is_aggregate_dirty());
+            assert(root.aggregate() == 1010);
+            assert(value_sum::evaluations() == 4);
+
+            value_sum::evaluations() = 0;
+            assert(root.aggregate() == 1010 && value_sum::evaluations() == 0);
+
+            // structural changes
+            root.push_back(smart_ptr(new aggregated_leaf()));
+            root.rbegin()->get()->set_value(5);
+            assert(root.aggregate() == 1015);
+
+            auto &last_dir = *(++root.rbegin());
+            leaf->relocate_to(*last_dir->begin());
+            assert(root.aggregate() == 1015);
+            assert(static_cast<node*>(last_dir->begin()->get())->aggregate() == 11 + 10);
+
+            auto pred = [](const smart_ptr &obj) { return obj->get_value() == 11; };
+            root.remove_if(pred);
+            assert(root.aggregate() == 1004);
+
+            root.begin()->get()->clear();
+            assert(root.aggregate() == 905);
+
+            // plain nodes contribute nothing and stop invalidation
+            root.push_back(smart_ptr(new test_class_leaf(100)));
+            root.push_back(smart_ptr(new test_class_composite(100)));
+            root.rbegin()->get()->push_back(smart_ptr(new aggregated_leaf()));
+            auto below_plain = static_cast<node*>(root.rbegin()->get()->begin()->get());
+            assert(root.aggregate() == 905);
+            below_plain->set_value(7);
+            below_plain->invalidate_aggregate();
+            assert(!root.is_aggregate_dirty() && below_plain->aggregate() == 7);
+
+            // a chain far deeper than the call stack allows recursion for
+            const int depth = 200000;
+            aggregated_composite chain;
+            test_class_composite_interface *current = &chain;
+            for (int i = 0; i < depth; ++i)
+            {
+                current->push_back(smart_ptr(new aggregated_composite()));
+                current = current->rbegin()->get();
+                current->set_value(1);
+            }
+            assert(chain.aggregate() == depth);
+            current->set_value(2);
+            static_cast<node*>(current)->invalidate_aggregate();
+            assert(chain.aggregate() == depth + 1);
+        }
+    };
+
+    struct top_down_propagation : public test
+    {
+        const char * name() const override { return "Top-down propagation"; }
+
+        class world_impl : public test_class_composite_base_impl
+        {
+        public:
+            long long world{ -1 };
+        };
+
+        using world_leaf = composite_object::leaf<world_impl>;
+        using world_composite = composite_object::composite<world_impl>;
+
+        static bool consistent(const world_impl &node, const long long inherited)
+        {
+            const long long world = inherited + node.get_value();
+            bool result = node.world == world;
+            for (auto it = node.cbegin(); it != node.cend(); ++it)
+            {
+                result = result && consistent(static_cast<const world_impl&>(**it), world);
+            }
+            return result;
+        }
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            world_composite root;
+            root.set_value(1);
+            for (int i = 0; i < 20; ++i)
+            {
+                smart_ptr dir(new world_composite());
+                dir->set_value(i);
+                for (int j = 0; j < 30; ++j)
+                {
+                    smart_ptr subdir(new world_composite());
+                    subdir->set_value(j);
+                    for (int k = 0; k < 40; ++k)
+                    {
+                        subdir->push_back(smart_ptr(new world_leaf()));
+                        subdir->rbegin()->get()->set_value(k);
+                    }
+                    dir->push_back(std::move(subdir));
+                }
+                root.push_back(std::move(dir));
+            }
+
+            std::atomic<size_t> batches{ 0 };
+            auto kernel = [&batches](world_impl* const* nodes, world_impl* const* parents, size_t count)
+            {
+                ++batches;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    nodes[i]->world = (parents[i] ? parents[i]->world : 0) + nodes[i]->get_value();
+                }
+            };
+
+            composite_object::parallel_options sequential;
+            sequential.partitions = 1;
+
+            composite_object::top_down_propagator<world_impl> propagator;
+            propagator.mark_changed(root);
+            assert(propagator.propagate(kernel, sequential) == root.nested_hierarchy_size() + 1);
+            assert(batches == 4 && propagator.pending() == 0);
+            assert(consistent(root, 0));
+
+            // only the marked subtree is recomputed; marks below it are merged
+            auto dir = static_cast<world_impl*>(root.begin()->get());
+            auto subdir = static_cast<world_impl*>(dir->begin()->get());
+            auto leaf = static_cast<world_impl*>(subdir->begin()->get());
+            dir->set_value(100);
+            leaf->set_value(7);
+            propagator.mark_changed(*leaf);
+            propagator.mark_changed(*dir);
+            propagator.mark_changed(*subdir);
+            assert(propagator.propagate(kernel, sequential) == 1 + 30 + 30 * 40);
+            assert(consistent(root, 0));
+
+            // independent subtrees in parallel
+            composite_object::thread_pool pool(4);
+            composite_object::parallel_options options;
+            options.pool = &pool;
+            options.sequential_threshold = 100;
+            options.partitions = 8;
+            for (auto it = root.begin(); it != root.end(); ++it)
+            {
+                (*it)->set_value((*it)->get_value() + 1);
+                propagator.mark_changed(static_cast<world_impl&>(**it));
+            }
+            batches = 0;
+            assert(propagator.propagate(kernel, options) == root.nested_hierarchy_size());
+            assert(batches == 1 + 8 + 8);
+            assert(consistent(root, 0));
+        }
+    };
+
+    struct concurrent_composite_locking : public test
+    {
+        const char * name() const override { return "Concurrent composite"; }
+
+        using concurrent = composite_object::concurrent_composite<test_class_composite_base_impl>;
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            const int dirs = 8;
+            concurrent root;
+            std::vector<concurrent*> dir;
+            for (int i = 0; i < dirs; ++i)
+            {
+                dir.push_back(new concurrent());
+                root.push_back(smart_ptr(dir.back()));
+                for (int j = 0; j < 50; ++j)
+                {
+                    dir.back()->push_back(smart_ptr(new test_class_leaf(-1)));
+                }
+            }
+            assert(root.size() == dirs && root.nested_hierarchy_size() == dirs * 51);
+
+            std::atomic<bool> done{ false };
+            std::atomic<size_t> traversals{ 0 };
+            std::vector<std::thread> readers;
+            for (int r = 0; r < 2; ++r)
+            {
+                readers.emplace_back([&]()
+                {
+                    while (!done.load())
+                    {
+                        size_t count = 0;
+                        for (auto it = root.cdf_pre_order_begin(); it != root.cdf_pre_order_end(); ++it)
+                        {
+                            count += (*it)->get_value() >= -1 ? 1 : 0;
+                        }
+                        assert(count >= dirs);
+                        ++traversals;
+                    }
+                });
+            }
+
+            size_t expected = dirs * 51;
+            for (int i = 0; i < 300; ++i)
+            {
+                concurrent *target = dir[i % dirs];
+                target->push_back(smart_ptr(new test_class_leaf(i)));
+                ++expected;
+
+                if (i % 3 == 0)
+                {
+                    auto &other = *std::next(root.begin(), (i + 1) % dirs);
+                    auto last = target->rbegin()->get();
+                    last->relocate_to(other);
+                }
+                if (i % 5 == 0)
+                {
+                    auto pred = [i](const smart_ptr &obj) { return obj->get_value() == i - 5; };
+                    const size_t before = root.nested_hierarchy_size();
+                    dir[(i + 1) % dirs]->remove_if(pred);
+                    expected -= before - root.nested_hierarchy_size();
+                }
+            }
+
+            while (traversals.load() < 10)
+            {
+                std::this_thread::yield();
+            }
+            done = true;
+            for (auto &reader : readers)
+            {
+                reader.join();
+            }
+
+            assert(root.nested_hierarchy_size() == expected);
+            for (int i = 0; i < dirs; ++i)
+            {
+                for (auto it = dir[i]->begin(); it != dir[i]->end(); ++it)
+                {
+                    assert((*it)->get_parent() == dir[i]);
+                }
+            }
+
+            dir[0]->clear();
+            assert(dir[0]->empty());
+
+            // the predicate may read the subtree locked by remove_if
+            auto empty_dir = [](const smart_ptr &obj) { return obj->is_composite() && obj->empty(); };
+            root.remove_if(empty_dir);
+            assert(root.size() == dirs - 1);
+            size_t small = 0;
+            for (auto it = root.begin(); it != root.end(); ++it)
+            {
+                small += (*it)->size() < 55 ? 1 : 0;
+            }
+            auto small_dir = [](const smart_ptr &obj) { return std::distance(obj->begin(), obj->end()) < 55; };
+            root.remove_if(small_dir);
+            assert(root.size() == dirs - 1 - small);
+
+            std::unique_ptr<test_class_composite_interface> copy(root.clone());
+            assert(copy->nested_hierarchy_size() == root.nested_hierarchy_size());
+        }
+    };
+
+    struct versioned_snapshots : public test
+    {
+        const char * name() const override { return "Versioned snapshots"; }
+
+        using shared_interface = composite_object::abstract<test_class_interface, composite_object::shared_pointer_model>;
+
+        class shared_impl : public shared_interface
+        {
+        public:
+            int get_value() const override { return value; }
+            void set_value(int val) override { value = val; }
+
+        private:
+            int value{ 0 };
+        };
+
+        using shared_leaf = composite_object::leaf<shared_impl>;
+        using shared_composite = composite_object::composite<shared_impl>;
+        using hierarchy_type = composite_object::versioned_hierarchy<shared_composite>;
+
+        static long long sum(const shared_interface &root)
+        {
+            long long result = 0;
+            for (auto it = root.cdf_pre_order_begin(); it != root.cdf_pre_order_end(); ++it)
+            {
+                result += (*it)->get_value();
+            }
+            return result;
+        }
+
+        void run() override
+        {
+            using smart_ptr = shared_interface::smart_ptr;
+
+            auto initial = std::make_shared<shared_composite>();
+            for (int i = 0; i < 3; ++i)
+            {
+                smart_ptr dir(new shared_composite());
+                for (int j = 0; j < 3; ++j)
+                {
+                    dir->push_back(smart_ptr(new shared_leaf()));
+                    (*dir->rbegin())->set_value(1);
+                }
+                initial->push_back(dir);
+            }
+
+            hierarchy_type hierarchy(std::move(initial));
+            auto v0 = hierarchy.pin();
+            assert(v0.version() == 0 && sum(v0.root()) == 9);
+
+            // edits copy only the paths to the changed nodes
+            std::weak_ptr<shared_interface> old_dir = v0.root().cont().front();
+            {
+                auto draft = hierarchy.edit();
+                auto &root = draft.root();
+                auto dir = static_cast<shared_composite*>(draft.edit(root, root.cont().front().get()));
+                auto leaf = draft.edit(*dir, dir->cont().front().get());
+                leaf->set_value(10);
+                dir->push_back(smart_ptr(new shared_leaf()));
+                assert(draft.remove(root, root.cont().back().get()));
+                assert(draft.edit(*static_cast<shared_composite*>(root.cont().back().get()), nullptr) == nullptr);
+                assert(draft.commit());
+            }
+
+            auto v1 = hierarchy.pin();
+            assert(v1.version() == 1 && hierarchy.version() == 1);
+            assert(sum(v0.root()) == 9 && v0.root().nested_hierarchy_size() == 12);
+            assert(sum(v1.root()) == 10 + 2 + 3 && v1.root().nested_hierarchy_size() == 9);
+            assert(v0.root().cont().front() != v1.root().cont().front());
+            assert(*std::next(v0.root().cont().begin()) == *std::next(v1.root().cont().begin()));
+            assert(v1.root().cont().front()->get_parent() == &v1.root());
+
+            // concurrent drafts
+            auto first = hierarchy.edit();
+            auto second = hierarchy.edit();
+            first.root().set_value(1);
+            second.root().set_value(2);
+            assert(first.commit() && !second.commit());
+            assert(hierarchy.pin().root().get_value() == 1);
+
+            // old versions are reclaimed when unpinned
+            assert(!old_dir.expired());
+            v0 = hierarchy_type::snapshot();
+            assert(old_dir.expired());
+
+            // readers see consistent versions while the writer commits
+            std::atomic<bool> done{ false };
+            std::atomic<size_t> reads{ 0 };
+            const long long total = sum(hierarchy.pin().root());
+            std::thread reader([&]()
+            {
+                while (!done.load() || reads.load() < 10)
+                {
+                    auto pinned = hierarchy.pin();
+                    assert(sum(pinned.root()) == total);
+                    ++reads;
+                }
+            });
+
+            for (int i = 0; i < 200; ++i)
+            {
+                auto draft = hierarchy.edit();
+                auto &root = draft.root();
+                auto a = static_cast<shared_composite*>(draft.edit(root, root.cont().front().get()));
+                auto b = static_cast<shared_composite*>(draft.edit(root, root.cont().back().get()));
+                auto from = draft.edit(*a, a->cont().back().get());
+                auto to = draft.edit(*b, b->cont().back().get());
+                from->set_value(from->get_value() - 1);
+                to->set_value(to->get_value() + 1);
+                assert(draft.commit());
+            }
+            done = true;
+            reader.join();
+            assert(hierarchy.version() == 202 && sum(hierarchy.pin().root()) == total);
+        }
+    };
+
+    struct append_only_children : public test
+    {
+        const char * name() const override { return "Append-only children"; }
+
+        using append_composite = composite_object::composite<test_class_composite_base_impl, composite_object::append_only_container_type>;
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            const int producers = 4;
+            const int items = 2000;
+
+            append_composite root;
+            std::atomic<bool> done{ false };
+            std::thread reader([&]()
+            {
+                size_t last = 0;
+                while (!done.load())
+                {
+                    size_t count = 0;
+                    for (auto it = root.cbegin(); it != root.cend(); ++it)
+                    {
+                        assert(*it && (*it)->get_parent() == &root);
+                        ++count;
+                    }
+                    assert(count >= last);
+                    last = count;
+                }
+            });
+
+            std::vector<std::thread> threads;
+            for (int p = 0; p < producers; ++p)
+            {
+                threads.emplace_back([&root, p, items]()
+                {
+                    for (int i = 0; i < items; ++i)
+                    {
+                        root.push_back(smart_ptr(new test_class_leaf(p * items + i)));
+                    }
+                });
+            }
+            for (auto &thread : threads)
+            {
+                thread.join();
+            }
+            done = true;
+            reader.join();
+
+            assert(root.size() == producers * items);
+            std::vector<int> values;
+            for (auto it = root.begin(); it != root.end(); ++it)
+            {
+                values.push_back((*it)->get_value());
+            }
+            std::sort(values.begin(), values.end());
+            for (int i = 0; i < producers * items; ++i)
+            {
+                assert(values[i] == i);
+            }
+
+            // single-threaded maintenance
+            auto odd = [](const smart_ptr &obj) { return obj->get_value() % 2 == 1; };
+            root.remove_if(odd);
+            assert(root.size() == producers * items / 2);
+            for (auto it = root.begin(); it != root.end(); ++it)
+            {
+                assert((*it)->get_value() % 2 == 0);
+            }
+
+            root.push_back(smart_ptr(new append_composite()));
+            auto target = root.rbegin()->get();
+            (*root.begin())->relocate_to(*root.rbegin());
+            assert(root.size() == producers * items / 2 && target->size() == 1);
+
+            root.clear();
+            assert(root.empty());
+            root.push_back(smart_ptr(new test_class_leaf(1)));
+            assert(root.size() == 1 && (*root.begin())->get_value() == 1);
+        }
+    };
+
+    struct epoch_reclamation : public test
+    {
+        const char * name() const override { return "Epoch-based reclamation"; }
+
+        class counted_leaf : public test_class_leaf
+        {
+        public:
+            explicit counted_leaf(int v) : test_class_leaf(v) {}
+
+            ~counted_leaf()
+            {
+                set_value(-1);
+                ++destroyed();
+            }
+
+            static std::atomic<int> &destroyed()
+            {
+                static std::atomic<int> count{ 0 };
+                return count;
+            }
+        };
+
+        using concurrent = composite_object::concurrent_composite<test_class_composite_base_impl>;
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+            using retire_scope = composite_object::epoch_domain::retire_scope<smart_ptr>;
+
+            composite_object::epoch_domain domain;
+            test_class_composite root;
+            for (int i = 0; i < 4; ++i)
+            {
+                smart_ptr dir(new test_class_composite(i));
+                dir->push_back(smart_ptr(new counted_leaf(i)));
+                root.push_back(std::move(dir));
+            }
+            auto leaf = root.begin()->get()->begin()->get();
+            counted_leaf::destroyed() = 0;
+
+            // removed nodes outlive readers which could see them
+            {
+                composite_object::epoch_domain::critical_section reader(domain);
+                {
+                    retire_scope scope(domain);
+                    auto pred = [](const smart_ptr &obj) { return obj->is_composite() && obj->get_value() == 0; };
+                    root.remove_if(pred);
+                }
+                assert(root.size() == 3 && domain.pending() == 1);
+                assert(domain.collect() == 0 && leaf->get_value() == 0);
+            }
+            assert(counted_leaf::destroyed() == 0);
+            assert(domain.collect() == 1 && domain.pending() == 0);
+            assert(counted_leaf::destroyed() == 1);
+
+            // readers entering after the removal do not hold it back
+            {
+                retire_scope scope(domain);
+                root.begin()->get()->clear();
+            }
+            {
+                composite_object::epoch_domain::critical_section late_reader(domain);
+                assert(domain.collect() == 1 && counted_leaf::destroyed() == 2);
+            }
+
+            // without a scope nodes are destroyed immediately
+            auto pred = [](const smart_ptr &obj) { return obj->get_value() == 2; };
+            root.remove_if(pred);
+            assert(counted_leaf::destroyed() == 3 && domain.pending() == 0);
+
+            // readers keep raw pointers beyond their iterators while the writer removes
+            concurrent shared;
+            for (int i = 0; i < 50; ++i)
+            {
+                shared.push_back(smart_ptr(new counted_leaf(i + 1)));
+            }
+
+            std::atomic<bool> done{ false };
+            std::vector<std::thread> readers;
+            for (int r = 0; r < 2; ++r)
+            {
+                readers.emplace_back([&]()
+                {
+                    while (!done.load())
+                    {
+                        composite_object::epoch_domain::critical_section section(domain);
+                        std::vector<test_class_composite_interface*> seen;
+                        for (auto it = shared.begin(); it != shared.end(); ++it)
+                        {
+                            seen.push_back(it->get());
+                        }
+                        for (auto node : seen)
+                        {
+                            assert(node->get_value() > 0);
+                        }
+                    }
+                });
+            }
+
+            for (int i = 0; i < 200; ++i)
+            {
+                {
+                    retire_scope scope(domain);
+                    auto target = shared.begin()->get();
+                    auto same = [target](const smart_ptr &obj) { return obj.get() == target; };
+                    shared.remove_if(same);
+                }
+                shared.push_back(smart_ptr(new counted_leaf(i + 100)));
+                domain.collect();
+            }
+            done = true;
+            for (auto &reader : readers)
+            {
+                reader.join();
+            }
+            domain.collect();
+            assert(domain.pending() == 0 && shared.size() == 50);
+
+            // retired concurrent composites are not left locked for their readers
+            smart_ptr dir(new concurrent());
+            dir->push_back(smart_ptr(new concurrent()));
+            auto retired = dir.get();
+            shared.push_back(std::move(dir));
+            {
+                composite_object::epoch_domain::critical_section reader(domain);
+                {
+                    retire_scope scope(domain);
+                    auto same = [retired](const smart_ptr &obj) { return obj.get() == retired; };
+                    shared.remove_if(same);
+                }
+                assert(domain.pending() == 1 && shared.size() == 50);
+                assert(retired->size() == 1 && retired->begin()->get()->empty());
+            }
+            assert(domain.collect() == 1);
+        }
+    };
+
+    struct background_reclamation : public test
+    {
+        const char * name() const override { return "Background and incremental reclamation"; }
+
+        using counted_leaf = epoch_reclamation::counted_leaf;
+        using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+        // One chain of `depth` nested composites, each holding `width` counted leaves.
+        static smart_ptr make_chain(const int depth, const int width)
+        {
+            smart_ptr top(new test_class_composite(1));
+            auto current = top.get();
+            for (int i = 0; i < depth; ++i)
+            {
+                for (int j = 0; j < width; ++j)
+                {
+                    current->push_back(smart_ptr(new counted_leaf(j)));
+                }
+                current->push_back(smart_ptr(new test_class_composite(1)));
+                current = current->rbegin()->get();
+            }
+            return top;
+        }
+
+        void run() override
+        {
+            using disposer_scope = composite_object::node_disposer<smart_ptr>::scope;
+
+            // removal costs only the direct children; destruction is spread over steps
+            test_class_composite root;
+            root.push_back(make_chain(10000, 1));
+            root.push_back(make_chain(10, 9));
+            root.push_back(smart_ptr(new counted_leaf(7)));
+            counted_leaf::destroyed() = 0;
+            {
+                composite_object::incremental_reclaimer<smart_ptr> reclaimer;
+                {
+                    disposer_scope scope(reclaimer);
+                    auto pred = [](const smart_ptr &obj) { return obj->is_composite(); };
+                    root.remove_if(pred);
+                }
+                assert(root.size() == 1 && reclaimer.pending() == 2);
+                assert(counted_leaf::destroyed() == 0);
+
+                assert(reclaimer.step(5) == 5);
+                size_t steps = 1;
+                while (reclaimer.step(100) > 0)
+                {
+                    ++steps;
+                }
+                assert(steps > 100 && reclaimer.pending() == 0);
+                assert(counted_leaf::destroyed() == 10090);
+
+                disposer_scope scope(reclaimer);
+                root.clear();
+                assert(root.empty() && reclaimer.pending() == 1);
+            }
+            assert(counted_leaf::destroyed() == 10091);
+
+            // the background thread destroys removed subtrees
+            for (int i = 0; i < 4; ++i)
+            {
+                root.push_back(make_chain(1000, 2));
+            }
+            counted_leaf::destroyed() = 0;
+            {
+                composite_object::background_reclaimer<smart_ptr> reclaimer;
+                {
+                    disposer_scope scope(reclaimer);
+                    auto first = root.begin()->get();
+                    auto pred = [first](const smart_ptr &obj) { return obj.get() == first; };
+                    root.remove_if(pred);
+                    reclaimer.wait_idle();
+                    assert(root.size() == 3 && counted_leaf::destroyed() == 2000);
+                    root.clear();
+                }
+                assert(root.empty());
+            }
+            assert(counted_leaf::destroyed() == 8000);
+
+            // nodes still shared elsewhere are released, not dismantled
+            using shared_interface = versioned_snapshots::shared_interface;
+            using shared_composite = versioned_snapshots::shared_composite;
+            using shared_ptr = shared_interface::smart_ptr;
+
+            shared_composite shared_root;
+            shared_ptr kept(new shared_composite());
+            kept->push_back(shared_ptr(new versioned_snapshots::shared_leaf()));
+            shared_root.push_back(kept);
+            {
+                composite_object::incremental_reclaimer<shared_ptr> reclaimer;
+                composite_object::node_disposer<shared_ptr>::scope scope(reclaimer);
+                shared_root.clear();
+                assert(reclaimer.step(10) == 1);
+            }
+            assert(kept->size() == 1);
+        }
+    };
+
+    struct deep_hierarchies : public test
+    {
+        const char * name() const override { return "Deep hierarchies"; }
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+            const int depth = 200000;
+
+            // a chain far deeper than the call stack allows recursion for
+            test_class_composite root(0);
+            test_class_composite_interface *current = &root;
+            for (int i = 1; i <= depth; ++i)
+            {
+                current->push_back(smart_ptr(new test_class_leaf(-i)));
+                current->push_back(smart_ptr(new test_class_composite(i)));
+                current = current->rbegin()->get();
+            }
+            assert(root.nested_hierarchy_size() == 2 * depth);
+
+            {
+                test_class_composite copy(root);
+                assert(copy.nested_hierarchy_size() == 2 * depth);
+                auto node = static_cast<test_class_composite_interface*>(&copy);
+                for (int i = 1; i <= depth; ++i)
+                {
+                    assert(node->size() == 2 && node->begin()->get()->get_value() == -i);
+                    node = node->rbegin()->get();
+                }
+            }
+
+            // predicates still see the children in pre-order
+            std::vector<int> seen;
+            auto pred = [&seen](const smart_ptr &obj)
+            {
+                seen.push_back(obj->get_value());
+                return obj->get_value() == 10;
+            };
+            root.remove_if(pred);
+            assert(root.nested_hierarchy_size() == 19);
+            assert((seen == std::vector<int>{ -1, 1, -2, 2, -3, 3, -4, 4, -5, 5, -6, 6, -7, 7, -8, 8, -9, 9, -10, 10 }));
+
+            current = root.rbegin()->get();
+            for (int i = 0; i < depth; ++i)
+            {
+                current->push_back(smart_ptr(new test_class_composite(i)));
+                current = current->rbegin()->get();
+            }
+            root.clear();
+            assert(root.nested_hierarchy_size() == 0);
+        }
+    };
+
+    struct mixed_composite_classes : public test
+    {
+        const char * name() const override { return "Hierarchies mixing composite classes"; }
+
+        // Copies of composites do not copy their own payload, so copies are compared by leaves.
+        static std::vector<int> values_of(test_class_composite_interface &root, const bool leaves_only = false)
+        {
+            std::vector<int> values;
+            for (auto it = root.df_pre_order_begin(); it != root.df_pre_order_end(); ++it)
+            {
+                if (!leaves_only || (*it)->is_leaf())
+                {
+                    values.push_back((*it)->get_value());
+                }
+            }
+            return values;
+        }
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            // plain composites and composites with ordered containers nested into each other
+            std::unique_ptr<test_class_composite> root(new test_class_composite(0));
+            root->push_back(smart_ptr(new test_class_leaf(1)));
+            root->push_back(smart_ptr(new test_class_ordered_composite(2)));
+            root->push_back(smart_ptr(new test_class_leaf(9)));
+            auto ordered = std::next(root->begin())->get();
+            ordered->push_back(smart_ptr(new test_class_leaf(8)));
+            ordered->push_back(smart_ptr(new test_class_composite(3)));
+            ordered->push_back(smart_ptr(new test_class_leaf(5)));
+            auto plain = ordered->begin()->get();
+            plain->push_back(smart_ptr(new test_class_leaf(4)));
+            plain->push_back(smart_ptr(new test_class_ordered_composite(6)));
+            plain->rbegin()->get()->push_back(smart_ptr(new test_class_leaf(7)));
+            plain->rbegin()->get()->push_back(smart_ptr(new test_class_composite(10)));
+
+            const std::vector<int> expected{ 1, 2, 3, 4, 6, 7, 10, 5, 8, 9 };
+            assert(root->nested_hierarchy_size() == expected.size());
+            assert(ordered->nested_hierarchy_size() == 7);
+            assert(values_of(*root) == expected);
+
+            std::unique_ptr<test_class_composite_interface> copy(root->clone());
+            assert(copy->nested_hierarchy_size() == expected.size());
+            assert(values_of(*copy, true) == values_of(*root, true));
+            for (auto it = copy->df_pre_order_begin(); it != copy->df_pre_order_end(); ++it)
+            {
+                assert((*it)->get_parent() != nullptr && (*it)->get_parent() != root.get());
+            }
+
+            // removal below an ordered composite, and of an ordered composite below a plain one
+            auto pred = [](const smart_ptr &obj) { return obj->get_value() == 4 || obj->get_value() == 6 || obj->get_value() == 8; };
+            root->remove_if(pred);
+            assert(root->nested_hierarchy_size() == 5);
+            assert((values_of(*root) == std::vector<int>{ 1, 2, 3, 5, 9 }));
+            assert(copy->nested_hierarchy_size() == expected.size());
+
+            // a leaf below a copied ordered composite
+            auto deeper = [](const smart_ptr &obj) { return obj->get_value() == 7; };
+            copy->push_back(smart_ptr(root.release()));
+            static_cast<composite_object::composite<test_class_composite_base_impl>*>(copy.get())->remove_if(deeper);
+            assert(copy->nested_hierarchy_size() == expected.size() + 6 - 1);
+
+            // destruction of a mixed chain deeper than the call stack allows recursion for
+            test_class_composite_interface *current = copy.get();
+            for (int i = 0; i < 100000; ++i)
+            {
+                if (i % 2)
+                {
+                    current->push_back(smart_ptr(new test_class_composite(i)));
+                }
+                else
+                {
+                    current->push_back(smart_ptr(new test_class_ordered_composite(i)));
+                }
+                current = current->rbegin()->get();
+            }
+            copy.reset();
+        }
+    };
+
+    struct memory_footprint_report : public test
+    {
+        const char * name() const override { return "Memory footprint report"; }
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            test_class_composite root;
+            root.push_back(smart_ptr(new test_class_leaf(1)));
+            root.push_back(smart_ptr(new test_class_leaf(2)));
+            root.push_back(smart_ptr(new test_class_composite(3)));
+            for (int i = 0; i < 3; ++i)
+            {
+                root.rbegin()->get()->push_back(smart_ptr(new test_class_leaf(i)));
+            }
+
+            composite_object::memory_accounting<test_class_composite_interface> accounting(16);
+            accounting.add_type<test_class_leaf>("leaf");
+            accounting.add_type<test_class_composite>("composite");
+            auto payload_of = [](const test_class_composite_interface &node) { return node.is_leaf() ? size_t(100) : size_t(0); };
+            const auto report = accounting.measure(root, payload_of);
+
+            const auto &total = report.total;
+            assert(total.nodes == 7 && report.unregistered_nodes == 0);
+            assert(total.allocations == 7 + 6 && total.allocation_overhead_bytes == 13 * 16);
+            assert(total.smart_pointer_bytes == 6 * sizeof(smart_ptr));
+            assert(total.container_bytes == 6 * 2 * sizeof(void*));
+            assert(total.external_payload_bytes == 500);
+            assert(total.vtable_pointer_bytes + total.library_field_bytes + total.inline_payload_bytes ==
+                5 * sizeof(test_class_leaf) + 2 * sizeof(test_class_composite));
+            assert(total.library_field_bytes > 0 && total.inline_payload_bytes > 0);
+            assert(total.total_bytes() == total.structure_bytes() + total.payload_bytes());
+
+            assert(report.types.size() == 2);
+            assert(report.types[0].name == "leaf" && report.types[0].footprint.nodes == 5);
+            assert(report.types[1].name == "composite" && report.types[1].footprint.nodes == 2);
+
+            // keyed composites also pay for their index
+            test_class_keyed_composite keyed(0);
+            test_class_composite plain(0);
+            for (int i = 0; i < 10; ++i)
+            {
+                keyed.push_back(smart_ptr(new test_class_leaf(i)));
+                plain.push_back(smart_ptr(new test_class_leaf(i)));
+            }
+            composite_object::memory_accounting<test_class_composite_interface> unregistered;
+            const auto keyed_report = unregistered.measure(keyed);
+            const auto plain_report = unregistered.measure(plain);
+            assert(keyed_report.unregistered_nodes == 11);
+            assert(keyed_report.total.structure_bytes() > plain_report.total.structure_bytes());
+            assert(keyed_report.total.inline_payload_bytes == 0);
+        }
+    };
+
+#ifdef COMPOSITE_OBJECT_TRACK_ALLOCATIONS
+    struct allocation_tracking : public test
+    {
+        const char * name() const override { return "Allocation tracking"; }
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+            using composite_object::allocation_category;
+
+            test_class_composite root;
+            composite_object::allocation_scope building;
+            for (int i = 0; i < 3; ++i)
+            {
+                root.push_back(smart_ptr(new test_class_composite(i)));
+                for (int j = 0; j < 4; ++j)
+                {
+                    root.rbegin()->get()->push_back(smart_ptr(new test_class_leaf(j)));
+                }
+            }
+            assert(building.stats().allocations_of(allocation_category::container_node) == 15);
+            assert(building.stats().bytes_of(allocation_category::container_node) >= 15 * sizeof(smart_ptr));
+
+            // one implementation per begin() and end(), one per copy
+            composite_object::allocation_scope linear;
+            int count = 0;
+            for (auto it = root.begin(); it != root.end(); ++it)
+            {
+                ++count;
+            }
+            auto first = root.begin();
+            auto copy = first;
+            assert(count == 3 && copy == first);
+            assert(linear.stats().allocations_of(allocation_category::iterator_impl) == 1 + 4 + 1);
+            assert(linear.stats().allocations_of(allocation_category::iterator_clone) == 1);
+            assert(linear.stats().allocations_of(allocation_category::container_node) == 0);
+
+            composite_object::allocation_scope depth_first;
+            for (auto it = root.df_pre_order_begin(); it != root.df_pre_order_end(); ++it)
+            {
+                ++count;
+            }
+            assert(depth_first.stats().allocations_of(allocation_category::traversal_stack) > 0);
+            assert(depth_first.stats().allocations_of(allocation_category::traversal_queue) == 0);
+
+            composite_object::allocation_scope breadth_first;
+            for (auto it = root.bf_begin(); it != root.bf_end(); ++it)
+            {
+                ++count;
+            }
+            assert(count == 3 + 15 + 15);
+            assert(breadth_first.stats().allocations_of(allocation_category::traversal_queue) > 0);
+
+            composite_object::allocation_stats::reset();
+            assert(composite_object::allocation_stats::current().total_allocations() == 0);
+        }
+    };
+#endif
+
+#ifdef COMPOSITE_OBJECT_TRAVERSAL_STATS
+    struct traversal_statistics : public test
+    {
+        const char * name() const override { return "Traversal statistics"; }
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            test_class_composite root;
+            for (int i = 0; i < 3; ++i)
+            {
+                root.push_back(smart_ptr(new test_class_composite(i)));
+                for (int j = 0; j < 4; ++j)
+                {
+                    root.rbegin()->get()->push_back(smart_ptr(new test_class_leaf(j)));
+                }
+            }
+
+            // not recorded outside of scopes
+            composite_object::traversal_stats::reset();
+            for (auto it = root.df_pre_order_begin(); it != root.df_pre_order_end(); ++it)
+            {
+            }
+            assert(composite_object::traversal_stats::current().nodes_visited == 0);
+
+            {
+                composite_object::traversal_stats_scope depth_first;
+                for (auto it = root.df_pre_order_begin(); it != root.df_pre_order_end(); ++it)
+                {
+                }
+                const auto stats = depth_first.stats();
+                assert(stats.nodes_visited == 15);
+                assert(stats.descents == 3);
+                assert(stats.max_depth == 2);
+                assert(stats.size_calls == 15);
+                assert(stats.iterator_allocations > 0);
+            }
+
+            {
+                composite_object::traversal_stats_scope breadth_first;
+                size_t post_order = 0;
+                {
+                    composite_object::traversal_stats_scope nested;
+                    for (auto it = root.df_post_order_begin(); it != root.df_post_order_end(); ++it)
+                    {
+                        ++post_order;
+                    }
+                    assert(nested.stats().nodes_visited == post_order);
+                }
+                for (auto it = root.bf_begin(); it != root.bf_end(); ++it)
+                {
+                }
+                const auto stats = breadth_first.stats();
+                assert(stats.nodes_visited == post_order + 15);
+                assert(stats.descents == 3 + 3);
+                assert(stats.max_depth == 4);
+            }
+            assert(!composite_object::traversal_stats::recording());
+        }
+    };
+#endif
+
+    // Hierarchies whose mutations are logged by the `mutation_hooks` specialization below.
+    class traced_interface : public test_class_interface
+    {
+    };
+
+    using traced_abstract = composite_object::abstract<traced_interface, composite_object::default_pointer_model>;
+
+    struct mutation_record
+    {
+        mutation_kind kind;
+        bool begin;
+        size_t nodes;
+
+        bool operator==(const mutation_record &another) const
+        {
+            return kind == another.kind && begin == another.begin && nodes == another.nodes;
+        }
+    };
+
+    inline std::vector<mutation_record> &mutation_log()
+    {
+        static std::vector<mutation_record> log;
+        return log;
+    }
+} // unittest
+
+template <>
+struct mutation_hooks<unittest::traced_abstract>
+{
+    static constexpr bool enabled = true;
+
+    static void begin(const mutation_kind kind, const unittest::traced_abstract &, const size_t nodes)
+    {
+        unittest::mutation_log().push_back({ kind, true, nodes });
+    }
+
+    static void end(const mutation_kind kind, const unittest::traced_abstract &, const size_t nodes)
+    {
+        unittest::mutation_log().push_back({ kind, false, nodes });
+    }
+};
+
+namespace unittest
+{
+    struct mutation_tracing : public test
+    {
+        const char * name() const override { return "Mutation tracing"; }
+
+        class traced_node : public traced_abstract
+        {
+        public:
+            int get_value() const override { return value; }
+            void set_value(int val) override { value = val; }
+
+        private:
+            int value{ 0 };
+        };
+
+        using traced_leaf = composite_object::leaf<traced_node>;
+        using traced_composite = composite_object::composite<traced_node>;
+
+        void run() override
+        {
+            using smart_ptr = traced_abstract::smart_ptr;
+            using log_type = std::vector<mutation_record>;
+            auto &log = mutation_log();
+
+            traced_composite root;
+            root.push_back(smart_ptr(new traced_composite()));
+            root.push_back(smart_ptr(new traced_composite()));
+            auto &a = *root.begin();
+            auto &b = *root.rbegin();
+            for (int i = 0; i < 3; ++i)
+            {
+                a->push_back(smart_ptr(new traced_leaf()));
+                a->rbegin()->get()->set_value(i);
+            }
+            assert(log.size() == 2 * 5);
+            assert((log[0] == mutation_record{ mutation_kind::push_back, true, 0 }));
+            assert((log[3] == mutation_record{ mutation_kind::push_back, false, 1 }));
+
+            // children of the copy are copied without nested events
+            log.clear();
+            std::unique_ptr<traced_abstract> copy(root.clone());
+            assert((log == log_type{ { mutation_kind::clone, true, 2 }, { mutation_kind::clone, false, 5 } }));
+
+            log.clear();
+            (*a->begin())->relocate_to(b);
+            assert((log == log_type{
+                { mutation_kind::relocate_to, true, 0 },
+                { mutation_kind::push_back, true, 0 },
+                { mutation_kind::push_back, false, 1 },
+                { mutation_kind::relocate_to, false, 1 } }));
+
+            log.clear();
+            auto odd = [](const smart_ptr &obj) { return obj->get_value() % 2 == 1; };
+            root.remove_if(odd);
+            assert((log == log_type{ { mutation_kind::remove_if, true, 2 }, { mutation_kind::remove_if, false, 1 } }));
+
+            log.clear();
+            root.clear();
+            assert((log == log_type{ { mutation_kind::clear, true, 2 }, { mutation_kind::clear, false, 2 } }));
+            log.clear();
+        }
+    };
+
+    struct resumable_traversal : public test
+    {
+        const char * name() const override { return "Resumable traversal"; }
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            test_class_composite root;
+            for (int i = 0; i < 3; ++i)
+            {
+                root.push_back(smart_ptr(new test_class_composite(10 * i)));
+                for (int j = 1; j <= 4; ++j)
+                {
+                    root.rbegin()->get()->push_back(smart_ptr(new test_class_leaf(10 * i + j)));
+                }
+            }
+
+            std::vector<int> expected;
+            for (auto it = root.df_pre_order_begin(); it != root.df_pre_order_end(); ++it)
+            {
+                expected.push_back((*it)->get_value());
+            }
+
+            std::vector<int> visited;
+            auto collect = [&visited](const smart_ptr &obj) { visited.push_back(obj->get_value()); };
+
+            composite_object::traversal_cursor<test_class_composite> cursor(root);
+            size_t steps = 0;
+            while (!cursor.done())
+            {
+                assert(cursor.step(collect, 4) <= 4);
+                ++steps;
+            }
+            assert(visited == expected && steps == 4);
+
+            // children appended ahead of the cursor are visited, behind it they are not
+            visited.clear();
+            cursor.reset();
+            assert(cursor.step(collect, 7) == 7);
+            auto first = root.begin()->get();
+            auto second = std::next(root.begin())->get();
+            first->push_back(smart_ptr(new test_class_leaf(5)));
+            second->push_back(smart_ptr(new test_class_leaf(15)));
+            root.push_back(smart_ptr(new test_class_leaf(30)));
+            cursor.step(collect, 1000);
+            assert(cursor.done());
+            expected.insert(expected.begin() + 10, 15);
+            expected.push_back(30);
+            assert(visited == expected);
+
+            // removed subtrees are not entered
+            visited.clear();
+            cursor.reset();
+            cursor.step(collect, 8);
+            assert(visited.back() == 11);
+            auto in_second = [](const smart_ptr &obj) { return obj->get_value() == 10; };
+            root.remove_if(in_second);
+            assert(cursor.step_for(collect, std::chrono::seconds(60)) > 0);
+            assert(cursor.done());
+            assert(std::find(visited.begin() + 8, visited.end(), 12) == visited.end());
+            assert(visited.back() == 30);
+
+            check_ordered<test_class_ordered_composite>();
+            check_ordered<test_class_multiset_ordered_composite>();
+        }
+
+        // Children inserted into ordered composites ahead of the cursor are visited, in front
+        // of it they are not, and nothing is visited twice.
+        template <class Composite>
+        static void check_ordered()
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            Composite dir(0);
+            for (int value : { 10, 20, 30, 40 })
+            {
+                dir.push_back(smart_ptr(new test_class_leaf(value)));
+            }
+
+            std::vector<int> visited;
+            auto collect = [&visited](const smart_ptr &obj) { visited.push_back(obj->get_value()); };
+
+            composite_object::traversal_cursor<Composite> cursor(dir);
+            assert(cursor.step(collect, 2) == 2);
+            dir.push_back(smart_ptr(new test_class_leaf(5)));
+            dir.push_back(smart_ptr(new test_class_leaf(25)));
+            cursor.step(collect, 1000);
+            assert(cursor.done());
+            assert((visited == std::vector<int>{ 10, 20, 25, 30, 40 }));
+
+            // at the end of a composite
+            visited.clear();
+            cursor.reset();
+            cursor.step(collect, 1000);
+            dir.push_back(smart_ptr(new test_class_leaf(1)));
+            dir.push_back(smart_ptr(new test_class_leaf(50)));
+            cursor.step(collect, 1000);
+            assert((visited == std::vector<int>{ 5, 10, 20, 25, 30, 40 }));
+        }
+    };
+
+    struct hot_cold_layout : public test
+    {
+        const char * name() const override { return "Hot/cold node layout"; }
+
+        struct record
+        {
+            int value{ 0 };
+            char description[256] = {};
+        };
+
+        class cold_impl : public test_class_composite_interface
+        {
+        public:
+            int get_value() const override { return payload->value; }
+            void set_value(int val) override { payload->value = val; }
+
+            composite_object::cold<record> payload;
+        };
+
+        using aligned_leaf = composite_object::leaf<composite_object::cache_aligned<cold_impl>>;
+        using aligned_composite = composite_object::composite<composite_object::cache_aligned<cold_impl>>;
+
+        void run() override
+        {
+            using smart_ptr = typename test_class_composite_interface::smart_ptr;
+
+            static_assert(sizeof(aligned_leaf) <= 64, "leaf nodes with a cold payload fit one cache line");
+
+            aligned_composite root;
+            for (int i = 0; i < 3; ++i)
+            {
+                root.push_back(smart_ptr(new aligned_composite()));
+                root.rbegin()->get()->set_value(i);
+                for (int j = 0; j < 4; ++j)
+                {
+                    root.rbegin()->get()->push_back(smart_ptr(new aligned_leaf()));
+                    root.rbegin()->get()->rbegin()->get()->set_value(10 * i + j);
+                }
+            }
+
+            std::unique_ptr<test_class_composite_interface> copy(root.clone());
+            std::vector<int> original_values, copied_values;
+            for (auto it = root.df_pre_order_begin(); it != root.df_pre_order_end(); ++it)
+            {
+                assert(reinterpret_cast<std::uintptr_t>(it->get()) % 64 == 0);
+                if ((*it)->is_leaf())
+                {
+                    original_values.push_back((*it)->get_value());
+                    (*it)->set_value(-1);
+                }
+            }
+            for (auto it = copy->df_pre_order_begin(); it != copy->df_pre_order_end(); ++it)
+            {
+                assert(reinterpret_cast<std::uintptr_t>(it->get()) % 64 == 0);
+                if ((*it)->is_leaf())
+                {
+                    copied_values.push_back((*it)->get_value());
+                }
+            }
+            assert(copied_values == original_values && copied_values.size() == 12);
+
+            composite_object::cold<record> moved(std::move(static_cast<cold_impl&>(root).payload));
+            assert(moved && !static_cast<cold_impl&>(root).payload);
+            assert(moved.heap_bytes() == sizeof(record) && static_cast<cold_impl&>(root).payload.heap_bytes() == 0);
+        }
+    };
+
     namespace iterators
     {
         struct hierarchy_basic_setup
@@ -1315,12 +3411,39 @@ namespace unittest
         tests.emplace_back(new remove_if_function());
         tests.emplace_back(new is_leaf_function());
         tests.emplace_back(new is_composite_function());
+        tests.emplace_back(new node_kind_flags());
         tests.emplace_back(new clear_function());
         tests.emplace_back(new size_function());
         tests.emplace_back(new nested_hierarchy_size_function());
         tests.emplace_back(new iterators_returning_functions());
         tests.emplace_back(new pointer_to_parent());
         tests.emplace_back(new relocate_to_function());
+        tests.emplace_back(new visitor_traversal());
+        tests.emplace_back(new keyed_composite_index());
+        tests.emplace_back(new ordered_children());
+        tests.emplace_back(new node_ids());
+        tests.emplace_back(new parallel_transform_reduce());
+        tests.emplace_back(new path_resolution());
+        tests.emplace_back(new change_notifications());
+        tests.emplace_back(new subtree_aggregates());
+        tests.emplace_back(new top_down_propagation());
+        tests.emplace_back(new concurrent_composite_locking());
+        tests.emplace_back(new versioned_snapshots());
+        tests.emplace_back(new append_only_children());
+        tests.emplace_back(new epoch_reclamation());
+        tests.emplace_back(new background_reclamation());
+        tests.emplace_back(new deep_hierarchies());
+        tests.emplace_back(new mixed_composite_classes());
+        tests.emplace_back(new memory_footprint_report());
+#ifdef COMPOSITE_OBJECT_TRACK_ALLOCATIONS
+        tests.emplace_back(new allocation_tracking());
+#endif
+#ifdef COMPOSITE_OBJECT_TRAVERSAL_STATS
+        tests.emplace_back(new traversal_statistics());
+#endif
+        tests.emplace_back(new mutation_tracing());
+        tests.emplace_back(new resumable_traversal());
+        tests.emplace_back(new hot_cold_layout());
 
         // Iterators checks
 